@@ -1,7 +1,37 @@
 #include "atomic.h"
 
+#if defined(_WIN32)
+
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#include <intrin.h>
+
+// Interlocked functions are full barriers, which satisfies every order.
+// Aligned loads and stores are atomic on their own. x86 and x64 keep them
+// in program order apart from a store followed by a load, so acquire and
+// release only need to stop the compiler reordering; other processors
+// need a hardware fence.
+#if defined(_M_IX86) || defined(_M_X64)
+#define atomic_ordering_barrier() _ReadWriteBarrier()
+#else
+#define atomic_ordering_barrier() MemoryBarrier()
+#endif
+
+static void atomic_barrier_after_load(atomic_order_t order)
+{
+	if (order != k_atomic_relaxed && order != k_atomic_release)
+	{
+		atomic_ordering_barrier();
+	}
+}
+
+static void atomic_barrier_before_store(atomic_order_t order)
+{
+	if (order != k_atomic_relaxed && order != k_atomic_acquire)
+	{
+		atomic_ordering_barrier();
+	}
+}
 
 int atomic_increment(int* address)
 {
@@ -13,17 +43,434 @@ int atomic_decrement(int* address)
 	return InterlockedDecrement(address) + 1;
 }
 
+int atomic_add(int* address, int value)
+{
+	return InterlockedExchangeAdd(address, value);
+}
+
 int atomic_compare_and_exchange(int* dest, int compare, int exchange)
 {
 	return InterlockedCompareExchange(dest, exchange, compare);
 }
 
+int atomic_exchange(int* address, int value)
+{
+	return InterlockedExchange(address, value);
+}
+
+int64_t atomic_add64(int64_t* address, int64_t value)
+{
+	return InterlockedExchangeAdd64(address, value);
+}
+
+int64_t atomic_compare_and_exchange64(int64_t* dest, int64_t compare, int64_t exchange)
+{
+	return InterlockedCompareExchange64(dest, exchange, compare);
+}
+
+#if defined(_M_X64) || defined(_M_ARM64)
+
+bool atomic_compare_and_exchange128(int64_t* dest, int64_t* compare, const int64_t* exchange)
+{
+	return InterlockedCompareExchange128(dest, exchange[1], exchange[0], compare) != 0;
+}
+
+#else
+
+// 32-bit targets have no 16-byte compare-and-exchange, so the pair is
+// compared and assigned under a lock. Still atomic with respect to other
+// calls here, which are the only writers the pair may have; plain reads
+// of it can tear, but a torn compare value only makes the exchange fail.
+static LONG s_atomic_pair_lock;
+
+bool atomic_compare_and_exchange128(int64_t* dest, int64_t* compare, const int64_t* exchange)
+{
+	while (InterlockedCompareExchange(&s_atomic_pair_lock, 1, 0) != 0)
+	{
+		YieldProcessor();
+	}
+	bool exchanged = dest[0] == compare[0] && dest[1] == compare[1];
+	if (exchanged)
+	{
+		dest[0] = exchange[0];
+		dest[1] = exchange[1];
+	}
+	else
+	{
+		compare[0] = dest[0];
+		compare[1] = dest[1];
+	}
+	InterlockedExchange(&s_atomic_pair_lock, 0);
+	return exchanged;
+}
+
+#endif
+
+void* atomic_exchange_pointer(void** address, void* value)
+{
+	return InterlockedExchangePointer(address, value);
+}
+
+void* atomic_compare_and_exchange_pointer(void** dest, void* compare, void* exchange)
+{
+	return InterlockedCompareExchangePointer(dest, exchange, compare);
+}
+
+int atomic_load_explicit(int* address, atomic_order_t order)
+{
+	int value = *(volatile int*)address;
+	atomic_barrier_after_load(order);
+	return value;
+}
+
+void atomic_store_explicit(int* address, int value, atomic_order_t order)
+{
+	if (order == k_atomic_seq_cst)
+	{
+		InterlockedExchange((volatile LONG*)address, value);
+		return;
+	}
+	atomic_barrier_before_store(order);
+	*(volatile int*)address = value;
+}
+
+int atomic_exchange_explicit(int* address, int value, atomic_order_t order)
+{
+	return InterlockedExchange((volatile LONG*)address, value);
+}
+
+int atomic_compare_and_exchange_explicit(int* dest, int compare, int exchange, atomic_order_t order)
+{
+	return InterlockedCompareExchange((volatile LONG*)dest, exchange, compare);
+}
+
+int atomic_fetch_add_explicit(int* address, int value, atomic_order_t order)
+{
+	return InterlockedExchangeAdd((volatile LONG*)address, value);
+}
+
+int atomic_fetch_or_explicit(int* address, int value, atomic_order_t order)
+{
+	return InterlockedOr((volatile LONG*)address, value);
+}
+
+int atomic_fetch_and_explicit(int* address, int value, atomic_order_t order)
+{
+	return InterlockedAnd((volatile LONG*)address, value);
+}
+
+int64_t atomic_load64_explicit(int64_t* address, atomic_order_t order)
+{
+#if defined(_M_IX86)
+	// 32-bit x86 has no plain 64-bit atomic load.
+	return InterlockedCompareExchange64(address, 0, 0);
+#else
+	int64_t value = *(volatile int64_t*)address;
+	atomic_barrier_after_load(order);
+	return value;
+#endif
+}
+
+void atomic_store64_explicit(int64_t* address, int64_t value, atomic_order_t order)
+{
+#if defined(_M_IX86)
+	InterlockedExchange64(address, value);
+#else
+	if (order == k_atomic_seq_cst)
+	{
+		InterlockedExchange64(address, value);
+		return;
+	}
+	atomic_barrier_before_store(order);
+	*(volatile int64_t*)address = value;
+#endif
+}
+
+int64_t atomic_exchange64_explicit(int64_t* address, int64_t value, atomic_order_t order)
+{
+	return InterlockedExchange64(address, value);
+}
+
+int64_t atomic_compare_and_exchange64_explicit(int64_t* dest, int64_t compare, int64_t exchange, atomic_order_t order)
+{
+	return InterlockedCompareExchange64(dest, exchange, compare);
+}
+
+int64_t atomic_fetch_add64_explicit(int64_t* address, int64_t value, atomic_order_t order)
+{
+	return InterlockedExchangeAdd64(address, value);
+}
+
+int64_t atomic_fetch_or64_explicit(int64_t* address, int64_t value, atomic_order_t order)
+{
+	return InterlockedOr64(address, value);
+}
+
+int64_t atomic_fetch_and64_explicit(int64_t* address, int64_t value, atomic_order_t order)
+{
+	return InterlockedAnd64(address, value);
+}
+
+void* atomic_load_pointer_explicit(void** address, atomic_order_t order)
+{
+	void* value = *(void* volatile*)address;
+	atomic_barrier_after_load(order);
+	return value;
+}
+
+void atomic_store_pointer_explicit(void** address, void* value, atomic_order_t order)
+{
+	if (order == k_atomic_seq_cst)
+	{
+		InterlockedExchangePointer(address, value);
+		return;
+	}
+	atomic_barrier_before_store(order);
+	*(void* volatile*)address = value;
+}
+
+void* atomic_exchange_pointer_explicit(void** address, void* value, atomic_order_t order)
+{
+	return InterlockedExchangePointer(address, value);
+}
+
+void* atomic_compare_and_exchange_pointer_explicit(void** dest, void* compare, void* exchange, atomic_order_t order)
+{
+	return InterlockedCompareExchangePointer(dest, exchange, compare);
+}
+
+void atomic_thread_fence(atomic_order_t order)
+{
+	if (order == k_atomic_seq_cst)
+	{
+		MemoryBarrier();
+	}
+	else if (order != k_atomic_relaxed)
+	{
+		atomic_ordering_barrier();
+	}
+}
+
+#else
+
+// The builtins only honor an order known at compile time, and reject
+// orders that make no sense for the operation, so each valid order gets
+// its own call and the rest are strengthened.
+#define atomic_load_ordered(address, order) \
+	((order) == k_atomic_relaxed ? __atomic_load_n((address), __ATOMIC_RELAXED) : \
+	(order) == k_atomic_acquire ? __atomic_load_n((address), __ATOMIC_ACQUIRE) : \
+	__atomic_load_n((address), __ATOMIC_SEQ_CST))
+
+#define atomic_store_ordered(address, value, order) \
+	((order) == k_atomic_relaxed ? __atomic_store_n((address), (value), __ATOMIC_RELAXED) : \
+	(order) == k_atomic_release || (order) == k_atomic_acq_rel ? __atomic_store_n((address), (value), __ATOMIC_RELEASE) : \
+	__atomic_store_n((address), (value), __ATOMIC_SEQ_CST))
+
+#define atomic_rmw_ordered(builtin, address, value, order) \
+	((order) == k_atomic_relaxed ? builtin((address), (value), __ATOMIC_RELAXED) : \
+	(order) == k_atomic_acquire ? builtin((address), (value), __ATOMIC_ACQUIRE) : \
+	(order) == k_atomic_release ? builtin((address), (value), __ATOMIC_RELEASE) : \
+	(order) == k_atomic_acq_rel ? builtin((address), (value), __ATOMIC_ACQ_REL) : \
+	builtin((address), (value), __ATOMIC_SEQ_CST))
+
+// A failed compare is only a load, so it takes the acquire part of the order.
+#define atomic_cas_ordered(dest, compare, exchange, order) \
+	((order) == k_atomic_relaxed ? __atomic_compare_exchange_n((dest), (compare), (exchange), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) : \
+	(order) == k_atomic_acquire ? __atomic_compare_exchange_n((dest), (compare), (exchange), 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE) : \
+	(order) == k_atomic_release ? __atomic_compare_exchange_n((dest), (compare), (exchange), 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED) : \
+	(order) == k_atomic_acq_rel ? __atomic_compare_exchange_n((dest), (compare), (exchange), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) : \
+	__atomic_compare_exchange_n((dest), (compare), (exchange), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+
+int atomic_increment(int* address)
+{
+	return __atomic_fetch_add(address, 1, __ATOMIC_SEQ_CST);
+}
+
+int atomic_decrement(int* address)
+{
+	return __atomic_fetch_sub(address, 1, __ATOMIC_SEQ_CST);
+}
+
+int atomic_add(int* address, int value)
+{
+	return __atomic_fetch_add(address, value, __ATOMIC_SEQ_CST);
+}
+
+int atomic_compare_and_exchange(int* dest, int compare, int exchange)
+{
+	__atomic_compare_exchange_n(dest, &compare, exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return compare;
+}
+
+int atomic_exchange(int* address, int value)
+{
+	return __atomic_exchange_n(address, value, __ATOMIC_SEQ_CST);
+}
+
+int64_t atomic_add64(int64_t* address, int64_t value)
+{
+	return __atomic_fetch_add(address, value, __ATOMIC_SEQ_CST);
+}
+
+int64_t atomic_compare_and_exchange64(int64_t* dest, int64_t compare, int64_t exchange)
+{
+	__atomic_compare_exchange_n(dest, &compare, exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return compare;
+}
+
+bool atomic_compare_and_exchange128(int64_t* dest, int64_t* compare, const int64_t* exchange)
+{
+#if defined(__x86_64__)
+	// Spelled out so x64 builds need neither -mcx16 nor libatomic.
+	// Other targets get the builtin, which may call into libatomic; link with -latomic.
+	bool exchanged;
+	__asm__ __volatile__("lock cmpxchg16b %1"
+		: "=@ccz"(exchanged), "+m"(*(unsigned __int128*)dest), "+a"(compare[0]), "+d"(compare[1])
+		: "b"(exchange[0]), "c"(exchange[1])
+		: "memory");
+	return exchanged;
+#else
+	return __atomic_compare_exchange((unsigned __int128*)dest, (unsigned __int128*)compare, (unsigned __int128*)exchange,
+		0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+}
+
+void* atomic_exchange_pointer(void** address, void* value)
+{
+	return __atomic_exchange_n(address, value, __ATOMIC_SEQ_CST);
+}
+
+void* atomic_compare_and_exchange_pointer(void** dest, void* compare, void* exchange)
+{
+	__atomic_compare_exchange_n(dest, &compare, exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return compare;
+}
+
+int atomic_load_explicit(int* address, atomic_order_t order)
+{
+	return atomic_load_ordered(address, order);
+}
+
+void atomic_store_explicit(int* address, int value, atomic_order_t order)
+{
+	atomic_store_ordered(address, value, order);
+}
+
+int atomic_exchange_explicit(int* address, int value, atomic_order_t order)
+{
+	return atomic_rmw_ordered(__atomic_exchange_n, address, value, order);
+}
+
+int atomic_compare_and_exchange_explicit(int* dest, int compare, int exchange, atomic_order_t order)
+{
+	atomic_cas_ordered(dest, &compare, exchange, order);
+	return compare;
+}
+
+int atomic_fetch_add_explicit(int* address, int value, atomic_order_t order)
+{
+	return atomic_rmw_ordered(__atomic_fetch_add, address, value, order);
+}
+
+int atomic_fetch_or_explicit(int* address, int value, atomic_order_t order)
+{
+	return atomic_rmw_ordered(__atomic_fetch_or, address, value, order);
+}
+
+int atomic_fetch_and_explicit(int* address, int value, atomic_order_t order)
+{
+	return atomic_rmw_ordered(__atomic_fetch_and, address, value, order);
+}
+
+int64_t atomic_load64_explicit(int64_t* address, atomic_order_t order)
+{
+	return atomic_load_ordered(address, order);
+}
+
+void atomic_store64_explicit(int64_t* address, int64_t value, atomic_order_t order)
+{
+	atomic_store_ordered(address, value, order);
+}
+
+int64_t atomic_exchange64_explicit(int64_t* address, int64_t value, atomic_order_t order)
+{
+	return atomic_rmw_ordered(__atomic_exchange_n, address, value, order);
+}
+
+int64_t atomic_compare_and_exchange64_explicit(int64_t* dest, int64_t compare, int64_t exchange, atomic_order_t order)
+{
+	atomic_cas_ordered(dest, &compare, exchange, order);
+	return compare;
+}
+
+int64_t atomic_fetch_add64_explicit(int64_t* address, int64_t value, atomic_order_t order)
+{
+	return atomic_rmw_ordered(__atomic_fetch_add, address, value, order);
+}
+
+int64_t atomic_fetch_or64_explicit(int64_t* address, int64_t value, atomic_order_t order)
+{
+	return atomic_rmw_ordered(__atomic_fetch_or, address, value, order);
+}
+
+int64_t atomic_fetch_and64_explicit(int64_t* address, int64_t value, atomic_order_t order)
+{
+	return atomic_rmw_ordered(__atomic_fetch_and, address, value, order);
+}
+
+void* atomic_load_pointer_explicit(void** address, atomic_order_t order)
+{
+	return atomic_load_ordered(address, order);
+}
+
+void atomic_store_pointer_explicit(void** address, void* value, atomic_order_t order)
+{
+	atomic_store_ordered(address, value, order);
+}
+
+void* atomic_exchange_pointer_explicit(void** address, void* value, atomic_order_t order)
+{
+	return atomic_rmw_ordered(__atomic_exchange_n, address, value, order);
+}
+
+void* atomic_compare_and_exchange_pointer_explicit(void** dest, void* compare, void* exchange, atomic_order_t order)
+{
+	atomic_cas_ordered(dest, &compare, exchange, order);
+	return compare;
+}
+
+void atomic_thread_fence(atomic_order_t order)
+{
+	if (order == k_atomic_relaxed)
+	{
+		return;
+	}
+	if (order == k_atomic_acquire)
+	{
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	}
+	else if (order == k_atomic_release)
+	{
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+	else if (order == k_atomic_acq_rel)
+	{
+		__atomic_thread_fence(__ATOMIC_ACQ_REL);
+	}
+	else
+	{
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+}
+
+#endif
+
 int atomic_load(int* address)
 {
-	return *(volatile int*)address;
+	return atomic_load_explicit(address, k_atomic_acquire);
 }
 
 void atomic_store(int* address, int value)
 {
-	*(volatile int*)address = value;
+	atomic_store_explicit(address, value, k_atomic_release);
 }
@@ -1,6 +1,30 @@
 #pragma once
 
-// Atomic operations on 32-bit integers.
+#include <stdbool.h>
+#include <stdint.h>
+
+// Atomic operations on integers and pointers.
+//
+// Operations without an order argument are sequentially consistent,
+// except atomic_load and atomic_store, which acquire and release.
+// The _explicit variants take the weakest order the caller needs.
+// Built on Interlocked functions on Windows and __atomic builtins elsewhere.
+
+// Memory ordering of an atomic operation, as in C11.
+typedef enum atomic_order_t
+{
+	// Atomic, but orders no other memory access.
+	k_atomic_relaxed,
+	// Later accesses on this thread stay after a load.
+	// Pairs with a release to see everything written before it.
+	k_atomic_acquire,
+	// Earlier accesses on this thread stay before a store.
+	k_atomic_release,
+	// Both acquire and release; for read-modify-write operations.
+	k_atomic_acq_rel,
+	// Acquire and release, plus one total order of all such operations.
+	k_atomic_seq_cst,
+} atomic_order_t;
 
 // Increment a number atomically.
 // Returns the old value of the number.
@@ -14,16 +38,98 @@ int atomic_increment(int* address);
 //   int old_value = *address; (*address)--; return old_value;
 int atomic_decrement(int* address);
 
+// Add to a number atomically.
+// Returns the old value of the number.
+// Performs the following operation atomically:
+//   int old_value = *address; (*address) += value; return old_value;
+int atomic_add(int* address, int value);
+
 // Compare two numbers atomically and assign if equal.
 // Returns the old value of the number.
 // Performs the following operation atomically:
 //   int old_value = *address; if (*address == compare) *address = exchange; return old_value;
 int atomic_compare_and_exchange(int* dest, int compare, int exchange);
 
+// Exchange a number atomically.
+// Returns the old value of the number.
+// Performs the following operation atomically:
+//   int old_value = *address; *address = value; return old_value;
+int atomic_exchange(int* address, int value);
+
+// Add to a 64-bit number atomically.
+// Returns the old value of the number.
+int64_t atomic_add64(int64_t* address, int64_t value);
+
+// Compare two 64-bit numbers atomically and assign if equal.
+// Returns the old value of the number.
+int64_t atomic_compare_and_exchange64(int64_t* dest, int64_t compare, int64_t exchange);
+
+// Compare a pair of 64-bit numbers atomically and assign both if equal.
+// Dest must be 16-byte aligned. Compare and exchange each point to a pair.
+// Returns true if assigned. Otherwise returns false and stores the current pair in compare.
+// Lets a pointer be swapped along with a tag that changes on every update.
+// Lock-free on x64 and ARM64. On 32-bit Windows it takes a global spin lock,
+// and on other POSIX targets it may need linking with -latomic.
+bool atomic_compare_and_exchange128(int64_t* dest, int64_t* compare, const int64_t* exchange);
+
+// Exchange a pointer atomically.
+// Returns the old value of the pointer.
+// Performs the following operation atomically:
+//   void* old_value = *address; *address = value; return old_value;
+void* atomic_exchange_pointer(void** address, void* value);
+
+// Compare two pointers atomically and assign if equal.
+// Returns the old value of the pointer.
+// Performs the following operation atomically:
+//   void* old_value = *address; if (*address == compare) *address = exchange; return old_value;
+void* atomic_compare_and_exchange_pointer(void** dest, void* compare, void* exchange);
+
 // Reads an integer from an address.
-// All writes that occurred before the last atomic_store to this address are flushed.
+// Acquires: sees everything written before the atomic_store that wrote the value.
 int atomic_load(int* address);
 
 // Writes an integer.
-// Paired with an atomic_load, can guarantee ordering and visibility.
+// Releases: an atomic_load that reads the value sees everything written before.
 void atomic_store(int* address, int value);
+
+// Reads an integer with the given order: relaxed, acquire or seq_cst.
+int atomic_load_explicit(int* address, atomic_order_t order);
+
+// Writes an integer with the given order: relaxed, release or seq_cst.
+void atomic_store_explicit(int* address, int value, atomic_order_t order);
+
+// Exchanges an integer. Returns the old value.
+int atomic_exchange_explicit(int* address, int value, atomic_order_t order);
+
+// Compares an integer and assigns if equal. Returns the old value.
+// A failed compare orders only as a load would.
+int atomic_compare_and_exchange_explicit(int* dest, int compare, int exchange, atomic_order_t order);
+
+// Adds to an integer. Returns the old value.
+int atomic_fetch_add_explicit(int* address, int value, atomic_order_t order);
+
+// Bitwise ors an integer. Returns the old value.
+int atomic_fetch_or_explicit(int* address, int value, atomic_order_t order);
+
+// Bitwise ands an integer. Returns the old value.
+int atomic_fetch_and_explicit(int* address, int value, atomic_order_t order);
+
+// 64-bit variants of the integer operations above.
+int64_t atomic_load64_explicit(int64_t* address, atomic_order_t order);
+void atomic_store64_explicit(int64_t* address, int64_t value, atomic_order_t order);
+int64_t atomic_exchange64_explicit(int64_t* address, int64_t value, atomic_order_t order);
+int64_t atomic_compare_and_exchange64_explicit(int64_t* dest, int64_t compare, int64_t exchange, atomic_order_t order);
+int64_t atomic_fetch_add64_explicit(int64_t* address, int64_t value, atomic_order_t order);
+int64_t atomic_fetch_or64_explicit(int64_t* address, int64_t value, atomic_order_t order);
+int64_t atomic_fetch_and64_explicit(int64_t* address, int64_t value, atomic_order_t order);
+
+// Pointer variants of the integer operations above.
+void* atomic_load_pointer_explicit(void** address, atomic_order_t order);
+void atomic_store_pointer_explicit(void** address, void* value, atomic_order_t order);
+void* atomic_exchange_pointer_explicit(void** address, void* value, atomic_order_t order);
+void* atomic_compare_and_exchange_pointer_explicit(void** dest, void* compare, void* exchange, atomic_order_t order);
+
+// Orders memory accesses around the fence without accessing memory itself.
+// A release fence before a relaxed store, or an acquire fence after a relaxed
+// load, orders like a release store or acquire load.
+void atomic_thread_fence(atomic_order_t order);
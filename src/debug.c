@@ -2,13 +2,20 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 
+#if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <DbgHelp.h>
+#else
+#include <execinfo.h>
+#endif
 
 static uint32_t s_mask = 0xffffffff;
 
+#if defined(_WIN32)
+
 static LONG debug_exception_handler(LPEXCEPTION_POINTERS info)
 {
 	// XXX: MS uses 0xE06D7363 to indicate C++ language exception.
@@ -48,6 +55,15 @@ void debug_install_exception_handler()
 	AddVectoredExceptionHandler(TRUE, debug_exception_handler);
 }
 
+#else
+
+void debug_install_exception_handler()
+{
+	// Crash dumps are left to the OS.
+}
+
+#endif
+
 void debug_set_print_mask(uint32_t mask)
 {
 	s_mask = mask;
@@ -66,15 +82,31 @@ void debug_print(uint32_t type, _Printf_format_string_ const char* format, ...)
 	vsnprintf(buffer, sizeof(buffer), format, args);
 	va_end(args);
 
+#if defined(_WIN32)
 	OutputDebugStringA(buffer);
 
 	DWORD bytes = (DWORD)strlen(buffer);
 	DWORD written = 0;
 	HANDLE out = GetStdHandle(STD_OUTPUT_HANDLE);
 	WriteConsoleA(out, buffer, bytes, &written, NULL);
+#else
+	fputs(buffer, stdout);
+#endif
 }
 
 int debug_backtrace(void** stack, int stack_capacity)
 {
+#if defined(_WIN32)
 	return CaptureStackBackTrace(1, stack_capacity, stack, NULL);
+#else
+	// Skip this function's own frame to match the Windows behavior.
+	void* frames[64 + 1];
+	int count = backtrace(frames, stack_capacity + 1 < 65 ? stack_capacity + 1 : 65);
+	if (count <= 1)
+	{
+		return 0;
+	}
+	memcpy(stack, frames + 1, (count - 1) * sizeof(void*));
+	return count - 1;
+#endif
 }
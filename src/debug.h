@@ -2,6 +2,10 @@
 
 #include <stdint.h>
 
+#if !defined(_MSC_VER)
+#define _Printf_format_string_
+#endif
+
 // Debugging Support
 
 // Flags for debug_print().
@@ -3,6 +3,7 @@
 #include "debug.h"
 #include "heap.h"
 #include "fs.h"
+#include "job.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -11,6 +12,9 @@ enum
 {
 	k_max_component_types = 64,
 	k_max_entities = 512,
+	// Parallel queries split into at most this many jobs.
+	k_max_parallel_chunks = 64,
+	k_default_parallel_grain = 64,
 };
 
 typedef enum entity_state_t
@@ -34,8 +38,23 @@ typedef struct ecs_t
 	size_t component_type_sizes[k_max_component_types];
 	char component_type_names[k_max_component_types][32];
 	bool save_component[k_max_component_types];
+
+	job_system_t* jobs;
 } ecs_t;
 
+typedef struct ecs_parallel_chunk_t
+{
+	ecs_t* ecs;
+	uint64_t mask;
+	void (*function)(ecs_t* ecs, ecs_query_t* query, void* user);
+	void* user;
+	int begin;
+	int end;
+} ecs_parallel_chunk_t;
+
+static bool ecs_entity_matches(ecs_t* ecs, int entity, uint64_t mask);
+static void ecs_parallel_chunk(void* data);
+
 // there was a smarter way to do this that was discussed in class.
 // naturally, i don't remember it, and google has been unhelpful
 // so we get to do it the stupid way
@@ -55,7 +74,7 @@ void ecs_save_game(heap_t* heap, ecs_t* ecs, fs_t* fs)
 		if (ecs->save_component[i]) size += (k_max_entities * ecs->component_type_sizes[i]);
 	}
 
-	char* data = heap_alloc(heap, size, 8);
+	char* data = heap_alloc_tagged(heap, size, 8, k_heap_tag_ecs);
 
 	// keeps track of where we are in the file
 	size_t ctr = 0;
@@ -105,7 +124,7 @@ void ecs_save_game(heap_t* heap, ecs_t* ecs, fs_t* fs)
 	}
 
 	fs_work_t* work = fs_write(fs, "savegame", data, size, false);
-	fs_work_wait(work);
+	fs_work_wait_job(work, ecs->jobs);
 	fs_work_destroy(work);
 	heap_free(heap, data);
 }
@@ -120,7 +139,7 @@ void ecs_load_game(heap_t* heap, ecs_t* ecs, fs_t* fs)
 	}
 
 	fs_work_t* work = fs_read(fs, "savegame", heap, false, false);
-	fs_work_wait(work);
+	fs_work_wait_job(work, ecs->jobs);
 	if (fs_work_get_result(work) != 0) return;
 	char* data = (char*) fs_work_get_buffer(work);
 
@@ -191,7 +210,7 @@ void ecs_load_game(heap_t* heap, ecs_t* ecs, fs_t* fs)
 
 ecs_t* ecs_create(heap_t* heap)
 {
-	ecs_t* ecs = heap_alloc(heap, sizeof(ecs_t), 8);
+	ecs_t* ecs = heap_alloc_tagged(heap, sizeof(ecs_t), 8, k_heap_tag_ecs);
 	memset(ecs, 0, sizeof(*ecs));
 	ecs->heap = heap;
 	ecs->global_sequence = 1;
@@ -210,6 +229,16 @@ void ecs_destroy(ecs_t* ecs)
 	heap_free(ecs->heap, ecs);
 }
 
+void ecs_set_job_system(ecs_t* ecs, job_system_t* jobs)
+{
+	ecs->jobs = jobs;
+}
+
+int ecs_get_entity_capacity(ecs_t* ecs)
+{
+	return k_max_entities;
+}
+
 void ecs_update(ecs_t* ecs)
 {
 	for (int i = 0; i < _countof(ecs->entity_states); ++i)
@@ -234,7 +263,7 @@ int ecs_register_component_type(ecs_t* ecs, const char* name, size_t size_per_co
 			size_t aligned_size = (size_per_component + (alignment - 1)) & ~(alignment - 1);
 			strcpy_s(ecs->component_type_names[i], sizeof(ecs->component_type_names[i]), name);
 			ecs->component_type_sizes[i] = aligned_size;
-			ecs->components[i] = heap_alloc(ecs->heap, aligned_size * k_max_entities, alignment);
+			ecs->components[i] = heap_alloc_tagged(ecs->heap, aligned_size * k_max_entities, alignment, k_heap_tag_ecs);
 			memset(ecs->components[i], 0, aligned_size * k_max_entities);
 			ecs->save_component[i] = save;
 			return i;
@@ -310,7 +339,7 @@ void ecs_query_next(ecs_t* ecs, ecs_query_t* query)
 {
 	for (int i = query->entity + 1; i < _countof(ecs->component_masks); ++i)
 	{
-		if ((ecs->component_masks[i] & query->component_mask) == query->component_mask && ecs->entity_states[i] >= k_entity_active)
+		if (ecs_entity_matches(ecs, i, query->component_mask))
 		{
 			query->entity = i;
 			return;
@@ -329,3 +358,66 @@ ecs_entity_ref_t ecs_query_get_entity(ecs_t* ecs, ecs_query_t* query)
 {
 	return (ecs_entity_ref_t) { .entity = query->entity, .sequence = ecs->sequences[query->entity] };
 }
+
+void ecs_query_parallel_for(ecs_t* ecs, uint64_t mask, void (*function)(ecs_t* ecs, ecs_query_t* query, void* user), void* user, int grain)
+{
+	if (grain <= 0)
+	{
+		grain = k_default_parallel_grain;
+	}
+	if (grain < k_max_entities / k_max_parallel_chunks)
+	{
+		grain = k_max_entities / k_max_parallel_chunks;
+	}
+
+	ecs_parallel_chunk_t chunks[k_max_parallel_chunks];
+	int chunk_count = 0;
+	for (int begin = 0; begin < k_max_entities; begin += grain)
+	{
+		ecs_parallel_chunk_t* chunk = &chunks[chunk_count++];
+		chunk->ecs = ecs;
+		chunk->mask = mask;
+		chunk->function = function;
+		chunk->user = user;
+		chunk->begin = begin;
+		chunk->end = begin + grain < k_max_entities ? begin + grain : k_max_entities;
+	}
+
+	if (!ecs->jobs || chunk_count == 1)
+	{
+		for (int i = 0; i < chunk_count; ++i)
+		{
+			ecs_parallel_chunk(&chunks[i]);
+		}
+		return;
+	}
+
+	// The calling thread takes the first chunk rather than idling until the barrier.
+	job_counter_t* counter = job_counter_create(ecs->jobs);
+	for (int i = 1; i < chunk_count; ++i)
+	{
+		job_run(ecs->jobs, ecs_parallel_chunk, &chunks[i], counter);
+	}
+	ecs_parallel_chunk(&chunks[0]);
+	job_wait(ecs->jobs, counter);
+	job_counter_destroy(counter);
+}
+
+static bool ecs_entity_matches(ecs_t* ecs, int entity, uint64_t mask)
+{
+	return (ecs->component_masks[entity] & mask) == mask && ecs->entity_states[entity] >= k_entity_active;
+}
+
+static void ecs_parallel_chunk(void* data)
+{
+	ecs_parallel_chunk_t* chunk = data;
+	ecs_query_t query = { .component_mask = chunk->mask };
+	for (int i = chunk->begin; i < chunk->end; ++i)
+	{
+		if (ecs_entity_matches(chunk->ecs, i, chunk->mask))
+		{
+			query.entity = i;
+			chunk->function(chunk->ecs, &query, chunk->user);
+		}
+	}
+}
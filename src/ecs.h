@@ -9,6 +9,7 @@
 #include <stdint.h>
 
 typedef struct heap_t heap_t;
+typedef struct job_system_t job_system_t;
 
 // Handle to an entity component system interface.
 typedef struct ecs_t ecs_t;
@@ -37,6 +38,13 @@ ecs_t* ecs_create(heap_t* heap);
 // Destroy an entity component system.
 void ecs_destroy(ecs_t* ecs);
 
+// Set the job system that parallel queries run on.
+// Without one, parallel queries run serially on the calling thread.
+void ecs_set_job_system(ecs_t* ecs, job_system_t* jobs);
+
+// Get the maximum number of entities; entity indices are below this.
+int ecs_get_entity_capacity(ecs_t* ecs);
+
 // Per-frame entity component system update.
 void ecs_update(ecs_t* ecs);
 
@@ -76,3 +84,10 @@ void* ecs_query_get_component(ecs_t* ecs, ecs_query_t* query, int component_type
 
 // Get a entity reference for the current query location.
 ecs_entity_ref_t ecs_query_get_entity(ecs_t* ecs, ecs_query_t* query);
+
+// Call function for every entity matching the component type mask, in parallel.
+// The entity index range is split into chunks of grain entities, each run as a job;
+// pass zero for a default grain. Returns once every chunk has finished.
+// Function is called with a query pointing at one entity; it may change that
+// entity's components but must not add or remove entities.
+void ecs_query_parallel_for(ecs_t* ecs, uint64_t mask, void (*function)(ecs_t* ecs, ecs_query_t* query, void* user), void* user, int grain);
@@ -1,30 +1,90 @@
 #include "event.h"
 
+#include "atomic.h"
+#include "futex.h"
+
+#include <stdlib.h>
+
+#if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#define event_pause() YieldProcessor()
+#elif defined(__x86_64__) || defined(__i386__)
+#define event_pause() __builtin_ia32_pause()
+#else
+#define event_pause()
+#endif
+
+enum
+{
+	// Polls of an unraised event before sleeping.
+	k_event_spin_count = 64,
+};
+
+typedef enum event_state_t
+{
+	k_event_lowered,
+	k_event_raised,
+	// Not raised, and threads may be sleeping on the state.
+	k_event_waited,
+} event_state_t;
+
+// Manual reset event: once signaled it stays raised.
+// Checking it is a plain load; the kernel is only entered to sleep on an
+// unraised event, or to wake sleepers when it is signaled.
+typedef struct event_t
+{
+	int state;
+} event_t;
 
 event_t* event_create()
 {
-	HANDLE evt = CreateEvent(NULL, TRUE, FALSE, NULL);
-	return (event_t*)evt;
+	event_t* event = malloc(sizeof(event_t));
+	event->state = k_event_lowered;
+	return event;
 }
 
 void event_destroy(event_t* event)
 {
-	CloseHandle(event);
+	free(event);
 }
 
 void event_signal(event_t* event)
 {
-	SetEvent(event);
+	if (atomic_exchange(&event->state, k_event_raised) == k_event_waited)
+	{
+		futex_wake_all(&event->state);
+	}
 }
 
 void event_wait(event_t* event)
 {
-	WaitForSingleObject(event, INFINITE);
+	for (int i = 0; i < k_event_spin_count; ++i)
+	{
+		if (atomic_load(&event->state) == k_event_raised)
+		{
+			return;
+		}
+		event_pause();
+	}
+
+	while (true)
+	{
+		int state = atomic_load(&event->state);
+		if (state == k_event_raised)
+		{
+			return;
+		}
+		if (state == k_event_lowered &&
+			atomic_compare_and_exchange(&event->state, k_event_lowered, k_event_waited) != k_event_lowered)
+		{
+			continue;
+		}
+		futex_wait(&event->state, k_event_waited);
+	}
 }
 
 bool event_is_raised(event_t* event)
 {
-	return WaitForSingleObject(event, 0) == WAIT_OBJECT_0;
+	return atomic_load(&event->state) == k_event_raised;
 }
@@ -3,6 +3,9 @@
 #include <stdbool.h>
 
 // Event thread synchronization
+//
+// Checking an event never enters the kernel; waiting on an unraised one
+// spins briefly, then sleeps on a futex.
 
 // Handle to an event.
 typedef struct event_t event_t;
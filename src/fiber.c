@@ -0,0 +1,145 @@
+#include "fiber.h"
+
+#include "heap.h"
+
+#if defined(_WIN32)
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+typedef struct fiber_t
+{
+	heap_t* heap;
+	void* handle;
+	void (*function)(void*);
+	void* data;
+	// False if the thread was already a fiber when entered, so must stay one.
+	bool converted;
+} fiber_t;
+
+static void WINAPI fiber_entry(void* user)
+{
+	fiber_t* fiber = user;
+	fiber->function(fiber->data);
+}
+
+fiber_t* fiber_enter_thread(heap_t* heap)
+{
+	fiber_t* fiber = heap_alloc(heap, sizeof(fiber_t), 8);
+	fiber->heap = heap;
+	fiber->function = NULL;
+	fiber->data = NULL;
+	fiber->converted = !IsThreadAFiber();
+	fiber->handle = fiber->converted ? ConvertThreadToFiber(NULL) : GetCurrentFiber();
+	return fiber;
+}
+
+void fiber_leave_thread(fiber_t* fiber)
+{
+	if (fiber->converted)
+	{
+		ConvertFiberToThread();
+	}
+	heap_free(fiber->heap, fiber);
+}
+
+fiber_t* fiber_create(heap_t* heap, size_t stack_size, void (*function)(void*), void* data)
+{
+	fiber_t* fiber = heap_alloc(heap, sizeof(fiber_t), 8);
+	fiber->heap = heap;
+	fiber->function = function;
+	fiber->data = data;
+	fiber->converted = false;
+	// Reserve the whole stack; the OS commits it as it is touched.
+	fiber->handle = CreateFiberEx(0, stack_size, 0, fiber_entry, fiber);
+	return fiber;
+}
+
+void fiber_destroy(fiber_t* fiber)
+{
+	DeleteFiber(fiber->handle);
+	heap_free(fiber->heap, fiber);
+}
+
+void fiber_switch(fiber_t* from, fiber_t* to)
+{
+	SwitchToFiber(to->handle);
+}
+
+#else
+
+#include "vm.h"
+
+#include <stdint.h>
+#include <ucontext.h>
+
+typedef struct fiber_t
+{
+	heap_t* heap;
+	ucontext_t context;
+	void (*function)(void*);
+	void* data;
+	// Reserved range including the guard page, NULL for a thread's own context.
+	void* stack;
+	size_t stack_size;
+} fiber_t;
+
+// makecontext passes only int arguments, so the pointer arrives in halves.
+static void fiber_entry(unsigned int low, unsigned int high)
+{
+	fiber_t* fiber = (fiber_t*)(((uintptr_t)high << 32) | (uintptr_t)low);
+	fiber->function(fiber->data);
+}
+
+fiber_t* fiber_enter_thread(heap_t* heap)
+{
+	fiber_t* fiber = heap_alloc(heap, sizeof(fiber_t), 16);
+	fiber->heap = heap;
+	fiber->function = NULL;
+	fiber->data = NULL;
+	fiber->stack = NULL;
+	fiber->stack_size = 0;
+	return fiber;
+}
+
+void fiber_leave_thread(fiber_t* fiber)
+{
+	heap_free(fiber->heap, fiber);
+}
+
+fiber_t* fiber_create(heap_t* heap, size_t stack_size, void (*function)(void*), void* data)
+{
+	size_t page_size = vm_page_size();
+	stack_size = (stack_size + page_size - 1) & ~(page_size - 1);
+
+	fiber_t* fiber = heap_alloc(heap, sizeof(fiber_t), 16);
+	fiber->heap = heap;
+	fiber->function = function;
+	fiber->data = data;
+
+	// The lowest page stays uncommitted to catch overflow.
+	fiber->stack_size = stack_size + page_size;
+	fiber->stack = vm_reserve(fiber->stack_size);
+	vm_commit((char*)fiber->stack + page_size, stack_size);
+
+	getcontext(&fiber->context);
+	fiber->context.uc_stack.ss_sp = (char*)fiber->stack + page_size;
+	fiber->context.uc_stack.ss_size = stack_size;
+	fiber->context.uc_link = NULL;
+	uintptr_t address = (uintptr_t)fiber;
+	makecontext(&fiber->context, (void (*)())fiber_entry, 2, (unsigned int)address, (unsigned int)(address >> 32));
+	return fiber;
+}
+
+void fiber_destroy(fiber_t* fiber)
+{
+	vm_release(fiber->stack, fiber->stack_size);
+	heap_free(fiber->heap, fiber);
+}
+
+void fiber_switch(fiber_t* from, fiber_t* to)
+{
+	swapcontext(&from->context, &to->context);
+}
+
+#endif
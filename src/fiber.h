@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Fibers
+//
+// Main object, fiber_t, is an execution context with its own stack that
+// runs only when explicitly switched to. Switching is cooperative and
+// never enters the OS scheduler. A fiber may be switched to from a
+// different thread than the one it last ran on.
+//
+// Built on Windows fibers, or on ucontext elsewhere.
+
+// Handle to a fiber.
+typedef struct fiber_t fiber_t;
+
+typedef struct heap_t heap_t;
+
+// Make the calling thread's own context a fiber so it can switch to others.
+// Call fiber_leave_thread on the same thread before it exits.
+fiber_t* fiber_enter_thread(heap_t* heap);
+
+// Undo fiber_enter_thread. Call from the thread's own context.
+void fiber_leave_thread(fiber_t* fiber);
+
+// Create a fiber that will call function with data when first switched to.
+// The function must never return; switch to another fiber instead.
+// Stack size is rounded up to whole pages.
+fiber_t* fiber_create(heap_t* heap, size_t stack_size, void (*function)(void*), void* data);
+
+// Destroy a fiber that is not running.
+void fiber_destroy(fiber_t* fiber);
+
+// Suspend the current fiber, from, and run fiber to.
+// Returns when another fiber switches back to from.
+void fiber_switch(fiber_t* from, fiber_t* to);
@@ -0,0 +1,108 @@
+#include "frame_arena.h"
+
+#include "heap.h"
+#include "semaphore.h"
+
+#include <stdint.h>
+
+// Additional memory for a frame that outgrew its block.
+typedef struct frame_arena_overflow_t
+{
+	struct frame_arena_overflow_t* next;
+} frame_arena_overflow_t;
+
+typedef struct frame_arena_frame_t
+{
+	char* block;
+	char* cur;
+	char* end;
+	frame_arena_overflow_t* overflow;
+} frame_arena_frame_t;
+
+typedef struct frame_arena_t
+{
+	heap_t* heap;
+	size_t block_size;
+	int frame_count;
+	int frame_index;
+	semaphore_t* free_frames;
+	frame_arena_frame_t* frames;
+} frame_arena_t;
+
+static void frame_arena_reset(frame_arena_t* arena, frame_arena_frame_t* frame);
+
+frame_arena_t* frame_arena_create(heap_t* heap, int frame_count, size_t block_size)
+{
+	frame_arena_t* arena = heap_alloc(heap, sizeof(frame_arena_t), 8);
+	arena->heap = heap;
+	arena->block_size = block_size;
+	arena->frame_count = frame_count;
+	arena->frame_index = 0;
+	// The current frame is in use by the producer; the rest are free.
+	arena->free_frames = semaphore_create(frame_count - 1, frame_count);
+	arena->frames = heap_alloc(heap, sizeof(frame_arena_frame_t) * frame_count, 8);
+	for (int i = 0; i < frame_count; ++i)
+	{
+		arena->frames[i].block = heap_alloc(heap, block_size, 16);
+		arena->frames[i].overflow = NULL;
+		frame_arena_reset(arena, &arena->frames[i]);
+	}
+	return arena;
+}
+
+void frame_arena_destroy(frame_arena_t* arena)
+{
+	for (int i = 0; i < arena->frame_count; ++i)
+	{
+		frame_arena_reset(arena, &arena->frames[i]);
+		heap_free(arena->heap, arena->frames[i].block);
+	}
+	heap_free(arena->heap, arena->frames);
+	semaphore_destroy(arena->free_frames);
+	heap_free(arena->heap, arena);
+}
+
+void* frame_arena_alloc(frame_arena_t* arena, size_t size, size_t alignment)
+{
+	frame_arena_frame_t* frame = &arena->frames[arena->frame_index];
+
+	uintptr_t address = ((uintptr_t)frame->cur + (alignment - 1)) & ~(uintptr_t)(alignment - 1);
+	if (address + size > (uintptr_t)frame->end)
+	{
+		size_t overflow_size = sizeof(frame_arena_overflow_t) + __max(arena->block_size, size + alignment);
+		frame_arena_overflow_t* overflow = heap_alloc(arena->heap, overflow_size, 16);
+		overflow->next = frame->overflow;
+		frame->overflow = overflow;
+		frame->cur = (char*)(overflow + 1);
+		frame->end = (char*)overflow + overflow_size;
+
+		address = ((uintptr_t)frame->cur + (alignment - 1)) & ~(uintptr_t)(alignment - 1);
+	}
+
+	frame->cur = (char*)(address + size);
+	return (void*)address;
+}
+
+void frame_arena_next_frame(frame_arena_t* arena)
+{
+	semaphore_acquire(arena->free_frames);
+	arena->frame_index = (arena->frame_index + 1) % arena->frame_count;
+	frame_arena_reset(arena, &arena->frames[arena->frame_index]);
+}
+
+void frame_arena_retire(frame_arena_t* arena)
+{
+	semaphore_release(arena->free_frames);
+}
+
+static void frame_arena_reset(frame_arena_t* arena, frame_arena_frame_t* frame)
+{
+	while (frame->overflow)
+	{
+		frame_arena_overflow_t* next = frame->overflow->next;
+		heap_free(arena->heap, frame->overflow);
+		frame->overflow = next;
+	}
+	frame->cur = frame->block;
+	frame->end = frame->block + arena->block_size;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+
+// Per-frame Linear Arena
+//
+// Main object, frame_arena_t, hands out transient memory for a frame
+// with a pointer bump. Memory is never freed individually. Instead, each
+// frame's memory is reset in one go once the consumer retires that frame.
+//
+// One thread produces (allocates and advances frames).
+// One thread consumes (retires frames when it has finished with them).
+// Up to frame_count frames may be in flight before the producer waits.
+
+// Handle to a frame arena.
+typedef struct frame_arena_t frame_arena_t;
+
+typedef struct heap_t heap_t;
+
+// Create a frame arena with frame_count buffered frames.
+// Each frame starts with block_size bytes; frames that need more grow
+// with additional blocks from the heap until they are reset.
+frame_arena_t* frame_arena_create(heap_t* heap, int frame_count, size_t block_size);
+
+// Destroy a frame arena.
+// All memory allocated from it becomes invalid.
+void frame_arena_destroy(frame_arena_t* arena);
+
+// Allocate memory for the current frame.
+// Memory remains valid until the consumer retires the frame.
+// Call only from the producer thread.
+void* frame_arena_alloc(frame_arena_t* arena, size_t size, size_t alignment);
+
+// Finish the current frame and start allocating into the next one.
+// If the next frame's memory is still in flight, blocks until it is retired.
+// Call only from the producer thread.
+void frame_arena_next_frame(frame_arena_t* arena);
+
+// Mark the oldest in-flight frame as no longer in use.
+// Call only from the consumer thread, once per frame, in order.
+void frame_arena_retire(frame_arena_t* arena);
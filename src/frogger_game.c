@@ -68,6 +68,13 @@ typedef struct frogger_game_t
 	ecs_entity_ref_t camera_ent;
 	ecs_entity_ref_t block_ents[12];
 
+	// Model matrices by entity index, filled in parallel before drawing.
+	mat4f_t* model_matrices;
+
+	// Frames of block updates so far. Seeds block randomness together with
+	// the entity index, so it does not depend on which worker runs a block.
+	uint32_t block_frame;
+
 	gpu_mesh_info_t cube_mesh;
 	gpu_shader_info_t cube_shader;
 	gpu_mesh_info_t block_mesh;
@@ -83,10 +90,20 @@ static void spawn_camera(frogger_game_t* game);
 static void update_players(frogger_game_t* game);
 static void update_blocks(frogger_game_t* game);
 static void draw_models(frogger_game_t* game);
+static void update_block(ecs_t* ecs, ecs_query_t* query, void* user);
+static float random_block_scale(uint32_t frame, int entity);
+static void update_model_matrix(ecs_t* ecs, ecs_query_t* query, void* user);
+
+typedef struct update_blocks_t
+{
+	frogger_game_t* game;
+	float speed;
+	uint32_t frame;
+} update_blocks_t;
 
-frogger_game_t* frogger_game_create(heap_t* heap, fs_t* fs, wm_window_t* window, render_t* render, int argc, const char** argv)
+frogger_game_t* frogger_game_create(heap_t* heap, fs_t* fs, job_system_t* jobs, wm_window_t* window, render_t* render, int argc, const char** argv)
 {
-	frogger_game_t* game = heap_alloc(heap, sizeof(frogger_game_t), 8);
+	frogger_game_t* game = heap_alloc_tagged(heap, sizeof(frogger_game_t), 8, k_heap_tag_game);
 	game->heap = heap;
 	game->fs = fs;
 	game->window = window;
@@ -95,6 +112,9 @@ frogger_game_t* frogger_game_create(heap_t* heap, fs_t* fs, wm_window_t* window,
 	game->timer = timer_object_create(heap, NULL);
 	
 	game->ecs = ecs_create(heap);
+	ecs_set_job_system(game->ecs, jobs);
+	game->model_matrices = heap_alloc_tagged(heap, sizeof(mat4f_t) * ecs_get_entity_capacity(game->ecs), 16, k_heap_tag_game);
+	game->block_frame = 0;
 	game->transform_type = ecs_register_component_type(game->ecs, "transform", sizeof(transform_component_t), _Alignof(transform_component_t), true);
 	game->camera_type = ecs_register_component_type(game->ecs, "camera", sizeof(camera_component_t), _Alignof(camera_component_t), false);
 	game->model_type = ecs_register_component_type(game->ecs, "model", sizeof(model_component_t), _Alignof(model_component_t), false);
@@ -103,7 +123,7 @@ frogger_game_t* frogger_game_create(heap_t* heap, fs_t* fs, wm_window_t* window,
 	game->name_type = ecs_register_component_type(game->ecs, "name", sizeof(name_component_t), _Alignof(name_component_t), false);
 
 	/*
-	game->net = net_create(heap, game->ecs);
+	game->net = net_create(heap, game->ecs, NULL);
 	if (argc >= 2)
 	{
 		net_address_t server;
@@ -130,6 +150,7 @@ void frogger_game_destroy(frogger_game_t* game)
 {
 	//net_destroy(game->net);
 	ecs_destroy(game->ecs);
+	heap_free(game->heap, game->model_matrices);
 	timer_object_destroy(game->timer);
 	unload_resources(game);
 	heap_free(game->heap, game);
@@ -363,56 +384,76 @@ static void update_blocks(frogger_game_t* game)
 	float speed = dt * 2;
 
 	uint64_t k_query_mask = (1ULL << game->transform_type) | (1ULL << game->block_type);
+	update_blocks_t update = { .game = game, .speed = speed, .frame = game->block_frame++ };
+	ecs_query_parallel_for(game->ecs, k_query_mask, update_block, &update, 64);
+}
 
-	for (ecs_query_t query = ecs_query_create(game->ecs, k_query_mask);
-		ecs_query_is_valid(game->ecs, &query);
-		ecs_query_next(game->ecs, &query))
-	{
-		transform_component_t* transform_comp = ecs_query_get_component(game->ecs, &query, game->transform_type);
-		block_component_t* block_comp = ecs_query_get_component(game->ecs, &query, game->block_type);
+// A block width between 4 and 12, as spawn_blocks picks with rand().
+// rand() is not used here: its state is per thread, so results would depend
+// on how chunks land on workers, and every worker starts from the same seed.
+static float random_block_scale(uint32_t frame, int entity)
+{
+	uint32_t hash = frame * 0x9e3779b9u ^ (uint32_t)entity * 0x85ebca6bu;
+	hash ^= hash >> 16;
+	hash *= 0x7feb352du;
+	hash ^= hash >> 15;
+	hash *= 0x846ca68bu;
+	hash ^= hash >> 16;
+	float unit = (float)(hash >> 8) / (float)(1 << 24);
+	return ((unit * 2) + 1) * 4;
+}
+
+// Blocks move independently, so each is updated on whichever worker its chunk lands on.
+static void update_block(ecs_t* ecs, ecs_query_t* query, void* user)
+{
+	update_blocks_t* update = user;
+	frogger_game_t* game = update->game;
+	float speed = update->speed;
 
-		if (block_comp != NULL)
+	transform_component_t* transform_comp = ecs_query_get_component(ecs, query, game->transform_type);
+	block_component_t* block_comp = ecs_query_get_component(ecs, query, game->block_type);
+
+	if (block_comp != NULL)
+	{
+		// middle row goes left to right
+		// outer rows go right to left
+		// i'm using this < 1, > -1 thing to determine if it's in the middle row because while the z values *should* be locked at
+		// -2, 0, and 2, *i don't trust them*
+		if (transform_comp->transform.translation.y > 12.0f && transform_comp->transform.translation.z < 1.0f && transform_comp->transform.translation.z > -1.0f)
 		{
-			// middle row goes left to right
-			// outer rows go right to left
-			// i'm using this < 1, > -1 thing to determine if it's in the middle row because while the z values *should* be locked at
-			// -2, 0, and 2, *i don't trust them*
-			if (transform_comp->transform.translation.y > 12.0f && transform_comp->transform.translation.z < 1.0f && transform_comp->transform.translation.z > -1.0f)
-			{
-				transform_comp->transform.translation.y = -12.0f;
-				block_comp->scale = ((((float)rand() / RAND_MAX) * 2) + 1) * 4;
-			}
-			if (transform_comp->transform.translation.y < -12.0f && (transform_comp->transform.translation.z > 1.0f || transform_comp->transform.translation.z < -1.0f))
-			{
-				transform_comp->transform.translation.y = 12.0f;
-				block_comp->scale = ((((float)rand() / RAND_MAX) * 2) + 1) * 4;
-			}
+			transform_comp->transform.translation.y = -12.0f;
+			block_comp->scale = random_block_scale(update->frame, query->entity);
+		}
+		if (transform_comp->transform.translation.y < -12.0f && (transform_comp->transform.translation.z > 1.0f || transform_comp->transform.translation.z < -1.0f))
+		{
+			transform_comp->transform.translation.y = 12.0f;
+			block_comp->scale = random_block_scale(update->frame, query->entity);
+		}
 
-			// aggressively make sure our scaling is right every frame
-			// i think this'll only matter when a block resets and when we load a save file
-			transform_comp->transform.scale.y = block_comp->scale;
-			
-			transform_t move;
-			transform_identity(&move);
-			// bottom row
-			if (transform_comp->transform.translation.z > 1.0f)
-			{
-				move.translation = vec3f_add(move.translation, vec3f_scale(vec3f_right(), -speed));
-			}
-			// top row
-			// i think some of the gaps for these are blatantly impossible
-			// but i actually kind of like that since the player then has to judge whether they can get away with rushing
-			else if (transform_comp->transform.translation.z < -1.0f)
-			{
-				move.translation = vec3f_add(move.translation, vec3f_scale(vec3f_right(), -speed * 2.0f));
-			}
-			// middle row
-			else
-			{
-				move.translation = vec3f_add(move.translation, vec3f_scale(vec3f_right(), speed * 1.5f));
-			}
-			transform_multiply(&transform_comp->transform, &move);
+		// aggressively make sure our scaling is right every frame
+		// i think this'll only matter when a block resets and when we load a save file
+		transform_comp->transform.scale.y = block_comp->scale;
+		
+		transform_t move;
+		transform_identity(&move);
+		// bottom row
+		if (transform_comp->transform.translation.z > 1.0f)
+		{
+			move.translation = vec3f_add(move.translation, vec3f_scale(vec3f_right(), -speed));
+		}
+		// top row
+		// i think some of the gaps for these are blatantly impossible
+		// but i actually kind of like that since the player then has to judge whether they can get away with rushing
+		else if (transform_comp->transform.translation.z < -1.0f)
+		{
+			move.translation = vec3f_add(move.translation, vec3f_scale(vec3f_right(), -speed * 2.0f));
 		}
+		// middle row
+		else
+		{
+			move.translation = vec3f_add(move.translation, vec3f_scale(vec3f_right(), speed * 1.5f));
+		}
+		transform_multiply(&transform_comp->transform, &move);
 	}
 }
 
@@ -501,6 +542,11 @@ static void update_players(frogger_game_t* game)
 
 static void draw_models(frogger_game_t* game)
 {
+	// Model matrices don't depend on the camera, and building them is the per-entity work.
+	// Pushing to the render queue must stay on this thread, so that part remains serial.
+	uint64_t k_model_query_mask = (1ULL << game->transform_type) | (1ULL << game->model_type);
+	ecs_query_parallel_for(game->ecs, k_model_query_mask, update_model_matrix, game, 64);
+
 	uint64_t k_camera_query_mask = (1ULL << game->camera_type);
 	for (ecs_query_t camera_query = ecs_query_create(game->ecs, k_camera_query_mask);
 		ecs_query_is_valid(game->ecs, &camera_query);
@@ -508,12 +554,10 @@ static void draw_models(frogger_game_t* game)
 	{
 		camera_component_t* camera_comp = ecs_query_get_component(game->ecs, &camera_query, game->camera_type);
 
-		uint64_t k_model_query_mask = (1ULL << game->transform_type) | (1ULL << game->model_type);
 		for (ecs_query_t query = ecs_query_create(game->ecs, k_model_query_mask);
 			ecs_query_is_valid(game->ecs, &query);
 			ecs_query_next(game->ecs, &query))
 		{
-			transform_component_t* transform_comp = ecs_query_get_component(game->ecs, &query, game->transform_type);
 			model_component_t* model_comp = ecs_query_get_component(game->ecs, &query, game->model_type);
 			ecs_entity_ref_t entity_ref = ecs_query_get_entity(game->ecs, &query);
 
@@ -525,10 +569,17 @@ static void draw_models(frogger_game_t* game)
 			} uniform_data;
 			uniform_data.projection = camera_comp->projection;
 			uniform_data.view = camera_comp->view;
-			transform_to_matrix(&transform_comp->transform, &uniform_data.model);
+			uniform_data.model = game->model_matrices[query.entity];
 			gpu_uniform_buffer_info_t uniform_info = { .data = &uniform_data, sizeof(uniform_data) };
 
 			render_push_model(game->render, &entity_ref, model_comp->mesh_info, model_comp->shader_info, &uniform_info);
 		}
 	}
 }
+
+static void update_model_matrix(ecs_t* ecs, ecs_query_t* query, void* user)
+{
+	frogger_game_t* game = user;
+	transform_component_t* transform_comp = ecs_query_get_component(ecs, query, game->transform_type);
+	transform_to_matrix(&transform_comp->transform, &game->model_matrices[query->entity]);
+}
@@ -1,9 +1,13 @@
 #include "fs.h"
 
+#include "atomic.h"
 #include "event.h"
 #include "heap.h"
+#include "job.h"
+#include "object_pool.h"
 #include "queue.h"
 #include "thread.h"
+#include "trace.h"
 #include "lz4/lz4.h"
 
 #include <string.h>
@@ -11,14 +15,27 @@
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
+enum
+{
+	// Work items a file or compression thread takes off its queue at once.
+	k_fs_work_batch = 16,
+};
+
+// Marks a work item's job counter once the work is done, so a late waiter
+// knows not to register one.
+#define k_fs_work_counter_done ((job_counter_t*)(intptr_t)-1)
+
 // seems easiest to keep the compression stuff in here rather than creating a new struct for it
 typedef struct fs_t
 {
 	heap_t* heap;
+	object_pool_t* work_pool;
 	queue_t* file_queue;
 	thread_t* file_thread;
 	queue_t* compression_queue;
 	thread_t* compression_thread;
+	int bytes_in_flight;
+	trace_t* trace;
 } fs_t;
 
 typedef enum fs_work_op_t
@@ -39,20 +56,33 @@ typedef struct fs_work_t
 	void* buffer;
 	size_t size;
 	event_t* done;
+	// Counter of a job waiting through fs_work_wait_job, signaled when the work is done.
+	job_counter_t* counter;
 	int result;
+	int flight_bytes;
 } fs_work_t;
 
 static int compression_thread_func(void* user);
 static int file_thread_func(void* user);
+static void file_work_in_flight(fs_work_t* work, size_t size);
+static void file_work_done(fs_work_t* work);
 
-fs_t* fs_create(heap_t* heap, int queue_capacity)
+fs_t* fs_create(heap_t* heap, int queue_capacity, const thread_options_t* thread_options)
 {
-	fs_t* fs = heap_alloc(heap, sizeof(fs_t), 8);
+	thread_options_t file_options = thread_options ? *thread_options : (thread_options_t) { 0 };
+	file_options.name = "fs file";
+	thread_options_t compression_options = file_options;
+	compression_options.name = "fs compression";
+
+	fs_t* fs = heap_alloc_tagged(heap, sizeof(fs_t), 8, k_heap_tag_fs);
 	fs->heap = heap;
+	fs->work_pool = object_pool_create(heap, sizeof(fs_work_t), 8, 16, true);
 	fs->file_queue = queue_create(heap, queue_capacity);
-	fs->file_thread = thread_create(file_thread_func, fs);
+	fs->file_thread = thread_create(file_thread_func, fs, &file_options);
 	fs->compression_queue = queue_create(heap, queue_capacity);
-	fs->compression_thread = thread_create(compression_thread_func, fs);
+	fs->compression_thread = thread_create(compression_thread_func, fs, &compression_options);
+	fs->bytes_in_flight = 0;
+	fs->trace = NULL;
 	return fs;
 }
 
@@ -64,13 +94,15 @@ void fs_destroy(fs_t* fs)
 	queue_destroy(fs->file_queue);
 	thread_destroy(fs->compression_thread);
 	queue_destroy(fs->compression_queue);
+	object_pool_destroy(fs->work_pool);
 	heap_free(fs->heap, fs);
 }
 
 fs_work_t* fs_read(fs_t* fs, const char* path, heap_t* heap, bool null_terminate, bool use_compression)
 {
-	fs_work_t* work = heap_alloc(fs->heap, sizeof(fs_work_t), 8);
+	fs_work_t* work = object_pool_alloc(fs->work_pool);
 	work->done = event_create();
+	work->counter = NULL;
 	work->heap = heap;
 	work->fs = fs;
 	work->op = k_fs_work_op_read;
@@ -80,14 +112,16 @@ fs_work_t* fs_read(fs_t* fs, const char* path, heap_t* heap, bool null_terminate
 	work->result = 0;
 	work->null_terminate = null_terminate;
 	work->use_compression = use_compression;
+	work->flight_bytes = 0;
 	queue_push(fs->file_queue, work);
 	return work;
 }
 
 fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size, bool use_compression)
 {
-	fs_work_t* work = heap_alloc(fs->heap, sizeof(fs_work_t), 8);
+	fs_work_t* work = object_pool_alloc(fs->work_pool);
 	work->done = event_create();
+	work->counter = NULL;
 	work->heap = fs->heap;
 	work->fs = fs;
 	work->op = k_fs_work_op_write;
@@ -97,6 +131,8 @@ fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size,
 	work->result = 0;
 	work->null_terminate = false;
 	work->use_compression = use_compression;
+	work->flight_bytes = 0;
+	file_work_in_flight(work, size);
 
 	if (use_compression)
 	{
@@ -123,6 +159,32 @@ void fs_work_wait(fs_work_t* work)
 	}
 }
 
+void fs_work_wait_job(fs_work_t* work, job_system_t* jobs)
+{
+	if (!work)
+	{
+		return;
+	}
+	if (!jobs)
+	{
+		fs_work_wait(work);
+		return;
+	}
+
+	job_counter_t* counter = job_counter_create(jobs);
+	job_counter_add(counter, 1);
+	job_counter_t* old_counter = atomic_compare_and_exchange_pointer((void**)&work->counter, NULL, counter);
+	if (!old_counter)
+	{
+		job_wait(jobs, counter);
+	}
+	else if (old_counter != k_fs_work_counter_done)
+	{
+		fs_work_wait(work);
+	}
+	job_counter_destroy(counter);
+}
+
 int fs_work_get_result(fs_work_t* work)
 {
 	fs_work_wait(work);
@@ -141,13 +203,20 @@ size_t fs_work_get_size(fs_work_t* work)
 	return work ? work->size : 0;
 }
 
+void fs_set_trace(fs_t* fs, trace_t* trace)
+{
+	fs->trace = trace;
+	queue_set_trace(fs->file_queue, trace, "fs file queue");
+	queue_set_trace(fs->compression_queue, trace, "fs compression queue");
+}
+
 void fs_work_destroy(fs_work_t* work)
 {
 	if (work)
 	{
 		event_wait(work->done);
 		event_destroy(work->done);
-		heap_free(work->heap, work);
+		object_pool_free(work->fs->work_pool, work);
 	}
 }
 
@@ -166,7 +235,7 @@ static void file_decompress(fs_work_t* work)
 	}
 
 	// we might want an extra character for the null termination
-	char* decompressed_buffer = heap_alloc(work->heap, work->null_terminate ? decompressed_size + 1 : decompressed_size, 8);
+	char* decompressed_buffer = heap_alloc_tagged(work->heap, work->null_terminate ? decompressed_size + 1 : decompressed_size, 8, k_heap_tag_fs);
 
 	LZ4_decompress_safe(compressed_buffer + 22, decompressed_buffer, compressed_size, decompressed_size);
 
@@ -175,7 +244,7 @@ static void file_decompress(fs_work_t* work)
 	work->buffer = decompressed_buffer;
 	heap_free(work->heap, compressed_buffer);
 	work->size = decompressed_size;
-	event_signal(work->done);
+	file_work_done(work);
 }
 
 static void file_read(fs_work_t* work)
@@ -184,7 +253,7 @@ static void file_read(fs_work_t* work)
 	if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, sizeof(wide_path)) <= 0)
 	{
 		work->result = -1;
-		event_signal(work->done);
+		file_work_done(work);
 		return;
 	}
 
@@ -193,7 +262,7 @@ static void file_read(fs_work_t* work)
 	if (handle == INVALID_HANDLE_VALUE)
 	{
 		work->result = GetLastError();
-		event_signal(work->done);
+		file_work_done(work);
 		return;
 	}
 
@@ -201,18 +270,20 @@ static void file_read(fs_work_t* work)
 	{
 		work->result = GetLastError();
 		CloseHandle(handle);
-		event_signal(work->done);
+		file_work_done(work);
 		return;
 	}
 
-	work->buffer = heap_alloc(work->heap, work->null_terminate ? work->size + 1 : work->size, 8);
+	file_work_in_flight(work, work->size);
+
+	work->buffer = heap_alloc_tagged(work->heap, work->null_terminate ? work->size + 1 : work->size, 8, k_heap_tag_fs);
 
 	DWORD bytes_read = 0;
 	if (!ReadFile(handle, work->buffer, (DWORD)work->size, &bytes_read, NULL))
 	{
 		work->result = GetLastError();
 		CloseHandle(handle);
-		event_signal(work->done);
+		file_work_done(work);
 		return;
 	}
 
@@ -230,7 +301,7 @@ static void file_read(fs_work_t* work)
 	}
 	else
 	{
-		event_signal(work->done);
+		file_work_done(work);
 	}
 }
 
@@ -251,7 +322,7 @@ static void file_compress(fs_work_t* work)
 	// and it was a disaster. but i'm trying it again. maybe it'll go better this time
 	// what i'm gonna try doing is passing in the pointer offset by 22 bytes into LZ4
 	// so i can use the first 22 bytes to store size data
-	char* buffer = heap_alloc(work->heap, max_size + 22, 8);
+	char* buffer = heap_alloc_tagged(work->heap, max_size + 22, 8, k_heap_tag_fs);
 
 	// compress the data, store the actual compressed size
 	int compressed_size = LZ4_compress_default(work->buffer, buffer + 22, (int)work->size, max_size);
@@ -295,7 +366,7 @@ static void file_write(fs_work_t* work)
 	if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, sizeof(wide_path)) <= 0)
 	{
 		work->result = -1;
-		event_signal(work->done);
+		file_work_done(work);
 		return;
 	}
 
@@ -304,7 +375,7 @@ static void file_write(fs_work_t* work)
 	if (handle == INVALID_HANDLE_VALUE)
 	{
 		work->result = GetLastError();
-		event_signal(work->done);
+		file_work_done(work);
 		return;
 	}
 
@@ -313,7 +384,7 @@ static void file_write(fs_work_t* work)
 	{
 		work->result = GetLastError();
 		CloseHandle(handle);
-		event_signal(work->done);
+		file_work_done(work);
 		return;
 	}
 
@@ -321,29 +392,70 @@ static void file_write(fs_work_t* work)
 
 	CloseHandle(handle);
 
+	file_work_done(work);
+}
+
+static void file_work_in_flight(fs_work_t* work, size_t size)
+{
+	fs_t* fs = work->fs;
+	work->flight_bytes = (int)size;
+	int bytes = atomic_add(&fs->bytes_in_flight, work->flight_bytes) + work->flight_bytes;
+	trace_t* trace = fs->trace;
+	if (trace)
+	{
+		trace_counter(trace, "fs bytes in flight", bytes);
+	}
+}
+
+static void file_work_done(fs_work_t* work)
+{
+	if (work->flight_bytes)
+	{
+		fs_t* fs = work->fs;
+		int bytes = atomic_add(&fs->bytes_in_flight, -work->flight_bytes) - work->flight_bytes;
+		work->flight_bytes = 0;
+		trace_t* trace = fs->trace;
+		if (trace)
+		{
+			trace_counter(trace, "fs bytes in flight", bytes);
+		}
+	}
+
+	// Take the waiting job's counter before raising the event, after which
+	// the work may be destroyed.
+	job_counter_t* counter = atomic_exchange_pointer((void**)&work->counter, k_fs_work_counter_done);
 	event_signal(work->done);
+	if (counter)
+	{
+		job_counter_signal(counter);
+	}
 }
 
 // this is basically the same as file_thread_func
 static int compression_thread_func(void* user)
 {
 	fs_t* fs = user;
+	fs_work_t* batch[k_fs_work_batch];
 	while (true)
 	{
-		fs_work_t* work = queue_pop(fs->compression_queue);
-		if (work == NULL)
+		int count = queue_pop_many(fs->compression_queue, (void**)batch, k_fs_work_batch);
+		for (int i = 0; i < count; ++i)
 		{
-			break;
-		}
-
-		switch (work->op)
-		{
-		case k_fs_work_op_read:
-			file_decompress(work);
-			break;
-		case k_fs_work_op_write:
-			file_compress(work);
-			break;
+			fs_work_t* work = batch[i];
+			if (work == NULL)
+			{
+				return 0;
+			}
+
+			switch (work->op)
+			{
+			case k_fs_work_op_read:
+				file_decompress(work);
+				break;
+			case k_fs_work_op_write:
+				file_compress(work);
+				break;
+			}
 		}
 	}
 	return 0;
@@ -352,22 +464,27 @@ static int compression_thread_func(void* user)
 static int file_thread_func(void* user)
 {
 	fs_t* fs = user;
+	fs_work_t* batch[k_fs_work_batch];
 	while (true)
 	{
-		fs_work_t* work = queue_pop(fs->file_queue);
-		if (work == NULL)
-		{
-			break;
-		}
-
-		switch (work->op)
+		int count = queue_pop_many(fs->file_queue, (void**)batch, k_fs_work_batch);
+		for (int i = 0; i < count; ++i)
 		{
-		case k_fs_work_op_read:
-			file_read(work);
-			break;
-		case k_fs_work_op_write:
-			file_write(work);
-			break;
+			fs_work_t* work = batch[i];
+			if (work == NULL)
+			{
+				return 0;
+			}
+
+			switch (work->op)
+			{
+			case k_fs_work_op_read:
+				file_read(work);
+				break;
+			case k_fs_work_op_write:
+				file_write(work);
+				break;
+			}
 		}
 	}
 	return 0;
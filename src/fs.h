@@ -11,11 +11,15 @@ typedef struct fs_t fs_t;
 typedef struct fs_work_t fs_work_t;
 
 typedef struct heap_t heap_t;
+typedef struct job_system_t job_system_t;
+typedef struct thread_options_t thread_options_t;
+typedef struct trace_t trace_t;
 
 // Create a new file system.
 // Provided heap will be used to allocate space for queue and work buffers.
 // Provided queue size defines number of in-flight file operations.
-fs_t* fs_create(heap_t* heap, int queue_capacity);
+// File and compression threads take their affinity and priority from thread options, which may be NULL.
+fs_t* fs_create(heap_t* heap, int queue_capacity, const thread_options_t* thread_options);
 
 // Destroy a previously created file system.
 void fs_destroy(fs_t* fs);
@@ -38,6 +42,12 @@ bool fs_work_is_done(fs_work_t* work);
 // Block for the file work to complete.
 void fs_work_wait(fs_work_t* work);
 
+// Wait for the file work without holding up a job worker.
+// Inside a job, suspends the job until the file thread finishes the work.
+// Elsewhere, runs queued jobs while waiting. With no job system, blocks as fs_work_wait.
+// If another thread is already waiting this way, blocks as fs_work_wait.
+void fs_work_wait_job(fs_work_t* work, job_system_t* jobs);
+
 // Get the error code for the file work.
 // A value of zero generally indicates success.
 int fs_work_get_result(fs_work_t* work);
@@ -48,5 +58,10 @@ void* fs_work_get_buffer(fs_work_t* work);
 // Get the size associated with the file operation.
 size_t fs_work_get_size(fs_work_t* work);
 
+// Report file system activity to a trace.
+// Queue depths and bytes in flight are recorded as counters.
+// Pass NULL to stop reporting.
+void fs_set_trace(fs_t* fs, trace_t* trace);
+
 // Free a file work object.
 void fs_work_destroy(fs_work_t* work);
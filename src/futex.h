@@ -0,0 +1,19 @@
+#pragma once
+
+// Address-based thread parking
+//
+// Lets a thread sleep until another thread changes an integer and wakes it.
+// Built on WaitOnAddress on Windows and the futex system call on Linux.
+// Neither call enters the kernel's object table, so there is nothing to
+// create or destroy; any aligned int can be waited on.
+
+// Sleep while the value at address equals expected.
+// Returns immediately if it already differs. May also return spuriously,
+// so callers re-check their condition in a loop.
+void futex_wait(int* address, int expected);
+
+// Wake one thread sleeping in futex_wait on address.
+void futex_wake(int* address);
+
+// Wake every thread sleeping in futex_wait on address.
+void futex_wake_all(int* address);
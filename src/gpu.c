@@ -2,6 +2,7 @@
 
 #include "debug.h"
 #include "heap.h"
+#include "object_pool.h"
 #include "wm.h"
 
 #define VK_USE_PLATFORM_WIN32_KHR
@@ -67,6 +68,7 @@ typedef struct gpu_frame_t
 typedef struct gpu_t
 {
 	heap_t* heap;
+	object_pool_t* uniform_buffer_pool;
 	VkInstance instance;
 	VkPhysicalDevice physical_device;
 	VkDevice logical_device;
@@ -107,9 +109,10 @@ static uint32_t get_memory_type_index(gpu_t* gpu, uint32_t bits, VkMemoryPropert
 
 gpu_t* gpu_create(heap_t* heap, wm_window_t* window)
 {
-	gpu_t* gpu = heap_alloc(heap, sizeof(gpu_t), 8);
+	gpu_t* gpu = heap_alloc_tagged(heap, sizeof(gpu_t), 8, k_heap_tag_render);
 	memset(gpu, 0, sizeof(*gpu));
 	gpu->heap = heap;
+	gpu->uniform_buffer_pool = object_pool_create(heap, sizeof(gpu_uniform_buffer_t), 8, 64, false);
 
 	//////////////////////////////////////////////////////
 	// Create VkInstance
@@ -304,7 +307,7 @@ gpu_t* gpu_create(heap_t* heap, wm_window_t* window)
 		goto fail;
 	}
 
-	gpu->frames = heap_alloc(heap, sizeof(gpu_frame_t) * gpu->frame_count, 8);
+	gpu->frames = heap_alloc_tagged(heap, sizeof(gpu_frame_t) * gpu->frame_count, 8, k_heap_tag_render);
 	memset(gpu->frames, 0, sizeof(gpu_frame_t) * gpu->frame_count);
 	VkImage* images = alloca(sizeof(VkImage) * gpu->frame_count);
 
@@ -586,7 +589,7 @@ gpu_t* gpu_create(heap_t* heap, wm_window_t* window)
 	//////////////////////////////////////////////////////
 	for (uint32_t i = 0; i < gpu->frame_count; i++)
 	{
-		gpu->frames[i].cmd_buffer = heap_alloc(gpu->heap, sizeof(gpu_cmd_buffer_t), 8);
+		gpu->frames[i].cmd_buffer = heap_alloc_tagged(gpu->heap, sizeof(gpu_cmd_buffer_t), 8, k_heap_tag_render);
 		memset(gpu->frames[i].cmd_buffer, 0, sizeof(gpu_cmd_buffer_t));
 
 		VkCommandBufferAllocateInfo alloc_info =
@@ -709,6 +712,10 @@ void gpu_destroy(gpu_t* gpu)
 	{
 		vkDestroyInstance(gpu->instance, NULL);
 	}
+	if (gpu && gpu->uniform_buffer_pool)
+	{
+		object_pool_destroy(gpu->uniform_buffer_pool);
+	}
 	if (gpu)
 	{
 		heap_free(gpu->heap, gpu);
@@ -727,7 +734,7 @@ void gpu_wait_until_idle(gpu_t* gpu)
 
 gpu_descriptor_t* gpu_descriptor_create(gpu_t* gpu, const gpu_descriptor_info_t* info)
 {
-	gpu_descriptor_t* descriptor = heap_alloc(gpu->heap, sizeof(gpu_descriptor_t), 8);
+	gpu_descriptor_t* descriptor = heap_alloc_tagged(gpu->heap, sizeof(gpu_descriptor_t), 8, k_heap_tag_render);
 	memset(descriptor, 0, sizeof(*descriptor));
 
 	VkDescriptorSetAllocateInfo alloc_info =
@@ -777,7 +784,7 @@ void gpu_descriptor_destroy(gpu_t* gpu, gpu_descriptor_t* descriptor)
 
 gpu_mesh_t* gpu_mesh_create(gpu_t* gpu, const gpu_mesh_info_t* info)
 {
-	gpu_mesh_t* mesh = heap_alloc(gpu->heap, sizeof(gpu_mesh_t), 8);
+	gpu_mesh_t* mesh = heap_alloc_tagged(gpu->heap, sizeof(gpu_mesh_t), 8, k_heap_tag_render);
 	memset(mesh, 0, sizeof(*mesh));
 
 	mesh->index_type = gpu->mesh_index_type[info->layout];
@@ -919,7 +926,7 @@ void gpu_mesh_destroy(gpu_t* gpu, gpu_mesh_t* mesh)
 
 gpu_pipeline_t* gpu_pipeline_create(gpu_t* gpu, const gpu_pipeline_info_t* info)
 {
-	gpu_pipeline_t* pipeline = heap_alloc(gpu->heap, sizeof(gpu_pipeline_t), 8);
+	gpu_pipeline_t* pipeline = heap_alloc_tagged(gpu->heap, sizeof(gpu_pipeline_t), 8, k_heap_tag_render);
 	memset(pipeline, 0, sizeof(*pipeline));
 
 	VkPipelineRasterizationStateCreateInfo rasterization_state_info =
@@ -1059,7 +1066,7 @@ void gpu_pipeline_destroy(gpu_t* gpu, gpu_pipeline_t* pipeline)
 
 gpu_shader_t* gpu_shader_create(gpu_t* gpu, const gpu_shader_info_t* info)
 {
-	gpu_shader_t* shader = heap_alloc(gpu->heap, sizeof(gpu_shader_t), 8);
+	gpu_shader_t* shader = heap_alloc_tagged(gpu->heap, sizeof(gpu_shader_t), 8, k_heap_tag_render);
 	memset(shader, 0, sizeof(*shader));
 
 	VkShaderModuleCreateInfo vertex_module_info =
@@ -1141,7 +1148,7 @@ void gpu_shader_destroy(gpu_t* gpu, gpu_shader_t* shader)
 
 gpu_uniform_buffer_t* gpu_uniform_buffer_create(gpu_t* gpu, const gpu_uniform_buffer_info_t* info)
 {
-	gpu_uniform_buffer_t* uniform_buffer = heap_alloc(gpu->heap, sizeof(gpu_uniform_buffer_t), 8);
+	gpu_uniform_buffer_t* uniform_buffer = object_pool_alloc(gpu->uniform_buffer_pool);
 	memset(uniform_buffer, 0, sizeof(*uniform_buffer));
 
 	VkBufferCreateInfo buffer_info =
@@ -1214,7 +1221,7 @@ void gpu_uniform_buffer_destroy(gpu_t* gpu, gpu_uniform_buffer_t* buffer)
 	}
 	if (buffer)
 	{
-		heap_free(gpu->heap, buffer);
+		object_pool_free(gpu->uniform_buffer_pool, buffer);
 	}
 }
 
@@ -1389,7 +1396,7 @@ static void create_mesh_layouts(gpu_t* gpu)
 			.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
 		};
 
-		VkVertexInputBindingDescription* vertex_binding = heap_alloc(gpu->heap, sizeof(VkVertexInputBindingDescription), 8);
+		VkVertexInputBindingDescription* vertex_binding = heap_alloc_tagged(gpu->heap, sizeof(VkVertexInputBindingDescription), 8, k_heap_tag_render);
 		*vertex_binding = (VkVertexInputBindingDescription)
 		{
 			.binding = 0,
@@ -1397,7 +1404,7 @@ static void create_mesh_layouts(gpu_t* gpu)
 			.inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
 		};
 
-		VkVertexInputAttributeDescription* vertex_attributes = heap_alloc(gpu->heap, sizeof(VkVertexInputAttributeDescription) * 1, 8);
+		VkVertexInputAttributeDescription* vertex_attributes = heap_alloc_tagged(gpu->heap, sizeof(VkVertexInputAttributeDescription) * 1, 8, k_heap_tag_render);
 		vertex_attributes[0] = (VkVertexInputAttributeDescription)
 		{
 			.binding = 0,
@@ -1428,7 +1435,7 @@ static void create_mesh_layouts(gpu_t* gpu)
 			.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
 		};
 
-		VkVertexInputBindingDescription* vertex_binding = heap_alloc(gpu->heap, sizeof(VkVertexInputBindingDescription), 8);
+		VkVertexInputBindingDescription* vertex_binding = heap_alloc_tagged(gpu->heap, sizeof(VkVertexInputBindingDescription), 8, k_heap_tag_render);
 		*vertex_binding = (VkVertexInputBindingDescription)
 		{
 			.binding = 0,
@@ -1436,7 +1443,7 @@ static void create_mesh_layouts(gpu_t* gpu)
 			.inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
 		};
 
-		VkVertexInputAttributeDescription* vertex_attributes = heap_alloc(gpu->heap, sizeof(VkVertexInputAttributeDescription) * 2, 8);
+		VkVertexInputAttributeDescription* vertex_attributes = heap_alloc_tagged(gpu->heap, sizeof(VkVertexInputAttributeDescription) * 2, 8, k_heap_tag_render);
 		vertex_attributes[0] = (VkVertexInputAttributeDescription)
 		{
 			.binding = 0,
@@ -1,103 +1,1252 @@
 #include "heap.h"
 
+#include "atomic.h"
 #include "debug.h"
+#include "heap_track.h"
 #include "mutex.h"
+#include "timer.h"
+#include "trace.h"
 #include "tlsf/tlsf.h"
+#include "vm.h"
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 
+#if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#else
+#include <pthread.h>
+#define WINAPI
+#define __max(a, b) (((a) > (b)) ? (a) : (b))
+#define __min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
 
+enum
+{
+	k_heap_cache_class_count = 14,
+	k_heap_cache_max_blocks = 64,
+	k_heap_cache_batch_blocks = 32,
+	k_heap_cache_alignment = 8,
+	k_heap_trim_default_idle_ms = 5000,
+	// How often heap_trim checks whether the threads owning caches have exited.
+	k_heap_cache_poll_ms = 1000,
+};
+
+// Allocations at least this large are mapped directly from the OS by default.
+#define k_heap_large_default_threshold ((size_t)1024 * 1024)
+
+// Address space reserved for each arena.
+// Arenas grow in place up to this size, which stays below the largest block TLSF can manage.
+// A 32-bit process has too little address space to reserve a gigabyte per arena.
+#define k_heap_arena_reserve_size (sizeof(void*) >= 8 ? (size_t)1 << 30 : (size_t)64 << 20)
+
+// Block sizes served from the per-thread caches.
+// Anything larger, or more strictly aligned, goes straight to TLSF.
+static const size_t k_heap_cache_class_sizes[k_heap_cache_class_count] =
+{
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048,
+};
+
+// A reserved range of address space holding one TLSF pool.
+// Pages are committed from the start of the range as the pool grows.
+// The arena header lives in the first committed page.
+// Arenas are listed newest first; the last is the heap's first arena and is never released.
 typedef struct arena_t
 {
 	pool_t pool;
+	size_t reserved_size;
+	size_t committed_size;
+	// Tick at which committed pages were first seen free at the end, zero if none.
+	uint64_t idle_ticks;
+	// Bytes that could be trimmed when idle_ticks was taken.
+	size_t idle_bytes;
+	// Backed by huge pages, so fully committed and never trimmed.
+	bool huge;
 	struct arena_t* next;
 } arena_t;
 
+typedef struct heap_cache_block_t
+{
+	struct heap_cache_block_t* next;
+} heap_cache_block_t;
+
+typedef struct heap_cache_class_t
+{
+	heap_cache_block_t* head;
+	int count;
+} heap_cache_class_t;
+
+// Free blocks owned by a single thread.
+// Only the owning thread touches the classes, so no lock is needed.
+// Blocks move to and from TLSF in batches under the heap mutex.
+// The thread also counts its cached allocations by size here.
+// Caches are per OS thread rather than per fiber: jobs move between
+// threads, but two never run on one thread at once, and a cache per fiber
+// would strand blocks in every pooled fiber.
+typedef struct heap_cache_t
+{
+	heap_t* heap;
+	struct heap_cache_t* next;
+#if defined(_WIN32)
+	// Thread local storage has no exit callback, so heap_trim polls the
+	// owning thread and returns the cache once the thread has exited.
+	HANDLE thread;
+#endif
+	heap_cache_class_t classes[k_heap_cache_class_count];
+	uint64_t size_histogram[k_heap_histogram_bucket_count];
+} heap_cache_t;
+
+// Header placed directly before an allocation mapped from the OS.
+// The marker overlays the TLSF block size field. TLSF never sets the
+// free bit on an allocated block, so the marker identifies large allocations.
+typedef struct heap_large_t
+{
+	struct heap_large_t* prev;
+	struct heap_large_t* next;
+	void* base;
+	size_t size;
+	size_t marker;
+} heap_large_t;
+
+static const size_t k_heap_large_marker = 1;
+
+// Header placed directly before a tagged allocation.
+// The marker works as for large allocations, with a different value.
+typedef struct heap_tag_header_t
+{
+	uint32_t offset;
+	uint32_t tag;
+	size_t size;
+	size_t marker;
+} heap_tag_header_t;
+
+static const size_t k_heap_tag_marker = 3;
+
+typedef struct heap_tag_budget_t
+{
+	int64_t bytes_in_use;
+	int64_t bytes_peak;
+	size_t soft_budget;
+	size_t hard_budget;
+} heap_tag_budget_t;
+
+static const char* k_heap_tag_names[k_heap_tag_count] =
+{
+	"render", "fs", "net", "ecs", "game",
+};
+
+// Trace counter names, which must stay valid while a capture is in progress.
+static const char* k_heap_tag_counter_names[k_heap_tag_count] =
+{
+	"heap render bytes", "heap fs bytes", "heap net bytes", "heap ecs bytes", "heap game bytes",
+};
+
+static const char* k_heap_tag_overrun_counter_names[k_heap_tag_count] =
+{
+	"heap render over budget", "heap fs over budget", "heap net over budget", "heap ecs over budget", "heap game over budget",
+};
+
 typedef struct heap_t
 {
 	tlsf_t tlsf;
+	size_t size;
+	size_t page_size;
+	size_t huge_page_size;
+	uint32_t flags;
 	size_t grow_increment;
+	size_t large_threshold;
 	arena_t* arena;
 	mutex_t* mutex;
+	// Large allocations are listed and counted under their own lock,
+	// so mapping or unmapping one never waits on the heap mutex.
+	mutex_t* large_mutex;
+	heap_large_t* large;
+	int64_t large_bytes;
+	// Bytes in use in TLSF; large_bytes is added on top when reporting.
+	size_t bytes_in_use;
+	size_t bytes_peak;
+	uint64_t size_histogram[k_heap_histogram_bucket_count];
+	heap_tag_budget_t tags[k_heap_tag_count];
+	uint32_t trim_idle_ms;
+	size_t trim_retain_bytes;
+	trace_t* trace;
+#if defined(_WIN32)
+	DWORD cache_index;
+#else
+	pthread_key_t cache_index;
+#endif
+	heap_cache_t* caches;
+#if defined(_WIN32)
+	uint64_t cache_poll_ticks;
+#endif
+	heap_track_t* track;
+	// Blocks freed without taking the lock, returned by the next thread to take it.
+	heap_cache_block_t* remote_frees;
 } heap_t;
 
-heap_t* heap_create(size_t grow_increment)
+static void* heap_alloc_untracked(heap_t* heap, size_t size, size_t alignment);
+static void* heap_alloc_locked(heap_t* heap, size_t size, size_t alignment);
+static void heap_free_locked(heap_t* heap, void* address);
+static bool heap_grow_locked(heap_t* heap, size_t size, size_t alignment);
+static size_t heap_arena_trim_bytes(heap_t* heap, arena_t* arena);
+static void heap_arena_trim_locked(heap_t* heap, arena_t* arena, size_t bytes);
+static void heap_arena_decommit_locked(heap_t* heap, arena_t* arena, size_t bytes);
+static void heap_arena_release_locked(heap_t* heap, arena_t* arena);
+static size_t heap_align_up(size_t size, size_t alignment);
+static void* heap_alloc_large(heap_t* heap, size_t size, size_t alignment);
+static void heap_free_large(heap_t* heap, heap_large_t* large);
+static void heap_lock(heap_t* heap);
+static void heap_remote_drain_locked(heap_t* heap);
+static void heap_free_block(heap_t* heap, void* address);
+static size_t heap_bytes_in_use_locked(heap_t* heap);
+static bool heap_tag_charge(heap_t* heap, heap_tag_t tag, size_t size);
+static void heap_tag_release(heap_t* heap, heap_tag_header_t* header);
+static void heap_remote_push(heap_t* heap, heap_cache_block_t* first, heap_cache_block_t* last);
+static int heap_histogram_bucket(size_t size);
+static void heap_report(size_t bytes_in_use, trace_t* trace);
+static heap_cache_t* heap_cache_get(heap_t* heap);
+static void heap_cache_refill(heap_t* heap, heap_cache_class_t* cache_class, int size_class);
+static void heap_cache_flush(heap_t* heap, heap_cache_class_t* cache_class, int block_count);
+static void heap_cache_release_locked(heap_t* heap, heap_cache_class_t* cache_class, int block_count);
+static void heap_cache_destroy_locked(heap_t* heap, heap_cache_t* cache);
+#if !defined(_WIN32)
+static void heap_cache_thread_exit(void* data);
+#endif
+
+heap_t* heap_create(size_t grow_increment, uint32_t flags)
 {
-	heap_t* heap = VirtualAlloc(NULL, sizeof(heap_t) + tlsf_size(),
-		MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-	if (!heap)
+	size_t page_size = vm_page_size();
+	size_t size = heap_align_up(sizeof(heap_t) + tlsf_size(), page_size);
+	heap_t* heap = vm_reserve(size);
+	if (!heap || !vm_commit(heap, size))
 	{
 		debug_print(
 			k_print_error,
 			"OUT OF MEMORY!\n");
+		if (heap)
+		{
+			vm_release(heap, size);
+		}
 		return NULL;
 	}
 
 	heap->mutex = mutex_create();
-	heap->grow_increment = grow_increment;
+	heap->large_mutex = mutex_create();
+	heap->size = size;
+	heap->page_size = page_size;
+	heap->huge_page_size = (flags & k_heap_flag_huge_pages) ? vm_huge_page_size() : 0;
+	heap->flags = flags;
+	heap->grow_increment = heap_align_up(grow_increment, __max(page_size, heap->huge_page_size));
 	heap->tlsf = tlsf_create(heap + 1);
+	heap->large_threshold = k_heap_large_default_threshold;
 	heap->arena = NULL;
+	heap->large = NULL;
+	heap->large_bytes = 0;
+	memset(heap->size_histogram, 0, sizeof(heap->size_histogram));
+	memset(heap->tags, 0, sizeof(heap->tags));
+	heap->bytes_in_use = 0;
+	heap->bytes_peak = 0;
+	heap->trim_idle_ms = k_heap_trim_default_idle_ms;
+	heap->trim_retain_bytes = grow_increment;
+	heap->trace = NULL;
+#if defined(_WIN32)
+	heap->cache_index = TlsAlloc();
+#else
+	pthread_key_create(&heap->cache_index, heap_cache_thread_exit);
+#endif
+	heap->caches = NULL;
+#if defined(_WIN32)
+	heap->cache_poll_ticks = 0;
+#endif
+	heap->track = (flags & k_heap_flag_track_leaks) ? heap_track_create() : NULL;
+	heap->remote_frees = NULL;
 
 	return heap;
 }
 
 void* heap_alloc(heap_t* heap, size_t size, size_t alignment)
 {
-	mutex_lock(heap->mutex);
+	void* address = heap_alloc_untracked(heap, size, alignment);
+	if (heap->track && address)
+	{
+		heap_track_alloc(heap->track, address, size);
+	}
+	return address;
+}
 
-	void* address = tlsf_memalign(heap->tlsf, alignment, size);
+static void* heap_alloc_untracked(heap_t* heap, size_t size, size_t alignment)
+{
+	if (size >= heap->large_threshold)
+	{
+		return heap_alloc_large(heap, size, alignment);
+	}
+
+	if (size <= k_heap_cache_class_sizes[k_heap_cache_class_count - 1] && alignment <= k_heap_cache_alignment)
+	{
+		heap_cache_t* cache = heap_cache_get(heap);
+		if (cache)
+		{
+			int size_class = 0;
+			while (k_heap_cache_class_sizes[size_class] < size)
+			{
+				++size_class;
+			}
+
+			cache->size_histogram[heap_histogram_bucket(size)]++;
+
+			heap_cache_class_t* cache_class = &cache->classes[size_class];
+			if (!cache_class->head)
+			{
+				heap_cache_refill(heap, cache_class, size_class);
+			}
+
+			heap_cache_block_t* block = cache_class->head;
+			if (block)
+			{
+				cache_class->head = block->next;
+				cache_class->count--;
+			}
+			return block;
+		}
+	}
+
+	heap_lock(heap);
+	heap->size_histogram[heap_histogram_bucket(size)]++;
+	void* address = heap_alloc_locked(heap, size, alignment);
+	size_t bytes_in_use = heap_bytes_in_use_locked(heap);
+	trace_t* trace = heap->trace;
+	mutex_unlock(heap->mutex);
+
+	heap_report(bytes_in_use, trace);
+
+	return address;
+}
+
+void* heap_alloc_tagged(heap_t* heap, size_t size, size_t alignment, heap_tag_t tag)
+{
+	if (!heap_tag_charge(heap, tag, size))
+	{
+		return NULL;
+	}
+
+	size_t offset = heap_align_up(sizeof(heap_tag_header_t), __max(alignment, sizeof(size_t)));
+	char* base = heap_alloc(heap, offset + size, alignment);
+	if (!base)
+	{
+		atomic_add64(&heap->tags[tag].bytes_in_use, -(int64_t)size);
+		return NULL;
+	}
+
+	char* address = base + offset;
+	heap_tag_header_t* header = (heap_tag_header_t*)address - 1;
+	header->offset = (uint32_t)offset;
+	header->tag = tag;
+	header->size = size;
+	header->marker = k_heap_tag_marker;
+	return address;
+}
+
+void heap_free(heap_t* heap, void* address)
+{
 	if (!address)
 	{
-		size_t arena_size =
-			__max(heap->grow_increment, size * 2) +
-			sizeof(arena_t);
-		arena_t* arena = VirtualAlloc(NULL,
-			arena_size + tlsf_pool_overhead(),
-			MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-		if (!arena)
+		return;
+	}
+
+	heap_tag_header_t* header = (heap_tag_header_t*)address - 1;
+	if (header->marker == k_heap_tag_marker)
+	{
+		heap_tag_release(heap, header);
+		address = (char*)address - header->offset;
+	}
+
+	if (heap->track)
+	{
+		heap_track_free(heap->track, address);
+	}
+
+	heap_large_t* large = (heap_large_t*)address - 1;
+	if (large->marker == k_heap_large_marker)
+	{
+		heap_free_large(heap, large);
+		return;
+	}
+
+	// Any block at least as large as a class can serve that class.
+	size_t block_size = tlsf_block_size(address);
+	if (block_size >= k_heap_cache_class_sizes[0] &&
+		block_size <= k_heap_cache_class_sizes[k_heap_cache_class_count - 1])
+	{
+		heap_cache_t* cache = heap_cache_get(heap);
+		if (cache)
+		{
+			int size_class = k_heap_cache_class_count - 1;
+			while (k_heap_cache_class_sizes[size_class] > block_size)
+			{
+				--size_class;
+			}
+
+			heap_cache_class_t* cache_class = &cache->classes[size_class];
+			heap_cache_block_t* block = address;
+			block->next = cache_class->head;
+			cache_class->head = block;
+			cache_class->count++;
+
+			if (cache_class->count > k_heap_cache_max_blocks)
+			{
+				heap_cache_flush(heap, cache_class, k_heap_cache_batch_blocks);
+			}
+			return;
+		}
+	}
+
+	heap_free_block(heap, address);
+}
+
+void* heap_realloc(heap_t* heap, void* address, size_t size, size_t alignment)
+{
+	if (!address)
+	{
+		return heap_alloc(heap, size, alignment);
+	}
+	if (!size)
+	{
+		heap_free(heap, address);
+		return NULL;
+	}
+
+	// Resize the whole tagged allocation; the header moves along with it.
+	heap_tag_header_t* header = (heap_tag_header_t*)address - 1;
+	if (header->marker == k_heap_tag_marker)
+	{
+		heap_tag_t tag = header->tag;
+		size_t old_size = header->size;
+		size_t offset = header->offset;
+		if (size > old_size && !heap_tag_charge(heap, tag, size - old_size))
 		{
-			debug_print(
-				k_print_error,
-				"OUT OF MEMORY!\n");
 			return NULL;
 		}
 
-		arena->pool = tlsf_add_pool(heap->tlsf, arena + 1, arena_size);
+		char* base = heap_realloc(heap, (char*)address - offset, offset + size, alignment);
+		if (!base)
+		{
+			if (size > old_size)
+			{
+				atomic_add64(&heap->tags[tag].bytes_in_use, -(int64_t)(size - old_size));
+			}
+			return NULL;
+		}
+		if (size < old_size)
+		{
+			atomic_add64(&heap->tags[tag].bytes_in_use, -(int64_t)(old_size - size));
+		}
+
+		header = (heap_tag_header_t*)(base + offset) - 1;
+		header->size = size;
+		return base + offset;
+	}
 
-		arena->next = heap->arena;
-		heap->arena = arena;
+	heap_large_t* large = (heap_large_t*)address - 1;
+	bool is_large = large->marker == k_heap_large_marker;
+	size_t old_size = is_large ?
+		large->size - ((char*)address - (char*)large->base) :
+		tlsf_block_size(address);
 
-		address = tlsf_memalign(heap->tlsf, alignment, size);
+	// TLSF only keeps its own alignment when it moves a block,
+	// and large allocations are never grown in place.
+	if (is_large || alignment > tlsf_align_size() || size >= heap->large_threshold)
+	{
+		// Shrinking a large allocation below the threshold moves it back into TLSF.
+		bool fits = size <= old_size && (!is_large || size >= heap->large_threshold);
+		if (fits)
+		{
+			if (heap->track)
+			{
+				heap_track_alloc(heap->track, address, size);
+			}
+			return address;
+		}
+
+		void* new_address = heap_alloc(heap, size, alignment);
+		if (new_address)
+		{
+			memcpy(new_address, address, __min(old_size, size));
+			heap_free(heap, address);
+		}
+		return new_address;
 	}
 
+	heap_lock(heap);
+	heap->size_histogram[heap_histogram_bucket(size)]++;
+	void* new_address = tlsf_realloc(heap->tlsf, address, size);
+	if (!new_address && heap_grow_locked(heap, size, alignment))
+	{
+		new_address = tlsf_realloc(heap->tlsf, address, size);
+	}
+	if (new_address)
+	{
+		heap->bytes_in_use += tlsf_block_size(new_address);
+		heap->bytes_in_use -= old_size;
+		heap->bytes_peak = __max(heap->bytes_peak, heap_bytes_in_use_locked(heap));
+	}
+	size_t bytes_in_use = heap_bytes_in_use_locked(heap);
+	trace_t* trace = heap->trace;
 	mutex_unlock(heap->mutex);
 
-	return address;
+	heap_report(bytes_in_use, trace);
+
+	if (heap->track && new_address)
+	{
+		heap_track_free(heap->track, address);
+		heap_track_alloc(heap->track, new_address, size);
+	}
+
+	return new_address;
 }
 
-void heap_free(heap_t* heap, void* address)
+void heap_set_budget(heap_t* heap, heap_tag_t tag, size_t soft_bytes, size_t hard_bytes)
+{
+	heap->tags[tag].soft_budget = soft_bytes;
+	heap->tags[tag].hard_budget = hard_bytes;
+}
+
+void heap_get_tag_stats(heap_t* heap, heap_tag_t tag, heap_tag_stats_t* stats)
+{
+	heap_tag_budget_t* budget = &heap->tags[tag];
+	stats->bytes_in_use = (size_t)budget->bytes_in_use;
+	stats->bytes_peak = (size_t)budget->bytes_peak;
+	stats->soft_budget = budget->soft_budget;
+	stats->hard_budget = budget->hard_budget;
+}
+
+void heap_set_large_threshold(heap_t* heap, size_t size)
+{
+	heap_lock(heap);
+	heap->large_threshold = size;
+	mutex_unlock(heap->mutex);
+}
+
+void heap_set_trim(heap_t* heap, uint32_t idle_ms, size_t retain_bytes)
+{
+	heap_lock(heap);
+	heap->trim_idle_ms = idle_ms;
+	heap->trim_retain_bytes = retain_bytes;
+	mutex_unlock(heap->mutex);
+}
+
+void heap_trim(heap_t* heap)
 {
+	uint64_t now = timer_get_ticks();
+
+	// Return blocks freed by other threads first, so their pages can count as free.
 	mutex_lock(heap->mutex);
-	tlsf_free(heap->tlsf, address);
+	heap_remote_drain_locked(heap);
+
+#if defined(_WIN32)
+	// Return the caches of threads that have exited, before looking for free pages.
+	// Threads come and go rarely, so this runs far less often than every trim.
+	if (timer_ticks_to_ms(now - heap->cache_poll_ticks) >= k_heap_cache_poll_ms)
+	{
+		heap->cache_poll_ticks = now;
+		heap_cache_t* cache = heap->caches;
+		while (cache)
+		{
+			heap_cache_t* next = cache->next;
+			if (WaitForSingleObject(cache->thread, 0) == WAIT_OBJECT_0)
+			{
+				heap_cache_destroy_locked(heap, cache);
+			}
+			cache = next;
+		}
+	}
+#endif
+
+	// Trim arenas whose free memory has stayed the same for long enough.
+	size_t idle_bytes = 0;
+	arena_t* arena = heap->arena;
+	while (arena)
+	{
+		arena_t* next = arena->next;
+		size_t bytes = heap_arena_trim_bytes(heap, arena);
+		if (!bytes)
+		{
+			arena->idle_ticks = 0;
+		}
+		else if (!arena->idle_ticks || bytes != arena->idle_bytes)
+		{
+			// Never zero, so it cannot be mistaken for an arena in use.
+			arena->idle_ticks = __max(now, 1);
+			arena->idle_bytes = bytes;
+			idle_bytes += bytes;
+		}
+		else if (timer_ticks_to_ms(now - arena->idle_ticks) >= heap->trim_idle_ms)
+		{
+			heap_arena_trim_locked(heap, arena, bytes);
+		}
+		else
+		{
+			idle_bytes += bytes;
+		}
+		arena = next;
+	}
+
+	// Then decommit the longest idle until under the retained threshold.
+	while (idle_bytes > heap->trim_retain_bytes)
+	{
+		arena_t* oldest = NULL;
+		for (arena_t* arena = heap->arena; arena; arena = arena->next)
+		{
+			if (arena->idle_ticks && (!oldest || arena->idle_ticks < oldest->idle_ticks))
+			{
+				oldest = arena;
+			}
+		}
+		size_t bytes = heap_arena_trim_bytes(heap, oldest);
+		idle_bytes -= bytes;
+		heap_arena_trim_locked(heap, oldest, bytes);
+	}
+
+	mutex_unlock(heap->mutex);
+}
+
+static void heap_stats_walker(void* ptr, size_t size, int used, void* user)
+{
+	heap_stats_t* stats = user;
+	if (!used)
+	{
+		stats->bytes_free += size;
+		stats->largest_free_block = __max(stats->largest_free_block, size);
+	}
+}
+
+void heap_get_stats(heap_t* heap, heap_stats_t* stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	// Return blocks freed by other threads first, so they no longer count as in use.
+	mutex_lock(heap->mutex);
+	heap_remote_drain_locked(heap);
+	stats->bytes_in_use = heap_bytes_in_use_locked(heap);
+	stats->bytes_peak = heap->bytes_peak;
+	for (arena_t* arena = heap->arena; arena; arena = arena->next)
+	{
+		stats->bytes_reserved += arena->reserved_size;
+		stats->bytes_committed += arena->committed_size;
+		stats->arena_count++;
+		tlsf_walk_pool(arena->pool, heap_stats_walker, stats);
+	}
+	mutex_lock(heap->large_mutex);
+	for (heap_large_t* large = heap->large; large; large = large->next)
+	{
+		stats->large_count++;
+		stats->large_bytes += large->size;
+	}
+	mutex_unlock(heap->large_mutex);
+
+	// Other threads may be counting into their caches; the total may lag slightly.
+	memcpy(stats->size_histogram, heap->size_histogram, sizeof(stats->size_histogram));
+	for (heap_cache_t* cache = heap->caches; cache; cache = cache->next)
+	{
+		for (int i = 0; i < k_heap_histogram_bucket_count; ++i)
+		{
+			stats->size_histogram[i] += cache->size_histogram[i];
+		}
+	}
+	mutex_unlock(heap->mutex);
+
+	if (stats->bytes_free)
+	{
+		stats->fragmentation = 1.0f - (float)stats->largest_free_block / (float)stats->bytes_free;
+	}
+}
+
+void heap_trace_stats(heap_t* heap)
+{
+	// Gathering the stats walks the whole heap under its lock; only pay for
+	// that while the counters are being recorded.
+	trace_t* trace = heap->trace;
+	if (!trace || !trace_is_capturing(trace))
+	{
+		return;
+	}
+
+	heap_stats_t stats;
+	heap_get_stats(heap, &stats);
+	trace_counter(trace, "heap bytes peak", stats.bytes_peak);
+	trace_counter(trace, "heap bytes committed", stats.bytes_committed);
+	trace_counter(trace, "heap bytes free", stats.bytes_free);
+	trace_counter(trace, "heap largest free block", stats.largest_free_block);
+	trace_counter(trace, "heap arena count", stats.arena_count);
+	trace_counter(trace, "heap large bytes", stats.large_bytes);
+
+	for (int i = 0; i < k_heap_tag_count; ++i)
+	{
+		heap_tag_budget_t* budget = &heap->tags[i];
+		int64_t bytes_in_use = budget->bytes_in_use;
+		trace_counter(trace, k_heap_tag_counter_names[i], bytes_in_use);
+		if (budget->soft_budget)
+		{
+			trace_counter(trace, k_heap_tag_overrun_counter_names[i], __max(bytes_in_use - (int64_t)budget->soft_budget, 0));
+		}
+	}
+	trace_counter(trace, "heap fragmentation percent", (int64_t)(stats.fragmentation * 100.0f));
+}
+
+void heap_set_trace(heap_t* heap, trace_t* trace)
+{
+	heap_lock(heap);
+	heap->trace = trace;
 	mutex_unlock(heap->mutex);
 }
 
 void heap_destroy(heap_t* heap)
 {
+	if (heap->track)
+	{
+		heap_track_report(heap->track);
+		heap_track_destroy(heap->track);
+	}
+
+	// Caches live inside the arenas, so there is nothing to return.
+	// Free the index first so thread exit callbacks no longer reference this heap.
+#if defined(_WIN32)
+	TlsFree(heap->cache_index);
+	for (heap_cache_t* cache = heap->caches; cache; cache = cache->next)
+	{
+		CloseHandle(cache->thread);
+	}
+#else
+	pthread_key_delete(heap->cache_index);
+#endif
+
 	tlsf_destroy(heap->tlsf);
 
+	heap_large_t* large = heap->large;
+	while (large)
+	{
+		heap_large_t* next = large->next;
+		vm_release(large->base, large->size);
+		large = next;
+	}
+
 	arena_t* arena = heap->arena;
 	while (arena)
 	{
 		arena_t* next = arena->next;
-		VirtualFree(arena, 0, MEM_RELEASE);
+		vm_release(arena, arena->reserved_size);
 		arena = next;
 	}
 
+	mutex_destroy(heap->large_mutex);
 	mutex_destroy(heap->mutex);
 
-	VirtualFree(heap, 0, MEM_RELEASE);
+	vm_release(heap, heap->size);
+}
+
+static void* heap_alloc_locked(heap_t* heap, size_t size, size_t alignment)
+{
+	void* address = tlsf_memalign(heap->tlsf, alignment, size);
+	if (!address && heap_grow_locked(heap, size, alignment))
+	{
+		address = tlsf_memalign(heap->tlsf, alignment, size);
+	}
+
+	if (address)
+	{
+		heap->bytes_in_use += tlsf_block_size(address);
+		heap->bytes_peak = __max(heap->bytes_peak, heap_bytes_in_use_locked(heap));
+	}
+
+	return address;
+}
+
+static void heap_free_locked(heap_t* heap, void* address)
+{
+	heap->bytes_in_use -= tlsf_block_size(address);
+	tlsf_free(heap->tlsf, address);
+}
+
+// Commit enough memory for an allocation of the given size.
+// Extends the newest arena in place when its reservation has room,
+// so the new pages merge with any free block at the end of its pool.
+static bool heap_grow_locked(heap_t* heap, size_t size, size_t alignment)
+{
+	// TLSF rounds large requests up to the next size class, up to 1/32 larger.
+	size_t grow_size = heap_align_up(
+		__max(heap->grow_increment, size + (size >> 4) + alignment + tlsf_pool_overhead()),
+		heap->page_size);
+
+	arena_t* arena = heap->arena;
+	if (arena && arena->reserved_size - arena->committed_size >= grow_size)
+	{
+		if (!vm_commit((char*)arena + arena->committed_size, grow_size))
+		{
+			debug_print(
+				k_print_error,
+				"OUT OF MEMORY!\n");
+			return false;
+		}
+		tlsf_extend_pool(heap->tlsf, arena->pool, arena->committed_size - sizeof(arena_t), grow_size);
+		arena->committed_size += grow_size;
+		// The free tail just changed, so it has not been idle for any time yet.
+		arena->idle_ticks = 0;
+		return true;
+	}
+
+	arena = NULL;
+	if (heap->huge_page_size)
+	{
+		size_t huge_size = heap_align_up(grow_size, heap->huge_page_size);
+		arena = vm_alloc_huge(huge_size);
+		if (arena)
+		{
+			arena->reserved_size = huge_size;
+			arena->committed_size = huge_size;
+			arena->huge = true;
+		}
+		else
+		{
+			// Don't keep trying; later arenas get transparent huge pages at best.
+			debug_print(
+				k_print_warning,
+				"Huge pages unavailable, falling back to regular pages.\n");
+			heap->huge_page_size = 0;
+		}
+	}
+
+	if (!arena)
+	{
+		size_t reserved_size = __max(k_heap_arena_reserve_size, heap_align_up(grow_size + sizeof(arena_t), heap->page_size));
+		arena = vm_reserve(reserved_size);
+		if (!arena || !vm_commit(arena, grow_size))
+		{
+			debug_print(
+				k_print_error,
+				"OUT OF MEMORY!\n");
+			if (arena)
+			{
+				vm_release(arena, reserved_size);
+			}
+			return false;
+		}
+		if (heap->flags & k_heap_flag_huge_pages)
+		{
+			vm_advise_huge(arena, reserved_size);
+		}
+
+		arena->reserved_size = reserved_size;
+		arena->committed_size = grow_size;
+		arena->huge = false;
+	}
+
+	// The pool fills the rest of the committed pages after the arena header.
+	arena->idle_ticks = 0;
+	arena->pool = tlsf_add_pool(heap->tlsf, arena + 1, arena->committed_size - sizeof(arena_t));
+
+	arena->next = heap->arena;
+	heap->arena = arena;
+	return true;
+}
+
+// Number of committed bytes that trimming an arena would return.
+// An entirely free arena other than the first is released whole;
+// otherwise only free pages at its end can be decommitted.
+static size_t heap_arena_trim_bytes(heap_t* heap, arena_t* arena)
+{
+	if (arena->huge)
+	{
+		return 0;
+	}
+	if (arena->next && tlsf_pool_is_free(arena->pool, arena->committed_size - sizeof(arena_t)))
+	{
+		return arena->committed_size;
+	}
+
+	size_t tail = tlsf_pool_free_tail(arena->pool, arena->committed_size - sizeof(arena_t));
+	size_t bytes = tail - tail % heap->page_size;
+
+	// Shrinking must either remove the free block whole or leave a valid block behind.
+	if (bytes && bytes != tail && tail - bytes < tlsf_block_size_min() + tlsf_alloc_overhead())
+	{
+		bytes -= heap->page_size;
+	}
+	return bytes;
+}
+
+// Return the bytes counted by heap_arena_trim_bytes to the OS.
+static void heap_arena_trim_locked(heap_t* heap, arena_t* arena, size_t bytes)
+{
+	if (bytes == arena->committed_size)
+	{
+		heap_arena_release_locked(heap, arena);
+	}
+	else
+	{
+		heap_arena_decommit_locked(heap, arena, bytes);
+	}
+}
+
+static void heap_arena_decommit_locked(heap_t* heap, arena_t* arena, size_t bytes)
+{
+	if (tlsf_shrink_pool(heap->tlsf, arena->pool, arena->committed_size - sizeof(arena_t), bytes))
+	{
+		arena->committed_size -= bytes;
+		vm_decommit((char*)arena + arena->committed_size, bytes);
+	}
+	arena->idle_ticks = 0;
+}
+
+static void heap_arena_release_locked(heap_t* heap, arena_t* arena)
+{
+	arena_t** link = &heap->arena;
+	while (*link != arena)
+	{
+		link = &(*link)->next;
+	}
+	*link = arena->next;
+
+	tlsf_remove_pool(heap->tlsf, arena->pool);
+	vm_release(arena, arena->reserved_size);
+}
+
+static size_t heap_align_up(size_t size, size_t alignment)
+{
+	return (size + alignment - 1) & ~(alignment - 1);
+}
+
+static void* heap_alloc_large(heap_t* heap, size_t size, size_t alignment)
+{
+	size_t map_size = heap_align_up(sizeof(heap_large_t) + alignment - 1 + size, heap->page_size);
+	char* base = vm_reserve(map_size);
+	if (!base || !vm_commit(base, map_size))
+	{
+		debug_print(
+			k_print_error,
+			"OUT OF MEMORY!\n");
+		if (base)
+		{
+			vm_release(base, map_size);
+		}
+		return NULL;
+	}
+	if (heap->flags & k_heap_flag_huge_pages)
+	{
+		vm_advise_huge(base, map_size);
+	}
+
+	char* address = (char*)heap_align_up((size_t)(base + sizeof(heap_large_t)), alignment);
+	heap_large_t* large = (heap_large_t*)address - 1;
+	large->base = base;
+	large->size = map_size;
+	large->marker = k_heap_large_marker;
+
+	mutex_lock(heap->large_mutex);
+	large->prev = NULL;
+	large->next = heap->large;
+	if (heap->large)
+	{
+		heap->large->prev = large;
+	}
+	heap->large = large;
+	atomic_add64(&heap->large_bytes, map_size);
+	mutex_unlock(heap->large_mutex);
+
+	heap_lock(heap);
+	heap->size_histogram[heap_histogram_bucket(size)]++;
+	size_t bytes_in_use = heap_bytes_in_use_locked(heap);
+	heap->bytes_peak = __max(heap->bytes_peak, bytes_in_use);
+	trace_t* trace = heap->trace;
+	mutex_unlock(heap->mutex);
+
+	heap_report(bytes_in_use, trace);
+
+	return address;
+}
+
+// Unmap a large allocation right away.
+// Only the large allocation lock is taken, and only to unlink it from the list.
+static void heap_free_large(heap_t* heap, heap_large_t* large)
+{
+	mutex_lock(heap->large_mutex);
+	if (large->prev)
+	{
+		large->prev->next = large->next;
+	}
+	else
+	{
+		heap->large = large->next;
+	}
+	if (large->next)
+	{
+		large->next->prev = large->prev;
+	}
+	size_t size = large->size;
+	int64_t large_bytes = atomic_add64(&heap->large_bytes, -(int64_t)size) - (int64_t)size;
+	// Read without the heap lock; the reported total is only a snapshot.
+	size_t bytes_in_use = heap->bytes_in_use + (size_t)large_bytes;
+	trace_t* trace = heap->trace;
+	mutex_unlock(heap->large_mutex);
+
+	vm_release(large->base, size);
+
+	heap_report(bytes_in_use, trace);
+}
+
+// Account for memory allocated with a tag and check it against the budgets.
+// Returns false, charging nothing, if the hard budget would be exceeded.
+static bool heap_tag_charge(heap_t* heap, heap_tag_t tag, size_t size)
+{
+	heap_tag_budget_t* budget = &heap->tags[tag];
+	int64_t old_bytes = atomic_add64(&budget->bytes_in_use, size);
+	int64_t new_bytes = old_bytes + size;
+
+	if (budget->hard_budget && new_bytes > (int64_t)budget->hard_budget)
+	{
+		atomic_add64(&budget->bytes_in_use, -(int64_t)size);
+		debug_print(
+			k_print_error,
+			"Heap budget for %s exceeded: %zu bytes requested, %lld of %zu in use.\n",
+			k_heap_tag_names[tag], size, (long long)old_bytes, budget->hard_budget);
+		return false;
+	}
+
+	// Warn only as the soft budget is crossed, not on every allocation above it.
+	if (budget->soft_budget &&
+		old_bytes <= (int64_t)budget->soft_budget &&
+		new_bytes > (int64_t)budget->soft_budget)
+	{
+		debug_print(
+			k_print_warning,
+			"Heap soft budget for %s exceeded: %lld of %zu bytes in use.\n",
+			k_heap_tag_names[tag], (long long)new_bytes, budget->soft_budget);
+	}
+
+	int64_t peak = budget->bytes_peak;
+	while (new_bytes > peak)
+	{
+		int64_t old_peak = atomic_compare_and_exchange64(&budget->bytes_peak, peak, new_bytes);
+		if (old_peak == peak)
+		{
+			break;
+		}
+		peak = old_peak;
+	}
+	return true;
+}
+
+static void heap_tag_release(heap_t* heap, heap_tag_header_t* header)
+{
+	atomic_add64(&heap->tags[header->tag].bytes_in_use, -(int64_t)header->size);
+}
+
+// Take the heap lock, then return any blocks other threads freed in the meantime.
+static void heap_lock(heap_t* heap)
+{
+	mutex_lock(heap->mutex);
+	heap_remote_drain_locked(heap);
+}
+
+// Return every block pushed by heap_remote_push so far.
+static void heap_remote_drain_locked(heap_t* heap)
+{
+	heap_cache_block_t* block = atomic_exchange_pointer((void**)&heap->remote_frees, NULL);
+	while (block)
+	{
+		heap_cache_block_t* next = block->next;
+		heap_free_locked(heap, block);
+		block = next;
+	}
+}
+
+// Return a block to TLSF now if the lock is free, as it is unless another
+// thread is in the heap. Otherwise leave it for the lock holder to return.
+static void heap_free_block(heap_t* heap, void* address)
+{
+	if (!mutex_try_lock(heap->mutex))
+	{
+		heap_remote_push(heap, address, address);
+		return;
+	}
+	heap_remote_drain_locked(heap);
+	heap_free_locked(heap, address);
+	size_t bytes_in_use = heap_bytes_in_use_locked(heap);
+	trace_t* trace = heap->trace;
+	mutex_unlock(heap->mutex);
+
+	heap_report(bytes_in_use, trace);
+}
+
+// Bytes in use in TLSF and in large allocations.
+// Large allocations may be mapped or unmapped meanwhile, so the total is a snapshot.
+static size_t heap_bytes_in_use_locked(heap_t* heap)
+{
+	return heap->bytes_in_use + (size_t)atomic_load64_explicit(&heap->large_bytes, k_atomic_relaxed);
+}
+
+// Push a chain of freed blocks for the next lock holder to return.
+// Many threads may push at once; the chain is only ever taken whole, so there is no ABA problem.
+static void heap_remote_push(heap_t* heap, heap_cache_block_t* first, heap_cache_block_t* last)
+{
+	heap_cache_block_t* head = heap->remote_frees;
+	while (true)
+	{
+		last->next = head;
+		heap_cache_block_t* old_head = atomic_compare_and_exchange_pointer((void**)&heap->remote_frees, head, first);
+		if (old_head == head)
+		{
+			break;
+		}
+		head = old_head;
+	}
+}
+
+static int heap_histogram_bucket(size_t size)
+{
+	int bucket = 0;
+	while (size > 1 && bucket < k_heap_histogram_bucket_count - 1)
+	{
+		size >>= 1;
+		++bucket;
+	}
+	return bucket;
+}
+
+static void heap_report(size_t bytes_in_use, trace_t* trace)
+{
+	if (trace)
+	{
+		trace_counter(trace, "heap bytes in use", bytes_in_use);
+	}
+}
+
+static heap_cache_t* heap_cache_get(heap_t* heap)
+{
+#if defined(_WIN32)
+	heap_cache_t* cache = TlsGetValue(heap->cache_index);
+#else
+	heap_cache_t* cache = pthread_getspecific(heap->cache_index);
+#endif
+	if (!cache)
+	{
+		heap_lock(heap);
+		cache = heap_alloc_locked(heap, sizeof(heap_cache_t), 8);
+		if (cache)
+		{
+			memset(cache, 0, sizeof(*cache));
+			cache->heap = heap;
+#if defined(_WIN32)
+			cache->thread = OpenThread(SYNCHRONIZE, FALSE, GetCurrentThreadId());
+#endif
+			cache->next = heap->caches;
+			heap->caches = cache;
+		}
+		mutex_unlock(heap->mutex);
+
+#if defined(_WIN32)
+		TlsSetValue(heap->cache_index, cache);
+#else
+		pthread_setspecific(heap->cache_index, cache);
+#endif
+	}
+	return cache;
+}
+
+static void heap_cache_refill(heap_t* heap, heap_cache_class_t* cache_class, int size_class)
+{
+	size_t size = k_heap_cache_class_sizes[size_class];
+
+	heap_lock(heap);
+	for (int i = 0; i < k_heap_cache_batch_blocks; ++i)
+	{
+		heap_cache_block_t* block = heap_alloc_locked(heap, size, k_heap_cache_alignment);
+		if (!block)
+		{
+			break;
+		}
+		block->next = cache_class->head;
+		cache_class->head = block;
+		cache_class->count++;
+	}
+	size_t bytes_in_use = heap_bytes_in_use_locked(heap);
+	trace_t* trace = heap->trace;
+	mutex_unlock(heap->mutex);
+
+	heap_report(bytes_in_use, trace);
+}
+
+static void heap_cache_flush(heap_t* heap, heap_cache_class_t* cache_class, int block_count)
+{
+	if (mutex_try_lock(heap->mutex))
+	{
+		heap_remote_drain_locked(heap);
+		heap_cache_release_locked(heap, cache_class, block_count);
+		mutex_unlock(heap->mutex);
+		return;
+	}
+
+	heap_cache_block_t* first = cache_class->head;
+	heap_cache_block_t* last = first;
+	cache_class->count--;
+	for (int i = 1; i < block_count && last->next; ++i)
+	{
+		last = last->next;
+		cache_class->count--;
+	}
+	cache_class->head = last->next;
+
+	heap_remote_push(heap, first, last);
+}
+
+static void heap_cache_release_locked(heap_t* heap, heap_cache_class_t* cache_class, int block_count)
+{
+	for (int i = 0; i < block_count && cache_class->head; ++i)
+	{
+		heap_cache_block_t* block = cache_class->head;
+		cache_class->head = block->next;
+		cache_class->count--;
+		heap_free_locked(heap, block);
+	}
+}
+
+// Return a cache's blocks and counts to the heap and free it.
+static void heap_cache_destroy_locked(heap_t* heap, heap_cache_t* cache)
+{
+	for (int i = 0; i < k_heap_cache_class_count; ++i)
+	{
+		heap_cache_release_locked(heap, &cache->classes[i], cache->classes[i].count);
+	}
+	for (int i = 0; i < k_heap_histogram_bucket_count; ++i)
+	{
+		heap->size_histogram[i] += cache->size_histogram[i];
+	}
+
+	heap_cache_t** link = &heap->caches;
+	while (*link != cache)
+	{
+		link = &(*link)->next;
+	}
+	*link = cache->next;
+
+#if defined(_WIN32)
+	CloseHandle(cache->thread);
+#endif
+	heap_free_locked(heap, cache);
+}
+
+#if !defined(_WIN32)
+// Called by the OS as a thread exits.
+// Returns the thread's cached blocks so they are not stranded.
+// Nothing is reported to the trace: that could allocate on the exiting thread.
+static void heap_cache_thread_exit(void* data)
+{
+	heap_cache_t* cache = data;
+	heap_t* heap = cache->heap;
+
+	heap_lock(heap);
+	heap_cache_destroy_locked(heap, cache);
+	mutex_unlock(heap->mutex);
 }
+#endif
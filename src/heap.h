@@ -1,25 +1,164 @@
 #pragma once
 
+#include <stdint.h>
 #include <stdlib.h>
 
 // Heap Memory Manager
 // 
 // Main object, heap_t, represents a dynamic memory heap.
 // Once created, memory can be allocated and free from the heap.
+// Small allocations are served from per-thread caches without locking.
+// Address space is reserved up front and committed as the heap grows,
+// so the heap extends in place rather than as separate pools.
 
 // Handle to a heap.
 typedef struct heap_t heap_t;
 
+typedef struct trace_t trace_t;
+
+// Flags for heap_create().
+typedef enum heap_flags_t
+{
+	// Back the heap with 2 MB huge pages to reduce TLB misses.
+	// Falls back to transparent huge pages where available, then regular pages.
+	// Huge page arenas stay committed until the heap is destroyed.
+	k_heap_flag_huge_pages = 1 << 0,
+
+	// Record the size and callstack of every live allocation.
+	// Allocations still live at heap_destroy are reported, grouped by callstack.
+	k_heap_flag_track_leaks = 1 << 1,
+} heap_flags_t;
+
+// Subsystems that memory can be attributed to with heap_alloc_tagged().
+typedef enum heap_tag_t
+{
+	k_heap_tag_render,
+	k_heap_tag_fs,
+	k_heap_tag_net,
+	k_heap_tag_ecs,
+	k_heap_tag_game,
+
+	k_heap_tag_count,
+} heap_tag_t;
+
+// Memory use and budgets for one tag.
+typedef struct heap_tag_stats_t
+{
+	size_t bytes_in_use;
+	size_t bytes_peak;
+	size_t soft_budget;
+	size_t hard_budget;
+} heap_tag_stats_t;
+
+enum
+{
+	// Number of buckets in the allocation size histogram.
+	k_heap_histogram_bucket_count = 32,
+};
+
+// Snapshot of heap usage.
+// Blocks held in per-thread caches count as in use.
+typedef struct heap_stats_t
+{
+	// Bytes allocated right now and the most ever allocated at once.
+	size_t bytes_in_use;
+	size_t bytes_peak;
+
+	// Address space reserved from the OS, how much of it is backed
+	// by memory, and how much of the committed memory is free.
+	size_t bytes_reserved;
+	size_t bytes_committed;
+	size_t bytes_free;
+
+	// Largest single allocation that could be served without growing.
+	size_t largest_free_block;
+
+	// Number of separate address ranges reserved from the OS.
+	int arena_count;
+
+	// Allocations mapped directly from the OS, and their total size.
+	// These are counted in bytes in use but not in the arena totals.
+	int large_count;
+	size_t large_bytes;
+
+	// Zero when all free memory is one block, approaching one as free
+	// memory is split into many small blocks: 1 - largest / total free.
+	float fragmentation;
+
+	// Number of allocations ever made by requested size.
+	// Bucket i counts sizes from 2^i up to 2^(i+1); the last bucket counts all larger sizes.
+	uint64_t size_histogram[k_heap_histogram_bucket_count];
+} heap_stats_t;
+
 // Creates a new memory heap.
 // The grow increment is the default size with which the heap grows.
 // Should be a multiple of OS page size.
-heap_t* heap_create(size_t grow_increment);
+// Flags are a combination of heap_flags_t values.
+heap_t* heap_create(size_t grow_increment, uint32_t flags);
 
 // Destroy a previously created heap.
 void heap_destroy(heap_t* heap);
 
 // Allocate memory from a heap.
+// Safe for multiple threads to allocate at the same time.
 void* heap_alloc(heap_t* heap, size_t size, size_t alignment);
 
+// Allocate memory from a heap and attribute it to a subsystem.
+// Costs a small header per allocation. Free with heap_free as usual.
+// Returns NULL if the allocation would exceed the tag's hard budget.
+void* heap_alloc_tagged(heap_t* heap, size_t size, size_t alignment, heap_tag_t tag);
+
 // Free memory previously allocated from a heap.
+// Memory may be freed on a different thread than it was allocated on.
+// Heap blocks never wait on the lock: those not kept in the calling thread's
+// cache are returned at once if the lock is free, and otherwise queued
+// lock-free and returned by the thread holding it.
+// Large allocations are unmapped at once under a lock of their own.
 void heap_free(heap_t* heap, void* address);
+
+// Resize memory previously allocated from a heap.
+// Grows into the adjacent free block where possible, otherwise moves the
+// contents to a new allocation. Returns the new address, or NULL on failure,
+// in which case the original memory is untouched.
+// A NULL address allocates; a zero size frees and returns NULL.
+void* heap_realloc(heap_t* heap, void* address, size_t size, size_t alignment);
+
+// Set budgets for memory allocated with a tag. Zero means no budget.
+// Exceeding the soft budget logs a warning; the hard budget fails allocations.
+// Overruns are also reported by heap_trace_stats.
+void heap_set_budget(heap_t* heap, heap_tag_t tag, size_t soft_bytes, size_t hard_bytes);
+
+// Get memory use and budgets for a tag.
+void heap_get_tag_stats(heap_t* heap, heap_tag_t tag, heap_tag_stats_t* stats);
+
+// Set the size at and above which allocations are mapped directly from the OS.
+// Freeing such an allocation unmaps it immediately. Defaults to 1 MB.
+// Use the size histogram from heap_get_stats to choose a threshold.
+void heap_set_large_threshold(heap_t* heap, size_t size);
+
+// Configure when free memory is returned to the OS.
+// Free pages at the end of an arena are decommitted once they have been free
+// for idle_ms, or sooner, oldest first, while they together exceed retain_bytes.
+// Arenas other than the first are released whole once entirely free.
+// Defaults to 5000 ms and one grow increment.
+void heap_set_trim(heap_t* heap, uint32_t idle_ms, size_t retain_bytes);
+
+// Return free memory to the OS according to the trim settings.
+// Also takes back blocks cached by threads that have since exited.
+// Intended to be called once per frame.
+void heap_trim(heap_t* heap);
+
+// Gather usage and fragmentation statistics for a heap.
+// Walks every block in the heap while holding its lock.
+// Blocks queued by heap_free are returned first, so they count as free.
+void heap_get_stats(heap_t* heap, heap_stats_t* stats);
+
+// Report heap statistics to the heap's trace as counters.
+// Intended to be called once per frame.
+// Does nothing unless a trace is set and capturing; see heap_get_stats for the cost.
+void heap_trace_stats(heap_t* heap);
+
+// Report heap usage to a trace as a counter of bytes in use.
+// Blocks held in per-thread caches count as in use.
+// Pass NULL to stop reporting; do so before the trace is destroyed.
+void heap_set_trace(heap_t* heap, trace_t* trace);
@@ -0,0 +1,474 @@
+#include "heap_bench.h"
+
+#include "atomic.h"
+#include "debug.h"
+#include "event.h"
+#include "heap.h"
+#include "thread.h"
+#include "timer.h"
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#if !defined(_WIN32)
+#define __min(a, b) ((a) < (b) ? (a) : (b))
+#define __max(a, b) ((a) > (b) ? (a) : (b))
+#define _countof(a) (sizeof(a) / sizeof((a)[0]))
+#endif
+
+enum
+{
+	k_heap_bench_max_threads = 64,
+	k_heap_bench_page_size = 4096,
+	// Period at which the main thread samples resident memory during a run.
+	k_heap_bench_rss_sample_ms = 1,
+
+	k_heap_bench_render_frames = 500,
+	k_heap_bench_render_commands = 256,
+	k_heap_bench_render_frames_in_flight = 3,
+
+	k_heap_bench_fs_buffers = 4000,
+	k_heap_bench_fs_in_flight = 4,
+
+	k_heap_bench_net_packets = 100000,
+	k_heap_bench_net_in_flight = 64,
+
+	k_heap_bench_mixed_steps = 200000,
+	k_heap_bench_mixed_slots = 1024,
+
+	// Blocks freed by each thread in the remote free check,
+	// all too large for the per-thread caches.
+	k_heap_bench_remote_blocks = 4096,
+	k_heap_bench_remote_block_size = 4096,
+};
+
+// Allocator under test.
+typedef struct heap_bench_allocator_t
+{
+	const char* name;
+	// True for the engine heap; the run creates one and passes it to alloc and free.
+	bool is_heap;
+	void* (*alloc)(void* user, size_t size);
+	void (*free)(void* user, void* address);
+} heap_bench_allocator_t;
+
+// State shared by all threads in one run.
+typedef struct heap_bench_run_t
+{
+	const heap_bench_allocator_t* allocator;
+	heap_t* heap;
+	heap_bench_trace_t trace;
+	event_t* start;
+	// Threads still replaying the trace.
+	int running;
+	int64_t rss_base;
+	// Largest resident size seen by any sample so far.
+	int64_t rss_peak;
+	float fragmentation;
+} heap_bench_run_t;
+
+// Per thread state and results.
+typedef struct heap_bench_thread_t
+{
+	heap_bench_run_t* run;
+	int index;
+	uint64_t rng;
+	uint64_t ops;
+	uint64_t us;
+} heap_bench_thread_t;
+
+// Blocks one thread frees in the remote free check.
+typedef struct heap_bench_remote_t
+{
+	heap_t* heap;
+	event_t* start;
+	void* blocks[k_heap_bench_remote_blocks];
+} heap_bench_remote_t;
+
+static const char* const k_heap_bench_trace_names[] = { "render", "fs", "net", "mixed" };
+
+// Set once malloc has run in this process; see rss_comparable in heap_bench.h.
+static bool s_heap_bench_malloc_has_run = false;
+
+// Aligned as most engine allocations are, so small blocks come from the thread caches.
+static void* heap_bench_heap_alloc(void* user, size_t size)
+{
+	return heap_alloc(user, size, 8);
+}
+
+static void heap_bench_heap_free(void* user, void* address)
+{
+	heap_free(user, address);
+}
+
+static void* heap_bench_malloc(void* user, size_t size)
+{
+	return malloc(size);
+}
+
+static void heap_bench_malloc_free(void* user, void* address)
+{
+	free(address);
+}
+
+static const heap_bench_allocator_t k_heap_bench_allocators[] =
+{
+	{ "heap", true, heap_bench_heap_alloc, heap_bench_heap_free },
+	{ "malloc", false, heap_bench_malloc, heap_bench_malloc_free },
+};
+
+static uint64_t heap_bench_rand(heap_bench_thread_t* thread)
+{
+	// xorshift64*
+	thread->rng ^= thread->rng >> 12;
+	thread->rng ^= thread->rng << 25;
+	thread->rng ^= thread->rng >> 27;
+	return thread->rng * 0x2545f4914f6cdd1dull;
+}
+
+// Uniform size in [min, max).
+static size_t heap_bench_rand_size(heap_bench_thread_t* thread, size_t min, size_t max)
+{
+	return min + (size_t)(heap_bench_rand(thread) % (max - min));
+}
+
+static void* heap_bench_alloc(heap_bench_thread_t* thread, size_t size)
+{
+	void* address = thread->run->allocator->alloc(thread->run->heap, size);
+
+	// Write each page as the owner would, so both allocators pay for faulting memory in.
+	char* bytes = address;
+	for (size_t offset = 0; offset < size; offset += k_heap_bench_page_size)
+	{
+		bytes[offset] = 1;
+	}
+	bytes[size - 1] = 1;
+
+	++thread->ops;
+	return address;
+}
+
+static void heap_bench_free(heap_bench_thread_t* thread, void* address)
+{
+	if (address)
+	{
+		thread->run->allocator->free(thread->run->heap, address);
+		++thread->ops;
+	}
+}
+
+// Fold the current resident size into the run's peak. Safe from any thread.
+static void heap_bench_sample_rss(heap_bench_run_t* run)
+{
+	int64_t rss = (int64_t)vm_resident_bytes();
+	int64_t peak = atomic_load64_explicit(&run->rss_peak, k_atomic_relaxed);
+	while (rss > peak)
+	{
+		int64_t old_peak = atomic_compare_and_exchange64(&run->rss_peak, peak, rss);
+		if (old_peak == peak)
+		{
+			break;
+		}
+		peak = old_peak;
+	}
+}
+
+// Called by each thread with its working set at its largest, in addition
+// to the periodic samples, so the peak cannot fall between two of them.
+static void heap_bench_sample_peak(heap_bench_thread_t* thread)
+{
+	heap_bench_run_t* run = thread->run;
+	heap_bench_sample_rss(run);
+	if (thread->index == 0 && run->heap)
+	{
+		heap_stats_t stats;
+		heap_get_stats(run->heap, &stats);
+		run->fragmentation = stats.fragmentation;
+	}
+}
+
+static void heap_bench_trace_render(heap_bench_thread_t* thread)
+{
+	void* frames[k_heap_bench_render_frames_in_flight][k_heap_bench_render_commands] = { 0 };
+
+	for (int f = 0; f < k_heap_bench_render_frames; ++f)
+	{
+		void** commands = frames[f % k_heap_bench_render_frames_in_flight];
+		for (int c = 0; c < k_heap_bench_render_commands; ++c)
+		{
+			heap_bench_free(thread, commands[c]);
+
+			// Mostly draw commands, with a uniform buffer copy every eighth.
+			size_t size = (c % 8) == 7 ?
+				heap_bench_rand_size(thread, 256, 4096) :
+				heap_bench_rand_size(thread, 48, 256);
+			commands[c] = heap_bench_alloc(thread, size);
+		}
+	}
+
+	heap_bench_sample_peak(thread);
+
+	for (int f = 0; f < k_heap_bench_render_frames_in_flight; ++f)
+	{
+		for (int c = 0; c < k_heap_bench_render_commands; ++c)
+		{
+			heap_bench_free(thread, frames[f][c]);
+		}
+	}
+}
+
+static void heap_bench_trace_fs(heap_bench_thread_t* thread)
+{
+	void* buffers[k_heap_bench_fs_in_flight] = { 0 };
+
+	for (int i = 0; i < k_heap_bench_fs_buffers; ++i)
+	{
+		void** buffer = &buffers[heap_bench_rand(thread) % k_heap_bench_fs_in_flight];
+		heap_bench_free(thread, *buffer);
+
+		// Log-uniform from 256 bytes to 4 MB: config files through textures.
+		size_t size = (size_t)256 << (heap_bench_rand(thread) % 14);
+		size = heap_bench_rand_size(thread, size, size * 2);
+		*buffer = heap_bench_alloc(thread, size);
+	}
+
+	heap_bench_sample_peak(thread);
+
+	for (int i = 0; i < k_heap_bench_fs_in_flight; ++i)
+	{
+		heap_bench_free(thread, buffers[i]);
+	}
+}
+
+static void heap_bench_trace_net(heap_bench_thread_t* thread)
+{
+	void* packets[k_heap_bench_net_in_flight] = { 0 };
+
+	for (int i = 0; i < k_heap_bench_net_packets; ++i)
+	{
+		// Received packets are consumed in order; most are small state updates.
+		void** packet = &packets[i % k_heap_bench_net_in_flight];
+		heap_bench_free(thread, *packet);
+
+		size_t size = (heap_bench_rand(thread) % 4) == 0 ?
+			heap_bench_rand_size(thread, 512, 1500) :
+			heap_bench_rand_size(thread, 32, 160);
+		*packet = heap_bench_alloc(thread, size);
+	}
+
+	heap_bench_sample_peak(thread);
+
+	for (int i = 0; i < k_heap_bench_net_in_flight; ++i)
+	{
+		heap_bench_free(thread, packets[i]);
+	}
+}
+
+static void heap_bench_trace_mixed(heap_bench_thread_t* thread)
+{
+	void* slots[k_heap_bench_mixed_slots] = { 0 };
+
+	for (int i = 0; i < k_heap_bench_mixed_steps; ++i)
+	{
+		void** slot = &slots[heap_bench_rand(thread) % k_heap_bench_mixed_slots];
+		heap_bench_free(thread, *slot);
+
+		uint64_t pick = heap_bench_rand(thread) % 100;
+		size_t size =
+			pick < 80 ? heap_bench_rand_size(thread, 16, 256) :
+			pick < 95 ? heap_bench_rand_size(thread, 256, 4096) :
+			heap_bench_rand_size(thread, 4096, 65536);
+		*slot = heap_bench_alloc(thread, size);
+	}
+
+	heap_bench_sample_peak(thread);
+
+	for (int i = 0; i < k_heap_bench_mixed_slots; ++i)
+	{
+		heap_bench_free(thread, slots[i]);
+	}
+}
+
+static int heap_bench_thread_func(void* user)
+{
+	heap_bench_thread_t* thread = user;
+
+	event_wait(thread->run->start);
+
+	uint64_t t0 = timer_get_ticks();
+
+	switch (thread->run->trace)
+	{
+	case k_heap_bench_trace_render: heap_bench_trace_render(thread); break;
+	case k_heap_bench_trace_fs: heap_bench_trace_fs(thread); break;
+	case k_heap_bench_trace_net: heap_bench_trace_net(thread); break;
+	case k_heap_bench_trace_mixed: heap_bench_trace_mixed(thread); break;
+	default: break;
+	}
+
+	thread->us = timer_ticks_to_us(timer_get_ticks() - t0);
+	atomic_decrement(&thread->run->running);
+	return 0;
+}
+
+static void heap_bench_run_allocator(const heap_bench_allocator_t* allocator, heap_bench_trace_t trace, int thread_count)
+{
+	bool rss_comparable = allocator->is_heap || !s_heap_bench_malloc_has_run;
+	s_heap_bench_malloc_has_run |= !allocator->is_heap;
+
+	heap_bench_run_t run =
+	{
+		.allocator = allocator,
+		.heap = allocator->is_heap ? heap_create(2 * 1024 * 1024, 0) : NULL,
+		.trace = trace,
+		.start = event_create(),
+		.running = thread_count,
+	};
+
+	heap_bench_thread_t threads[k_heap_bench_max_threads];
+	thread_t* handles[k_heap_bench_max_threads];
+	for (int i = 0; i < thread_count; ++i)
+	{
+		threads[i] = (heap_bench_thread_t)
+		{
+			.run = &run,
+			.index = i,
+			.rng = 0x9e3779b97f4a7c15ull * (i + 1),
+		};
+		handles[i] = thread_create(heap_bench_thread_func, &threads[i], NULL);
+	}
+
+	// Every figure is taken with the allocator alive and the threads created,
+	// so the heap's initial arena and the thread stacks cancel out of the deltas.
+	run.rss_base = (int64_t)vm_resident_bytes();
+	run.rss_peak = run.rss_base;
+
+	uint64_t t0 = timer_get_ticks();
+	event_signal(run.start);
+
+	while (atomic_load(&run.running))
+	{
+		heap_bench_sample_rss(&run);
+		thread_sleep(k_heap_bench_rss_sample_ms);
+	}
+
+	uint64_t ops = 0;
+	uint64_t thread_us = 0;
+	for (int i = 0; i < thread_count; ++i)
+	{
+		ops += threads[i].ops;
+		thread_us += threads[i].us;
+	}
+	uint64_t wall_us = timer_ticks_to_us(timer_get_ticks() - t0);
+
+	// What the allocator holds on to once everything is freed.
+	// It counts as a sample too, so the peak is never below it.
+	int64_t rss_retained = (int64_t)vm_resident_bytes();
+	run.rss_peak = __max(run.rss_peak, rss_retained);
+
+	for (int i = 0; i < thread_count; ++i)
+	{
+		thread_destroy(handles[i]);
+	}
+	event_destroy(run.start);
+
+	char fragmentation[16] = "null";
+	if (run.heap)
+	{
+		heap_destroy(run.heap);
+		snprintf(fragmentation, sizeof(fragmentation), "%.3f", run.fragmentation);
+	}
+	debug_print(k_print_info,
+		"{\"allocator\":\"%s\",\"trace\":\"%s\",\"threads\":%d,\"ops\":%llu,\"ns_per_op\":%.1f,"
+		"\"mops_per_sec\":%.2f,\"rss_peak_bytes\":%lld,\"rss_retained_bytes\":%lld,\"rss_comparable\":%s,\"fragmentation\":%s}\n",
+		allocator->name,
+		k_heap_bench_trace_names[trace],
+		thread_count,
+		(unsigned long long)ops,
+		ops ? thread_us * 1000.0 / ops : 0.0,
+		wall_us ? (double)ops / wall_us : 0.0,
+		(long long)(run.rss_peak - run.rss_base),
+		(long long)(rss_retained - run.rss_base),
+		rss_comparable ? "true" : "false",
+		fragmentation);
+}
+
+const char* heap_bench_trace_name(heap_bench_trace_t trace)
+{
+	return k_heap_bench_trace_names[trace];
+}
+
+void heap_bench_run_trace(heap_bench_trace_t trace, int max_threads)
+{
+	max_threads = __min(max_threads, k_heap_bench_max_threads);
+
+	for (int thread_count = 1; thread_count <= max_threads; thread_count *= 2)
+	{
+		for (size_t i = 0; i < _countof(k_heap_bench_allocators); ++i)
+		{
+			heap_bench_run_allocator(&k_heap_bench_allocators[i], trace, thread_count);
+		}
+	}
+}
+
+static int heap_bench_remote_thread_func(void* user)
+{
+	heap_bench_remote_t* remote = user;
+	event_wait(remote->start);
+	for (int i = 0; i < k_heap_bench_remote_blocks; ++i)
+	{
+		heap_free(remote->heap, remote->blocks[i]);
+	}
+	return 0;
+}
+
+bool heap_bench_check_remote_frees(int thread_count)
+{
+	// At least two threads, so that some frees find the lock held.
+	thread_count = __min(__max(thread_count, 2), k_heap_bench_max_threads);
+
+	heap_t* heap = heap_create(2 * 1024 * 1024, 0);
+	event_t* start = event_create();
+	// Not from malloc, which would leave memory resident under the malloc runs.
+	heap_bench_remote_t* remotes = heap_alloc(heap, sizeof(heap_bench_remote_t) * thread_count, 8);
+	thread_t* handles[k_heap_bench_max_threads];
+	for (int i = 0; i < thread_count; ++i)
+	{
+		remotes[i].heap = heap;
+		remotes[i].start = start;
+		for (int b = 0; b < k_heap_bench_remote_blocks; ++b)
+		{
+			remotes[i].blocks[b] = heap_alloc(heap, k_heap_bench_remote_block_size + (b % 8) * 64, 8);
+		}
+		handles[i] = thread_create(heap_bench_remote_thread_func, &remotes[i], NULL);
+	}
+
+	event_signal(start);
+	for (int i = 0; i < thread_count; ++i)
+	{
+		thread_destroy(handles[i]);
+	}
+	heap_free(heap, remotes);
+
+	heap_stats_t stats;
+	heap_get_stats(heap, &stats);
+	if (stats.bytes_in_use)
+	{
+		debug_print(k_print_error,
+			"heap_bench: %zu bytes still in use after freeing everything on %d threads\n",
+			stats.bytes_in_use, thread_count);
+	}
+
+	event_destroy(start);
+	heap_destroy(heap);
+	return stats.bytes_in_use == 0;
+}
+
+void heap_bench_run(int max_threads)
+{
+	for (int trace = 0; trace < k_heap_bench_trace_count; ++trace)
+	{
+		heap_bench_run_trace(trace, max_threads);
+	}
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Heap Benchmarks
+//
+// Replays allocation traces modeled on engine subsystems against
+// heap_alloc/heap_free and against the C runtime malloc/free,
+// on 1, 2, 4, ... threads sharing one allocator.
+// Results are printed with debug_print, one JSON object per line:
+//
+//   {"allocator":"heap","trace":"render","threads":2,"ops":1536000,
+//    "ns_per_op":41.2,"mops_per_sec":44.10,"rss_peak_bytes":1310720,
+//    "rss_retained_bytes":65536,"rss_comparable":true,"fragmentation":0.031}
+//
+// ns_per_op is thread time per allocation or free.
+// RSS figures are process-wide deltas from the start of the run, taken with
+// the allocator created and the threads started. Peak is the largest of
+// samples taken every millisecond and by each thread at its largest working
+// set; retained is taken once every thread has freed everything, before the
+// allocator is destroyed. Each heap run maps and releases its own memory,
+// but the C runtime keeps memory from earlier malloc runs resident and
+// reuses it, so only the first malloc run in a process has RSS figures that
+// compare with the heap's. rss_comparable is false for the others; run one
+// trace on one thread count per process to compare every malloc result.
+// Fragmentation is null for malloc.
+// Requires timer_startup to have been called.
+
+// Allocation trace to replay.
+typedef enum heap_bench_trace_t
+{
+	// Per-frame command and uniform buffers, freed three frames later.
+	k_heap_bench_trace_render,
+	// File buffers from a few hundred bytes to a few megabytes, few alive at once.
+	k_heap_bench_trace_fs,
+	// Packet sized blocks freed in arrival order.
+	k_heap_bench_trace_net,
+	// Random sizes with random lifetimes.
+	k_heap_bench_trace_mixed,
+
+	k_heap_bench_trace_count,
+} heap_bench_trace_t;
+
+// Get the name of a trace as it appears in results.
+const char* heap_bench_trace_name(heap_bench_trace_t trace);
+
+// Replay one trace against both allocators on 1, 2, 4, ... up to max_threads threads.
+void heap_bench_run_trace(heap_bench_trace_t trace, int max_threads);
+
+// Replay every trace against both allocators on up to max_threads threads.
+void heap_bench_run(int max_threads);
+
+// Check that blocks freed on other threads, some of them while another
+// thread holds the heap lock, are counted as free by heap_get_stats.
+// Prints an error and returns false if any are still counted in use.
+bool heap_bench_check_remote_frees(int thread_count);
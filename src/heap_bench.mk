@@ -0,0 +1,41 @@
+# Stand-alone heap benchmark for Linux; see heap_bench_main.c.
+# From the src directory:
+#
+#   make -f heap_bench.mk
+#
+# Lists every source the benchmark links, so a new dependency of the heap
+# or its locks shows up here as a link error rather than in a stale comment.
+
+CC ?= cc
+CFLAGS ?= -O2
+CFLAGS += -I. -Wall
+LDLIBS += -lpthread
+
+# atomic.c spells out the 16-byte compare-and-exchange only for x86-64;
+# elsewhere the compiler builtin may call into libatomic.
+ifneq ($(shell uname -m),x86_64)
+LDLIBS += -latomic
+endif
+
+heap_bench_sources = \
+	heap_bench_main.c \
+	heap_bench.c \
+	heap.c \
+	heap_track.c \
+	vm.c \
+	mutex.c \
+	event.c \
+	futex.c \
+	timer.c \
+	debug.c \
+	atomic.c \
+	thread.c \
+	tlsf/tlsf.c
+
+heap_bench: $(heap_bench_sources) $(wildcard *.h)
+	$(CC) $(CFLAGS) -o $@ $(heap_bench_sources) $(LDLIBS)
+
+clean:
+	rm -f heap_bench
+
+.PHONY: clean
@@ -0,0 +1,60 @@
+// Stand-alone heap benchmark.
+//
+// Not part of the game project, which has its own main.
+// On Linux, build from the src directory with:
+//
+//   make -f heap_bench.mk
+//
+// Usage: heap_bench [max_threads] [render|fs|net|mixed]
+// Prints one JSON object per line to stdout; see heap_bench.h for the fields.
+
+#include "debug.h"
+#include "heap_bench.h"
+#include "timer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include "trace.h"
+
+// heap.c reports counters through trace.c, which only builds on Windows.
+// The benchmark never attaches a trace to its heaps, so these stand in for it.
+void trace_counter(trace_t* trace, const char* name, int64_t value)
+{
+}
+
+bool trace_is_capturing(trace_t* trace)
+{
+	return false;
+}
+#endif
+
+int main(int argc, const char* argv[])
+{
+	debug_set_print_mask(k_print_info | k_print_warning | k_print_error);
+	timer_startup();
+
+	int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+	if (!heap_bench_check_remote_frees(max_threads))
+	{
+		return 1;
+	}
+
+	if (argc > 2)
+	{
+		for (int trace = 0; trace < k_heap_bench_trace_count; ++trace)
+		{
+			if (strcmp(argv[2], heap_bench_trace_name(trace)) == 0)
+			{
+				heap_bench_run_trace(trace, max_threads);
+				return 0;
+			}
+		}
+		debug_print(k_print_error, "heap_bench: unknown trace '%s'\n", argv[2]);
+		return 1;
+	}
+
+	heap_bench_run(max_threads);
+	return 0;
+}
@@ -0,0 +1,375 @@
+#include "heap_track.h"
+
+#include "atomic.h"
+#include "debug.h"
+#include "mutex.h"
+#include "vm.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum
+{
+	k_heap_track_stack_depth = 16,
+	k_heap_track_stack_capacity = 1 << 16,
+	// A power of two; addresses are spread over the shards by hash.
+	k_heap_track_shard_bits = 4,
+	k_heap_track_shard_count = 1 << k_heap_track_shard_bits,
+	k_heap_track_initial_entry_capacity = (1 << 16) / k_heap_track_shard_count,
+	k_heap_track_report_stack_count = 32,
+	k_heap_track_cache_line = 64,
+};
+
+// A unique callstack, shared by all allocations made from it.
+// Depth is stored last, so a nonzero depth means the rest is written.
+typedef struct heap_track_stack_t
+{
+	uint64_t hash;
+	int depth;
+	void* frames[k_heap_track_stack_depth];
+} heap_track_stack_t;
+
+// A live allocation. A NULL address marks an empty slot.
+typedef struct heap_track_entry_t
+{
+	void* address;
+	size_t size;
+	uint32_t stack;
+} heap_track_entry_t;
+
+// Allocations in one shard of the table, under the shard's own lock.
+typedef struct heap_track_shard_t
+{
+	mutex_t* mutex;
+	heap_track_entry_t* entries;
+	size_t entry_capacity;
+	size_t entry_count;
+	char pad[k_heap_track_cache_line - 2 * sizeof(void*) - 2 * sizeof(size_t)];
+} heap_track_shard_t;
+
+// Allocations and callstacks are each kept in open-addressed hash tables
+// with linear probing. Allocations are split over shards by address, so
+// threads only contend when they touch the same shard. Callstacks are never
+// removed, so a callstack's slot doubles as its identifier, and a known
+// callstack is found without locking. One extra callstack slot past the end
+// of the table collects allocations once the table is half full.
+typedef struct heap_track_t
+{
+	// First, so each shard starts on its own cache line.
+	heap_track_shard_t shards[k_heap_track_shard_count];
+
+	mutex_t* stack_mutex;
+	heap_track_stack_t* stacks;
+	size_t stack_count;
+} heap_track_t;
+
+typedef struct heap_track_group_t
+{
+	uint32_t stack;
+	size_t count;
+	size_t bytes;
+} heap_track_group_t;
+
+static uint64_t heap_track_hash(void* address);
+static heap_track_shard_t* heap_track_shard(heap_track_t* track, void* address);
+static size_t heap_track_entry_home(heap_track_shard_t* shard, void* address);
+static size_t heap_track_entry_slot(heap_track_shard_t* shard, void* address);
+static void heap_track_entries_grow(heap_track_shard_t* shard);
+static uint32_t heap_track_stack_get(heap_track_t* track, void** frames, int depth);
+static uint32_t heap_track_stack_find(heap_track_t* track, uint64_t hash, void** frames, int depth, size_t* slot);
+static void heap_track_unlock_all(heap_track_t* track);
+static int heap_track_group_compare(const void* a, const void* b);
+
+heap_track_t* heap_track_create()
+{
+	size_t size = sizeof(heap_track_t) + sizeof(heap_track_stack_t) * (k_heap_track_stack_capacity + 1);
+	heap_track_t* track = vm_reserve(size);
+	if (!track || !vm_commit(track, size))
+	{
+		return NULL;
+	}
+
+	track->stack_mutex = mutex_create();
+	track->stacks = (heap_track_stack_t*)(track + 1);
+	track->stack_count = 0;
+
+	for (int i = 0; i < k_heap_track_shard_count; ++i)
+	{
+		heap_track_shard_t* shard = &track->shards[i];
+		shard->mutex = mutex_create();
+		shard->entry_capacity = k_heap_track_initial_entry_capacity;
+		shard->entry_count = 0;
+		shard->entries = vm_reserve(sizeof(heap_track_entry_t) * shard->entry_capacity);
+		vm_commit(shard->entries, sizeof(heap_track_entry_t) * shard->entry_capacity);
+	}
+
+	return track;
+}
+
+void heap_track_destroy(heap_track_t* track)
+{
+	for (int i = 0; i < k_heap_track_shard_count; ++i)
+	{
+		heap_track_shard_t* shard = &track->shards[i];
+		vm_release(shard->entries, sizeof(heap_track_entry_t) * shard->entry_capacity);
+		mutex_destroy(shard->mutex);
+	}
+	mutex_destroy(track->stack_mutex);
+	vm_release(track, sizeof(heap_track_t) + sizeof(heap_track_stack_t) * (k_heap_track_stack_capacity + 1));
+}
+
+void heap_track_alloc(heap_track_t* track, void* address, size_t size)
+{
+	// Capture and look up the callstack outside the lock; they are the most expensive part.
+	void* frames[k_heap_track_stack_depth];
+	int depth = debug_backtrace(frames, k_heap_track_stack_depth);
+	uint32_t stack = heap_track_stack_get(track, frames, depth);
+
+	heap_track_shard_t* shard = heap_track_shard(track, address);
+	mutex_lock(shard->mutex);
+
+	if ((shard->entry_count + 1) * 2 > shard->entry_capacity)
+	{
+		heap_track_entries_grow(shard);
+	}
+
+	heap_track_entry_t* entry = &shard->entries[heap_track_entry_slot(shard, address)];
+	if (!entry->address)
+	{
+		entry->address = address;
+		shard->entry_count++;
+	}
+	entry->size = size;
+	entry->stack = stack;
+
+	mutex_unlock(shard->mutex);
+}
+
+void heap_track_free(heap_track_t* track, void* address)
+{
+	heap_track_shard_t* shard = heap_track_shard(track, address);
+	mutex_lock(shard->mutex);
+
+	size_t mask = shard->entry_capacity - 1;
+	size_t slot = heap_track_entry_slot(shard, address);
+	if (shard->entries[slot].address)
+	{
+		shard->entry_count--;
+
+		// Shift later entries in the probe sequence back into the hole,
+		// so lookups never need tombstones.
+		size_t hole = slot;
+		for (size_t next = (hole + 1) & mask; shard->entries[next].address; next = (next + 1) & mask)
+		{
+			size_t home = heap_track_entry_home(shard, shard->entries[next].address);
+			if (((next - home) & mask) >= ((next - hole) & mask))
+			{
+				shard->entries[hole] = shard->entries[next];
+				hole = next;
+			}
+		}
+		shard->entries[hole].address = NULL;
+	}
+
+	mutex_unlock(shard->mutex);
+}
+
+size_t heap_track_report(heap_track_t* track)
+{
+	// Hold every shard, in order, so the report is one consistent snapshot.
+	size_t live_count = 0;
+	for (int i = 0; i < k_heap_track_shard_count; ++i)
+	{
+		mutex_lock(track->shards[i].mutex);
+		live_count += track->shards[i].entry_count;
+	}
+	mutex_lock(track->stack_mutex);
+
+	if (!live_count)
+	{
+		heap_track_unlock_all(track);
+		return 0;
+	}
+
+	// Total the live allocations by callstack.
+	size_t groups_size = sizeof(heap_track_group_t) * (k_heap_track_stack_capacity + 1);
+	heap_track_group_t* groups = vm_reserve(groups_size);
+	vm_commit(groups, groups_size);
+
+	size_t live_bytes = 0;
+	for (int s = 0; s < k_heap_track_shard_count; ++s)
+	{
+		heap_track_shard_t* shard = &track->shards[s];
+		for (size_t i = 0; i < shard->entry_capacity; ++i)
+		{
+			heap_track_entry_t* entry = &shard->entries[i];
+			if (entry->address)
+			{
+				groups[entry->stack].stack = entry->stack;
+				groups[entry->stack].count++;
+				groups[entry->stack].bytes += entry->size;
+				live_bytes += entry->size;
+			}
+		}
+	}
+	qsort(groups, k_heap_track_stack_capacity + 1, sizeof(heap_track_group_t), heap_track_group_compare);
+
+	debug_print(
+		k_print_warning,
+		"Heap leak report: %zu bytes in %zu allocations still live.\n",
+		live_bytes, live_count);
+	for (int i = 0; i < k_heap_track_report_stack_count && groups[i].count; ++i)
+	{
+		debug_print(
+			k_print_warning,
+			"  %zu bytes in %zu allocations from:\n",
+			groups[i].bytes, groups[i].count);
+
+		heap_track_stack_t* stack = &track->stacks[groups[i].stack];
+		if (!stack->depth)
+		{
+			debug_print(k_print_warning, "    (callstack not recorded)\n");
+		}
+		for (int f = 0; f < stack->depth; ++f)
+		{
+			debug_print(k_print_warning, "    %p\n", stack->frames[f]);
+		}
+	}
+
+	vm_release(groups, groups_size);
+
+	heap_track_unlock_all(track);
+
+	return live_count;
+}
+
+static void heap_track_unlock_all(heap_track_t* track)
+{
+	mutex_unlock(track->stack_mutex);
+	for (int i = k_heap_track_shard_count - 1; i >= 0; --i)
+	{
+		mutex_unlock(track->shards[i].mutex);
+	}
+}
+
+// Fibonacci hashing; the low bits of addresses are mostly alignment.
+// The top bits pick the shard and the low bits the slot within it.
+static uint64_t heap_track_hash(void* address)
+{
+	return ((uint64_t)(uintptr_t)address >> 3) * 0x9e3779b97f4a7c15ull;
+}
+
+static heap_track_shard_t* heap_track_shard(heap_track_t* track, void* address)
+{
+	return &track->shards[heap_track_hash(address) >> (64 - k_heap_track_shard_bits)];
+}
+
+// Slot where an address would be if there were no collisions.
+static size_t heap_track_entry_home(heap_track_shard_t* shard, void* address)
+{
+	return (size_t)heap_track_hash(address) & (shard->entry_capacity - 1);
+}
+
+// Find the slot holding an address, or the empty slot where it belongs.
+static size_t heap_track_entry_slot(heap_track_shard_t* shard, void* address)
+{
+	size_t mask = shard->entry_capacity - 1;
+	size_t slot = heap_track_entry_home(shard, address);
+	while (shard->entries[slot].address && shard->entries[slot].address != address)
+	{
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+static void heap_track_entries_grow(heap_track_shard_t* shard)
+{
+	heap_track_entry_t* old_entries = shard->entries;
+	size_t old_capacity = shard->entry_capacity;
+
+	shard->entry_capacity = old_capacity * 2;
+	shard->entries = vm_reserve(sizeof(heap_track_entry_t) * shard->entry_capacity);
+	vm_commit(shard->entries, sizeof(heap_track_entry_t) * shard->entry_capacity);
+
+	for (size_t i = 0; i < old_capacity; ++i)
+	{
+		if (old_entries[i].address)
+		{
+			shard->entries[heap_track_entry_slot(shard, old_entries[i].address)] = old_entries[i];
+		}
+	}
+
+	vm_release(old_entries, sizeof(heap_track_entry_t) * old_capacity);
+}
+
+// Find or add a callstack.
+static uint32_t heap_track_stack_get(heap_track_t* track, void** frames, int depth)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (int i = 0; i < depth; ++i)
+	{
+		hash = (hash ^ (uintptr_t)frames[i]) * 1099511628211ull;
+	}
+
+	if (!depth)
+	{
+		return k_heap_track_stack_capacity;
+	}
+
+	// Slots are filled in probe order and never emptied, so a lookup
+	// without the lock can only miss a callstack that is being added.
+	size_t slot = hash & (k_heap_track_stack_capacity - 1);
+	uint32_t found = heap_track_stack_find(track, hash, frames, depth, &slot);
+	if (found != UINT32_MAX)
+	{
+		return found;
+	}
+
+	mutex_lock(track->stack_mutex);
+	found = heap_track_stack_find(track, hash, frames, depth, &slot);
+	if (found == UINT32_MAX)
+	{
+		if (track->stack_count >= k_heap_track_stack_capacity / 2)
+		{
+			found = k_heap_track_stack_capacity;
+		}
+		else
+		{
+			heap_track_stack_t* stack = &track->stacks[slot];
+			stack->hash = hash;
+			memcpy(stack->frames, frames, sizeof(void*) * depth);
+			atomic_store(&stack->depth, depth);
+			track->stack_count++;
+			found = (uint32_t)slot;
+		}
+	}
+	mutex_unlock(track->stack_mutex);
+	return found;
+}
+
+// Probe for a callstack from *slot on. Returns its slot, or UINT32_MAX
+// with *slot left at the first empty slot.
+static uint32_t heap_track_stack_find(heap_track_t* track, uint64_t hash, void** frames, int depth, size_t* slot)
+{
+	size_t mask = k_heap_track_stack_capacity - 1;
+	int stack_depth;
+	while ((stack_depth = atomic_load(&track->stacks[*slot].depth)) != 0)
+	{
+		heap_track_stack_t* stack = &track->stacks[*slot];
+		if (stack->hash == hash && stack_depth == depth &&
+			memcmp(stack->frames, frames, sizeof(void*) * depth) == 0)
+		{
+			return (uint32_t)*slot;
+		}
+		*slot = (*slot + 1) & mask;
+	}
+	return UINT32_MAX;
+}
+
+static int heap_track_group_compare(const void* a, const void* b)
+{
+	const heap_track_group_t* group_a = a;
+	const heap_track_group_t* group_b = b;
+	return (group_a->bytes < group_b->bytes) - (group_a->bytes > group_b->bytes);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+
+// Heap Allocation Tracking
+//
+// Records the size and callstack of every live allocation so that leaks
+// can be reported, grouped by callstack. Used by the heap when created with
+// k_heap_flag_track_leaks. Memory for tracking comes straight from the OS.
+
+// Handle to an allocation tracker.
+typedef struct heap_track_t heap_track_t;
+
+// Creates an allocation tracker.
+heap_track_t* heap_track_create();
+
+// Destroys an allocation tracker.
+void heap_track_destroy(heap_track_t* track);
+
+// Record a live allocation and the current callstack.
+// Recording an address that is already live updates its size.
+// Safe to call from multiple threads.
+void heap_track_alloc(heap_track_t* track, void* address, size_t size);
+
+// Forget an allocation that has been freed.
+// Safe to call from multiple threads.
+void heap_track_free(heap_track_t* track, void* address);
+
+// Print all live allocations grouped by callstack, largest total first.
+// Returns the number of live allocations.
+size_t heap_track_report(heap_track_t* track);
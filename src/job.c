@@ -0,0 +1,710 @@
+#include "job.h"
+
+#include "atomic.h"
+#include "fiber.h"
+#include "futex.h"
+#include "heap.h"
+#include "queue.h"
+#include "thread.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#define job_thread_local __declspec(thread)
+#define job_pause() YieldProcessor()
+#else
+#define job_thread_local __thread
+#if defined(__x86_64__) || defined(__i386__)
+#define job_pause() __builtin_ia32_pause()
+#else
+#define job_pause()
+#endif
+#endif
+
+enum
+{
+	k_job_cache_line = 64,
+	// Jobs a worker can hold before job_run executes new ones inline.
+	k_job_deque_capacity = 4096,
+	// Jobs queued from threads that are not workers.
+	k_job_shared_capacity = 1024,
+	// Fruitless searches for work before a thread sleeps.
+	k_job_spin_count = 64,
+	// Pooled fibers jobs run on; a job that waits keeps its fiber until it resumes.
+	// A power of two, as the free and ready queues hold every fiber.
+	k_job_fiber_count = 128,
+	k_job_fiber_stack_size = 64 * 1024,
+	// Pending count held by the job that drains a counter while it hands off waiters.
+	k_job_counter_draining = -1,
+};
+
+typedef struct job_t
+{
+	void (*function)(void*);
+	void* data;
+	job_counter_t* counter;
+} job_t;
+
+typedef struct job_fiber_t job_fiber_t;
+
+typedef struct job_counter_t
+{
+	job_system_t* jobs;
+	int pending;
+	// Threads sleeping in job_wait outside a fiber.
+	int waiters;
+	// Fibers suspended in job_wait, guarded by the lock.
+	int lock;
+	job_fiber_t* waiting;
+} job_counter_t;
+
+// Chase-Lev deque. The owning worker pushes and pops at the bottom;
+// other threads steal from the top. Indices wrap as unsigned and
+// bottom - top is the number of jobs.
+typedef struct job_deque_t
+{
+	int top;
+	char pad0[k_job_cache_line - sizeof(int)];
+	int bottom;
+	char pad1[k_job_cache_line - sizeof(int)];
+	job_t jobs[k_job_deque_capacity];
+} job_deque_t;
+
+typedef struct job_worker_t job_worker_t;
+
+// A pooled fiber. It loops running the job it is given, switching back to
+// the worker that resumed it whenever the job finishes, waits or yields.
+typedef struct job_fiber_t
+{
+	fiber_t* fiber;
+	job_t job;
+	// Set on each resume; a waiting fiber may resume on another worker.
+	job_worker_t* worker;
+	// Set before switching out to tell the worker what to do with the fiber.
+	job_counter_t* wait_counter;
+	bool yielded;
+	job_fiber_t* next;
+} job_fiber_t;
+
+typedef struct job_worker_t
+{
+	job_deque_t deque;
+	job_system_t* system;
+	thread_t* thread;
+	// The thread's own context. Workers schedule from here.
+	fiber_t* thread_fiber;
+	// Fiber running on this worker, NULL while scheduling.
+	job_fiber_t* current;
+	uint32_t rng;
+} job_worker_t;
+
+typedef struct job_system_t
+{
+	heap_t* heap;
+	queue_t* shared;
+	job_fiber_t* fibers;
+	queue_t* free_fibers;
+	queue_t* ready_fibers;
+	job_worker_t* workers;
+	int worker_count;
+	int quit;
+	// Idle workers sleep on the epoch; the count lets job_run skip the wake when none do.
+	int sleepers;
+	int wake_epoch;
+	// Threads that are not workers sleep here in job_wait until a counter drains.
+	// Wakes go through the job system rather than the counter, which its
+	// owner may destroy as soon as it reads zero.
+	int drain_epoch;
+} job_system_t;
+
+// The worker the current thread runs as, if any.
+static job_thread_local job_worker_t* s_job_worker;
+
+static int job_worker_func(void* user);
+static void job_fiber_func(void* user);
+static job_worker_t* job_current_worker(job_system_t* jobs);
+static bool job_step(job_system_t* jobs, job_worker_t* worker);
+static bool job_find(job_system_t* jobs, job_worker_t* worker, job_t* job);
+static void job_start(job_system_t* jobs, job_worker_t* worker, job_t* job);
+static void job_resume(job_system_t* jobs, job_worker_t* worker, job_fiber_t* fiber);
+static void job_suspend(job_fiber_t* fiber);
+static void job_execute(job_system_t* jobs, job_t* job);
+static void job_counter_finish(job_system_t* jobs, job_counter_t* counter);
+static void job_counter_park(job_system_t* jobs, job_counter_t* counter, job_fiber_t* fiber);
+static void job_counter_lock(job_counter_t* counter);
+static void job_counter_unlock(job_counter_t* counter);
+static void job_sleep(job_system_t* jobs, job_worker_t* worker, job_counter_t* counter);
+static void job_wake(job_system_t* jobs);
+static bool job_deque_push(job_deque_t* deque, job_t* job);
+static bool job_deque_pop(job_deque_t* deque, job_t* job);
+static bool job_deque_steal(job_deque_t* deque, job_t* job);
+
+job_system_t* job_system_create(heap_t* heap, int worker_count)
+{
+	if (worker_count <= 0)
+	{
+		worker_count = thread_get_core_count();
+	}
+
+	job_system_t* jobs = heap_alloc(heap, sizeof(job_system_t), 8);
+	jobs->heap = heap;
+	jobs->shared = queue_create(heap, k_job_shared_capacity);
+	jobs->free_fibers = queue_create(heap, k_job_fiber_count);
+	jobs->ready_fibers = queue_create(heap, k_job_fiber_count);
+	jobs->fibers = heap_alloc(heap, sizeof(job_fiber_t) * k_job_fiber_count, 8);
+	for (int i = 0; i < k_job_fiber_count; ++i)
+	{
+		job_fiber_t* fiber = &jobs->fibers[i];
+		fiber->fiber = fiber_create(heap, k_job_fiber_stack_size, job_fiber_func, fiber);
+		fiber->worker = NULL;
+		fiber->wait_counter = NULL;
+		fiber->yielded = false;
+		fiber->next = NULL;
+		queue_push(jobs->free_fibers, fiber);
+	}
+	jobs->workers = heap_alloc(heap, sizeof(job_worker_t) * worker_count, k_job_cache_line);
+	jobs->worker_count = worker_count;
+	jobs->quit = 0;
+	jobs->sleepers = 0;
+	jobs->wake_epoch = 0;
+	jobs->drain_epoch = 0;
+
+	for (int i = 0; i < worker_count; ++i)
+	{
+		job_worker_t* worker = &jobs->workers[i];
+		worker->deque.top = 0;
+		worker->deque.bottom = 0;
+		worker->system = jobs;
+		worker->thread = NULL;
+		worker->thread_fiber = NULL;
+		worker->current = NULL;
+		worker->rng = 0x9e3779b9u * (i + 1);
+	}
+
+	// The calling thread is worker zero.
+	s_job_worker = &jobs->workers[0];
+	jobs->workers[0].thread_fiber = fiber_enter_thread(heap);
+	for (int i = 1; i < worker_count; ++i)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "job worker %d", i);
+		thread_options_t options = { .name = name };
+		jobs->workers[i].thread = thread_create(job_worker_func, &jobs->workers[i], &options);
+	}
+	return jobs;
+}
+
+void job_system_destroy(job_system_t* jobs)
+{
+	atomic_compare_and_exchange(&jobs->quit, 0, 1);
+	atomic_increment(&jobs->wake_epoch);
+	futex_wake_all(&jobs->wake_epoch);
+
+	for (int i = 1; i < jobs->worker_count; ++i)
+	{
+		thread_destroy(jobs->workers[i].thread);
+	}
+	fiber_leave_thread(jobs->workers[0].thread_fiber);
+	if (s_job_worker == &jobs->workers[0])
+	{
+		s_job_worker = NULL;
+	}
+
+	for (int i = 0; i < k_job_fiber_count; ++i)
+	{
+		fiber_destroy(jobs->fibers[i].fiber);
+	}
+	heap_free(jobs->heap, jobs->fibers);
+	queue_destroy(jobs->free_fibers);
+	queue_destroy(jobs->ready_fibers);
+	queue_destroy(jobs->shared);
+	heap_free(jobs->heap, jobs->workers);
+	heap_free(jobs->heap, jobs);
+}
+
+int job_system_get_worker_count(job_system_t* jobs)
+{
+	return jobs->worker_count;
+}
+
+job_counter_t* job_counter_create(job_system_t* jobs)
+{
+	job_counter_t* counter = heap_alloc(jobs->heap, sizeof(job_counter_t), 8);
+	counter->jobs = jobs;
+	counter->pending = 0;
+	counter->waiters = 0;
+	counter->lock = 0;
+	counter->waiting = NULL;
+	return counter;
+}
+
+void job_counter_destroy(job_counter_t* counter)
+{
+	// The job that drained the counter may still hold its lock.
+	job_counter_lock(counter);
+	heap_free(counter->jobs->heap, counter);
+}
+
+void job_counter_add(job_counter_t* counter, int count)
+{
+	int pending = atomic_load(&counter->pending);
+	while (true)
+	{
+		if (pending == k_job_counter_draining)
+		{
+			// Wait out the job draining the previous batch, which would
+			// otherwise take the new count for its own and zero it.
+			job_pause();
+			pending = atomic_load(&counter->pending);
+			continue;
+		}
+		int old_pending = atomic_compare_and_exchange(&counter->pending, pending, pending + count);
+		if (old_pending == pending)
+		{
+			break;
+		}
+		pending = old_pending;
+	}
+}
+
+void job_counter_signal(job_counter_t* counter)
+{
+	job_counter_finish(counter->jobs, counter);
+}
+
+void job_run(job_system_t* jobs, void (*function)(void*), void* data, job_counter_t* counter)
+{
+	if (counter)
+	{
+		job_counter_add(counter, 1);
+	}
+
+	job_t job = { .function = function, .data = data, .counter = counter };
+
+	job_worker_t* worker = job_current_worker(jobs);
+	if (worker)
+	{
+		if (!job_deque_push(&worker->deque, &job))
+		{
+			job_execute(jobs, &job);
+			return;
+		}
+	}
+	else
+	{
+		job_t* shared = heap_alloc(jobs->heap, sizeof(job_t), 8);
+		*shared = job;
+		if (!queue_try_push(jobs->shared, shared))
+		{
+			heap_free(jobs->heap, shared);
+			job_execute(jobs, &job);
+			return;
+		}
+	}
+
+	job_wake(jobs);
+}
+
+void job_wait(job_system_t* jobs, job_counter_t* counter)
+{
+	job_worker_t* worker = job_current_worker(jobs);
+
+	job_fiber_t* fiber = worker ? worker->current : NULL;
+	if (fiber)
+	{
+		// Inside a job: hand the worker back and resume once the count drains.
+		while (atomic_load(&counter->pending) != 0)
+		{
+			fiber->wait_counter = counter;
+			job_suspend(fiber);
+		}
+		return;
+	}
+
+	int idle = 0;
+	while (atomic_load(&counter->pending) != 0)
+	{
+		if (job_step(jobs, worker))
+		{
+			idle = 0;
+		}
+		else if (++idle < k_job_spin_count)
+		{
+			job_pause();
+		}
+		else if (worker)
+		{
+			// A worker may yet be handed ready fibers only it can resume,
+			// so it sleeps where job_run and the counter draining both wake it.
+			job_sleep(jobs, worker, counter);
+			idle = 0;
+		}
+		else
+		{
+			// Nothing left to help with; the remaining jobs are running elsewhere.
+			int epoch = atomic_load(&jobs->drain_epoch);
+			atomic_increment(&counter->waiters);
+			if (atomic_load(&counter->pending) != 0)
+			{
+				futex_wait(&jobs->drain_epoch, epoch);
+			}
+			atomic_decrement(&counter->waiters);
+			idle = 0;
+		}
+	}
+}
+
+void job_yield(job_system_t* jobs)
+{
+	job_worker_t* worker = job_current_worker(jobs);
+
+	job_fiber_t* fiber = worker ? worker->current : NULL;
+	if (fiber)
+	{
+		fiber->yielded = true;
+		job_suspend(fiber);
+	}
+	else if (!job_step(jobs, worker))
+	{
+		job_pause();
+	}
+}
+
+static int job_worker_func(void* user)
+{
+	job_worker_t* worker = user;
+	job_system_t* jobs = worker->system;
+	s_job_worker = worker;
+	worker->thread_fiber = fiber_enter_thread(jobs->heap);
+
+	int idle = 0;
+	while (!atomic_load(&jobs->quit))
+	{
+		if (job_step(jobs, worker))
+		{
+			idle = 0;
+		}
+		else if (++idle < k_job_spin_count)
+		{
+			job_pause();
+		}
+		else
+		{
+			job_sleep(jobs, worker, NULL);
+			idle = 0;
+		}
+	}
+
+	fiber_leave_thread(worker->thread_fiber);
+	return 0;
+}
+
+static void job_fiber_func(void* user)
+{
+	job_fiber_t* fiber = user;
+	while (true)
+	{
+		job_execute(fiber->worker->system, &fiber->job);
+		job_suspend(fiber);
+	}
+}
+
+static job_worker_t* job_current_worker(job_system_t* jobs)
+{
+	job_worker_t* worker = s_job_worker;
+	return worker && worker->system == jobs ? worker : NULL;
+}
+
+// Run one piece of work from a thread's own context.
+// Workers resume fibers whose wait is over before starting new jobs.
+static bool job_step(job_system_t* jobs, job_worker_t* worker)
+{
+	if (worker)
+	{
+		job_fiber_t* fiber = queue_try_pop(jobs->ready_fibers);
+		if (fiber)
+		{
+			job_resume(jobs, worker, fiber);
+			return true;
+		}
+	}
+
+	job_t job;
+	if (!job_find(jobs, worker, &job))
+	{
+		return false;
+	}
+	job_start(jobs, worker, &job);
+	return true;
+}
+
+// Own deque first, newest job first for cache warmth; then the shared
+// queue; then the oldest job of another worker, starting at a random one.
+static bool job_find(job_system_t* jobs, job_worker_t* worker, job_t* job)
+{
+	if (worker && job_deque_pop(&worker->deque, job))
+	{
+		return true;
+	}
+
+	job_t* shared = queue_try_pop(jobs->shared);
+	if (shared)
+	{
+		*job = *shared;
+		heap_free(jobs->heap, shared);
+		return true;
+	}
+
+	int start = 0;
+	if (worker)
+	{
+		worker->rng ^= worker->rng << 13;
+		worker->rng ^= worker->rng >> 17;
+		worker->rng ^= worker->rng << 5;
+		start = (int)(worker->rng % (uint32_t)jobs->worker_count);
+	}
+	for (int i = 0; i < jobs->worker_count; ++i)
+	{
+		job_worker_t* victim = &jobs->workers[(start + i) % jobs->worker_count];
+		if (victim != worker && job_deque_steal(&victim->deque, job))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// Run a job on a pooled fiber so that it can wait without holding the thread.
+// Threads that are not workers, or any worker once the pool runs dry, run it directly.
+static void job_start(job_system_t* jobs, job_worker_t* worker, job_t* job)
+{
+	job_fiber_t* fiber = worker ? queue_try_pop(jobs->free_fibers) : NULL;
+	if (!fiber)
+	{
+		job_execute(jobs, job);
+		return;
+	}
+	fiber->job = *job;
+	job_resume(jobs, worker, fiber);
+}
+
+// Switch to a fiber, then act on why it switched back.
+// This runs after the fiber is off its stack, so it is safe to let
+// another worker pick it up.
+static void job_resume(job_system_t* jobs, job_worker_t* worker, job_fiber_t* fiber)
+{
+	fiber->worker = worker;
+	worker->current = fiber;
+	fiber_switch(worker->thread_fiber, fiber->fiber);
+	worker->current = NULL;
+
+	if (fiber->wait_counter)
+	{
+		job_counter_t* counter = fiber->wait_counter;
+		fiber->wait_counter = NULL;
+		job_counter_park(jobs, counter, fiber);
+	}
+	else if (fiber->yielded)
+	{
+		fiber->yielded = false;
+		queue_push(jobs->ready_fibers, fiber);
+	}
+	else
+	{
+		queue_push(jobs->free_fibers, fiber);
+	}
+}
+
+// Switch from a fiber back to the worker running it.
+// The worker may differ when this returns.
+static void job_suspend(job_fiber_t* fiber)
+{
+	fiber_switch(fiber->fiber, fiber->worker->thread_fiber);
+}
+
+static void job_execute(job_system_t* jobs, job_t* job)
+{
+	job->function(job->data);
+	if (job->counter)
+	{
+		job_counter_finish(jobs, job->counter);
+	}
+}
+
+// Count a job against its counter as finished.
+// The last job holds the count at k_job_counter_draining rather than zero
+// while it takes the waiting list, and only releases it under the lock, so
+// a waiter cannot return and destroy the counter while it is still in use.
+// Once the lock is dropped the counter is not touched again: waking its
+// waiters goes through the job system's own epochs.
+static void job_counter_finish(job_system_t* jobs, job_counter_t* counter)
+{
+	int pending = atomic_load(&counter->pending);
+	while (true)
+	{
+		int next = pending == 1 ? k_job_counter_draining : pending - 1;
+		int old_pending = atomic_compare_and_exchange(&counter->pending, pending, next);
+		if (old_pending == pending)
+		{
+			break;
+		}
+		pending = old_pending;
+	}
+	if (pending != 1)
+	{
+		return;
+	}
+
+	job_counter_lock(counter);
+	job_fiber_t* fiber = counter->waiting;
+	counter->waiting = NULL;
+	atomic_compare_and_exchange(&counter->pending, k_job_counter_draining, 0);
+	bool waiters = atomic_load(&counter->waiters) != 0;
+	job_counter_unlock(counter);
+
+	if (waiters)
+	{
+		atomic_increment(&jobs->drain_epoch);
+		futex_wake_all(&jobs->drain_epoch);
+		// Workers waiting on the counter sleep with the idle ones.
+		atomic_increment(&jobs->wake_epoch);
+		futex_wake_all(&jobs->wake_epoch);
+	}
+	if (fiber)
+	{
+		while (fiber)
+		{
+			// A ready fiber may resume and wait again at once, reusing its link.
+			job_fiber_t* next = fiber->next;
+			queue_push(jobs->ready_fibers, fiber);
+			fiber = next;
+		}
+		job_wake(jobs);
+	}
+}
+
+// Add a suspended fiber to a counter's waiting list, or make it ready
+// at once if the count drained while it was switching out.
+// The check is under the same lock job_execute takes to empty the list.
+static void job_counter_park(job_system_t* jobs, job_counter_t* counter, job_fiber_t* fiber)
+{
+	job_counter_lock(counter);
+	bool drained = atomic_load(&counter->pending) == 0;
+	if (!drained)
+	{
+		fiber->next = counter->waiting;
+		counter->waiting = fiber;
+	}
+	job_counter_unlock(counter);
+
+	if (drained)
+	{
+		queue_push(jobs->ready_fibers, fiber);
+	}
+}
+
+static void job_counter_lock(job_counter_t* counter)
+{
+	while (atomic_compare_and_exchange(&counter->lock, 0, 1) != 0)
+	{
+		job_pause();
+	}
+}
+
+static void job_counter_unlock(job_counter_t* counter)
+{
+	atomic_compare_and_exchange(&counter->lock, 1, 0);
+}
+
+// Registering as a sleeper is interlocked, as is every push of a job or
+// ready fiber, so either the final step finds the work or the pusher sees
+// the sleeper. A worker waiting on a counter registers with it the same way,
+// so the job that drains it either is seen here or sees the waiter.
+static void job_sleep(job_system_t* jobs, job_worker_t* worker, job_counter_t* counter)
+{
+	int epoch = atomic_load(&jobs->wake_epoch);
+	atomic_increment(&jobs->sleepers);
+	if (counter)
+	{
+		atomic_increment(&counter->waiters);
+	}
+	if ((!counter || atomic_load(&counter->pending) != 0) &&
+		!job_step(jobs, worker) &&
+		!atomic_load(&jobs->quit))
+	{
+		futex_wait(&jobs->wake_epoch, epoch);
+	}
+	if (counter)
+	{
+		atomic_decrement(&counter->waiters);
+	}
+	atomic_decrement(&jobs->sleepers);
+}
+
+static void job_wake(job_system_t* jobs)
+{
+	if (atomic_load(&jobs->sleepers))
+	{
+		atomic_increment(&jobs->wake_epoch);
+		futex_wake(&jobs->wake_epoch);
+	}
+}
+
+static bool job_deque_push(job_deque_t* deque, job_t* job)
+{
+	unsigned int bottom = (unsigned int)deque->bottom;
+	unsigned int top = (unsigned int)atomic_load(&deque->top);
+	if (bottom - top >= k_job_deque_capacity)
+	{
+		return false;
+	}
+
+	deque->jobs[bottom & (k_job_deque_capacity - 1)] = *job;
+
+	// Interlocked so the job is visible to thieves before the sleeper check in job_run.
+	atomic_add(&deque->bottom, 1);
+	return true;
+}
+
+static bool job_deque_pop(job_deque_t* deque, job_t* job)
+{
+	// Interlocked so claiming the bottom job is ordered before reading the top.
+	unsigned int bottom = (unsigned int)atomic_add(&deque->bottom, -1) - 1;
+	unsigned int top = (unsigned int)atomic_load(&deque->top);
+
+	if ((int)(bottom - top) < 0)
+	{
+		// Empty.
+		atomic_store(&deque->bottom, (int)(bottom + 1));
+		return false;
+	}
+
+	*job = deque->jobs[bottom & (k_job_deque_capacity - 1)];
+	if (bottom != top)
+	{
+		return true;
+	}
+
+	// Last job: race any thief for it.
+	bool won = atomic_compare_and_exchange(&deque->top, (int)top, (int)(top + 1)) == (int)top;
+	atomic_store(&deque->bottom, (int)(bottom + 1));
+	return won;
+}
+
+static bool job_deque_steal(job_deque_t* deque, job_t* job)
+{
+	unsigned int top = (unsigned int)atomic_load(&deque->top);
+	unsigned int bottom = (unsigned int)atomic_load(&deque->bottom);
+	if ((int)(bottom - top) <= 0)
+	{
+		return false;
+	}
+
+	// The copy may be torn if the owner wraps around onto this slot, but
+	// then the top has moved on and the exchange below fails.
+	*job = deque->jobs[top & (k_job_deque_capacity - 1)];
+	return atomic_compare_and_exchange(&deque->top, (int)top, (int)(top + 1)) == (int)top;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+// Work-stealing Job System
+//
+// Main object, job_system_t, runs small functions ("jobs") across a pool of
+// worker threads, one per core. Each worker keeps its own deque of jobs:
+// it pushes and pops at one end without contention, while idle workers
+// steal from the other end. Jobs are grouped by counters so a caller can
+// wait for a batch of work; waiting runs other jobs instead of blocking.
+//
+// Workers run jobs on pooled fibers. A job that waits is set aside with its
+// stack and the worker moves on to other jobs; the job is made ready again
+// only once its counter drains. Counters can also track work done outside
+// the job system, such as file work, so a job can wait on that the same way.
+// A job resumes later, possibly on another worker, so it must not rely on
+// thread identity across a wait or yield.
+//
+// The thread that creates the job system counts as one of the workers.
+// It runs jobs only while inside job_wait.
+
+// Handle to a job system.
+typedef struct job_system_t job_system_t;
+
+// Handle to a job counter.
+// Counts jobs that have been queued against it but have not finished.
+typedef struct job_counter_t job_counter_t;
+
+typedef struct heap_t heap_t;
+
+// Create a job system.
+// Worker count includes the calling thread; pass zero for one per core.
+job_system_t* job_system_create(heap_t* heap, int worker_count);
+
+// Destroy a job system.
+// All queued jobs must have been waited on.
+void job_system_destroy(job_system_t* jobs);
+
+// Get the number of workers, including the thread that created the system.
+int job_system_get_worker_count(job_system_t* jobs);
+
+// Create a counter to group jobs.
+job_counter_t* job_counter_create(job_system_t* jobs);
+
+// Destroy a counter.
+// All jobs queued against it must have finished.
+void job_counter_destroy(job_counter_t* counter);
+
+// Count outside work against a counter, such as a file read a job will wait on.
+// Each count must be matched by a job_counter_signal once that work is done.
+void job_counter_add(job_counter_t* counter, int count);
+
+// Count one piece of outside work as finished, resuming jobs waiting on the counter.
+// Safe to call from any thread, including threads the job system does not own.
+void job_counter_signal(job_counter_t* counter);
+
+// Queue a job to call function with data.
+// If counter is not NULL, it is incremented now and decremented once the job finishes.
+// Safe to call from any thread, including from inside a job.
+// Jobs queued from a worker go to that worker's deque; others go to a shared queue.
+void job_run(job_system_t* jobs, void (*function)(void*), void* data, job_counter_t* counter);
+
+// Wait until every job queued against counter has finished.
+// Inside a job, suspends the job and frees its worker until then.
+// Elsewhere, runs queued jobs while waiting, and only sleeps when none are left to run.
+void job_wait(job_system_t* jobs, job_counter_t* counter);
+
+// Let other jobs run before continuing.
+// The job is ready again at once, so a loop that yields until something
+// happens keeps a worker busy; wait on a counter instead.
+// Outside a job, runs one queued job if there is one.
+void job_yield(job_system_t* jobs);
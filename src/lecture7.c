@@ -90,7 +90,7 @@ static void run_timed_test(int (*thread_func)(void*), const char* name)
 	thread_t* threads[8];
 	for (int i = 0; i < _countof(threads); ++i)
 	{
-		threads[i] = thread_create(thread_func, &thread_data);
+		threads[i] = thread_create(thread_func, &thread_data, NULL);
 	}
 
 	// Go!
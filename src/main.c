@@ -1,11 +1,60 @@
 #include "debug.h"
 #include "fs.h"
 #include "heap.h"
+#include "job.h"
 #include "render.h"
 #include "frogger_game.h"
+#include "thread.h"
 #include "timer.h"
+#include "trace.h"
 #include "wm.h"
 
+enum
+{
+	// Fewest cores at which service threads are pinned away from the main thread.
+	k_pin_min_core_count = 8,
+	// Frames covered by the duration statistics toggled with F12.
+	k_trace_stats_frame_window = 600,
+};
+
+// F11 starts and stops a Chrome trace capture, written to trace.json.
+// F12 starts and stops per-frame duration statistics, written to trace_stats.csv.
+// Called between frames so no duration is open when recording starts or stops.
+static void update_trace_keys(trace_t* trace, wm_window_t* window, uint32_t* last_key_mask)
+{
+	uint32_t key_mask = wm_get_key_mask(window);
+	uint32_t pressed = key_mask & ~*last_key_mask;
+	*last_key_mask = key_mask;
+
+	if (pressed & k_key_f11)
+	{
+		if (trace_is_capturing(trace))
+		{
+			trace_capture_stop(trace);
+			debug_print(k_print_info, "Trace capture stopped, writing trace.json\n");
+		}
+		else
+		{
+			trace_capture_start(trace, "trace.json");
+			debug_print(k_print_info, "Trace capture started\n");
+		}
+	}
+	if (pressed & k_key_f12)
+	{
+		if (trace_stats_is_running(trace))
+		{
+			trace_stats_stop(trace);
+			trace_stats_write_csv(trace, "trace_stats.csv");
+			debug_print(k_print_info, "Trace stats stopped, writing trace_stats.csv\n");
+		}
+		else
+		{
+			trace_stats_start(trace, k_trace_stats_frame_window);
+			debug_print(k_print_info, "Trace stats started\n");
+		}
+	}
+}
+
 int main(int argc, const char* argv[])
 {
 	debug_set_print_mask(k_print_info | k_print_warning | k_print_error);
@@ -13,24 +62,59 @@ int main(int argc, const char* argv[])
 
 	timer_startup();
 
-	heap_t* heap = heap_create(2 * 1024 * 1024);
-	fs_t* fs = fs_create(heap, 8);
+	// On machines with cores to spare, the main thread keeps the first core to itself
+	// and the render and file system threads run on the rest.
+	thread_options_t main_options = { .name = "main" };
+	thread_options_t service_options = { 0 };
+	int core_count = thread_get_core_count();
+	if (core_count >= k_pin_min_core_count)
+	{
+		main_options.affinity_mask = 1;
+		service_options.affinity_mask = (core_count >= 64 ? ~0ULL : (1ULL << core_count) - 1) & ~1ULL;
+	}
+	thread_set_current_options(&main_options);
+
+	uint32_t heap_flags = k_heap_flag_huge_pages;
+#if defined(_DEBUG)
+	heap_flags |= k_heap_flag_track_leaks;
+#endif
+	heap_t* heap = heap_create(2 * 1024 * 1024, heap_flags);
+	fs_t* fs = fs_create(heap, 8, &service_options);
+	job_system_t* jobs = job_system_create(heap, 0);
+	trace_t* trace = trace_create(heap, fs, 16 * 1024);
 	wm_window_t* window = wm_create(heap);
-	render_t* render = render_create(heap, window);
+	render_t* render = render_create(heap, window, &service_options);
+
+	heap_set_trace(heap, trace);
+	fs_set_trace(fs, trace);
+	render_set_trace(render, trace);
 
-	frogger_game_t* game = frogger_game_create(heap, fs, window, render, argc, argv);
+	frogger_game_t* game = frogger_game_create(heap, fs, jobs, window, render, argc, argv);
 
+	uint32_t last_key_mask = 0;
 	while (!wm_pump(window))
 	{
+		update_trace_keys(trace, window, &last_key_mask);
+
+		trace_duration_push(trace, "frame");
 		frogger_game_update(game);
+		trace_duration_pop(trace);
+		heap_trim(heap);
+		heap_trace_stats(heap);
+		trace_frame_end(trace);
 	}
 
+	heap_set_trace(heap, NULL);
+	fs_set_trace(fs, NULL);
+
 	/* XXX: Shutdown render before the game. Render uses game resources. */
 	render_destroy(render);
 
 	frogger_game_destroy(game);
 
 	wm_destroy(window);
+	trace_destroy(trace);
+	job_system_destroy(jobs);
 	fs_destroy(fs);
 	heap_destroy(heap);
 
@@ -1,24 +1,141 @@
 #include "mutex.h"
 
+#include "atomic.h"
+#include "futex.h"
+
+#include <stdlib.h>
+
+#if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#define mutex_thread_local __declspec(thread)
+#define mutex_pause() YieldProcessor()
+#else
+#define mutex_thread_local __thread
+#if defined(__x86_64__) || defined(__i386__)
+#define mutex_pause() __builtin_ia32_pause()
+#else
+#define mutex_pause()
+#endif
+#endif
+
+enum
+{
+	// Upper bound on polls of a held lock before sleeping.
+	k_mutex_max_spin_count = 128,
+};
+
+typedef enum mutex_state_t
+{
+	k_mutex_unlocked,
+	k_mutex_locked,
+	// Locked, and other threads may be sleeping on the state.
+	k_mutex_contended,
+} mutex_state_t;
+
+// Locked and unlocked in user space; the kernel is only entered to sleep
+// while another thread holds the lock, or to wake a sleeper on unlock.
+typedef struct mutex_t
+{
+	int state;
+	// Address of the owning thread's tag while locked. Only the owner
+	// writes it, so a thread never mistakes a stale value for itself.
+	void* volatile owner;
+	int depth;
+	// Running average of polls it took to take the lock by spinning.
+	int spin_count;
+} mutex_t;
+
+static mutex_thread_local char s_mutex_thread_tag;
+
+static void mutex_lock_contended(mutex_t* mutex);
 
 mutex_t* mutex_create()
 {
-	return (mutex_t*)CreateMutex(NULL, FALSE, NULL);
+	mutex_t* mutex = malloc(sizeof(mutex_t));
+	mutex->state = k_mutex_unlocked;
+	mutex->owner = NULL;
+	mutex->depth = 0;
+	mutex->spin_count = 0;
+	return mutex;
 }
 
 void mutex_destroy(mutex_t* mutex)
 {
-	CloseHandle(mutex);
+	free(mutex);
 }
 
 void mutex_lock(mutex_t* mutex)
 {
-	WaitForSingleObject(mutex, INFINITE);
+	void* self = &s_mutex_thread_tag;
+	if (mutex->owner == self)
+	{
+		++mutex->depth;
+		return;
+	}
+	if (atomic_compare_and_exchange(&mutex->state, k_mutex_unlocked, k_mutex_locked) != k_mutex_unlocked)
+	{
+		mutex_lock_contended(mutex);
+	}
+	mutex->owner = self;
+	mutex->depth = 1;
+}
+
+bool mutex_try_lock(mutex_t* mutex)
+{
+	void* self = &s_mutex_thread_tag;
+	if (mutex->owner == self)
+	{
+		++mutex->depth;
+		return true;
+	}
+	if (atomic_compare_and_exchange(&mutex->state, k_mutex_unlocked, k_mutex_locked) != k_mutex_unlocked)
+	{
+		return false;
+	}
+	mutex->owner = self;
+	mutex->depth = 1;
+	return true;
 }
 
 void mutex_unlock(mutex_t* mutex)
 {
-	ReleaseMutex(mutex);
+	if (--mutex->depth > 0)
+	{
+		return;
+	}
+	mutex->owner = NULL;
+	if (atomic_exchange(&mutex->state, k_mutex_unlocked) == k_mutex_contended)
+	{
+		futex_wake(&mutex->state);
+	}
+}
+
+static void mutex_lock_contended(mutex_t* mutex)
+{
+	// Spin a little longer than it has recently taken to get the lock,
+	// on the bet that the owner is about to release it.
+	int spin_limit = mutex->spin_count * 2 + 16;
+	if (spin_limit > k_mutex_max_spin_count)
+	{
+		spin_limit = k_mutex_max_spin_count;
+	}
+	for (int i = 0; i < spin_limit; ++i)
+	{
+		mutex_pause();
+		if (atomic_load(&mutex->state) == k_mutex_unlocked &&
+			atomic_compare_and_exchange(&mutex->state, k_mutex_unlocked, k_mutex_locked) == k_mutex_unlocked)
+		{
+			mutex->spin_count += (i - mutex->spin_count) / 8;
+			return;
+		}
+	}
+	mutex->spin_count += (spin_limit - mutex->spin_count) / 8;
+
+	// Mark the lock contended before sleeping so the owner knows to wake us.
+	// Taking it this way leaves it marked, which at worst costs one spare wake.
+	while (atomic_exchange(&mutex->state, k_mutex_contended) != k_mutex_unlocked)
+	{
+		futex_wait(&mutex->state, k_mutex_contended);
+	}
 }
@@ -1,6 +1,11 @@
 #pragma once
 
+#include <stdbool.h>
+
 // Recursive mutex thread synchronization
+//
+// Uncontended lock and unlock are a single atomic operation.
+// A thread that finds the mutex held spins briefly, then sleeps on a futex.
 
 // Handle to a mutex.
 typedef struct mutex_t mutex_t;
@@ -16,5 +21,9 @@ void mutex_destroy(mutex_t* mutex);
 // multiple times.
 void mutex_lock(mutex_t* mutex);
 
+// Attempts to lock a mutex without blocking.
+// Returns true if the lock was taken or this thread already held it.
+bool mutex_try_lock(mutex_t* mutex);
+
 // Unlocks a mutex.
 void mutex_unlock(mutex_t* mutex);
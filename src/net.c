@@ -1,8 +1,10 @@
 #include "net.h"
 
 #include "debug.h"
+#include "frame_arena.h"
 #include "heap.h"
 #include "mutex.h"
+#include "object_pool.h"
 #include "queue.h"
 #include "thread.h"
 #include "timer.h"
@@ -22,6 +24,7 @@ enum
 	k_max_entity_types = 32,
 	k_max_snapshots = 256,
 	k_max_entities = 32,
+	k_send_arena_frames = 4,
 };
 
 typedef struct entity_type_t
@@ -80,6 +83,9 @@ typedef struct connection_t
 	queue_t* send_queue;
 	queue_t* recv_queue;
 
+	// Outgoing packets, one frame per packet, retired by the send thread.
+	frame_arena_t* send_arena;
+
 	uint32_t last_recv_ms;
 
 	entity_data_t entities[k_max_entities];
@@ -94,6 +100,11 @@ typedef struct net_t
 
 	SOCKET sock;
 	thread_t* recv_thread;
+	// Options for send threads, which start as connections are made.
+	thread_options_t send_thread_options;
+
+	// Incoming packets: allocated on the recv thread, freed on the main thread.
+	object_pool_t* packet_pool;
 
 	mutex_t* connections_mutex;
 	connection_t connections[3];
@@ -111,12 +122,13 @@ static void snapshot_entities(net_t* net);
 static void packet_send(connection_t* connection);
 static void packet_recv(connection_t* connection);
 
-net_t* net_create(heap_t* heap, ecs_t* ecs)
+net_t* net_create(heap_t* heap, ecs_t* ecs, const thread_options_t* thread_options)
 {
-	net_t* net = heap_alloc(heap, sizeof(net_t), 8);
+	net_t* net = heap_alloc_tagged(heap, sizeof(net_t), 8, k_heap_tag_net);
 	memset(net, 0, sizeof(net_t));
 	net->heap = heap;
 	net->ecs = ecs;
+	net->packet_pool = object_pool_create(heap, sizeof(packet_t), 8, 8, true);
 
 	WSADATA data;
 	WSAStartup(MAKEWORD(2, 2), &data);
@@ -134,7 +146,11 @@ net_t* net_create(heap_t* heap, ecs_t* ecs)
 	getsockname(net->sock, (struct sockaddr*)&address, &address_len);
 	debug_print(k_print_info, "Net bound port %d\n", ntohs(address.sin_port));
 
-	net->recv_thread = thread_create(recv_thread_func, net);
+	thread_options_t recv_options = thread_options ? *thread_options : (thread_options_t) { 0 };
+	recv_options.name = "net recv";
+	net->send_thread_options = recv_options;
+	net->send_thread_options.name = "net send";
+	net->recv_thread = thread_create(recv_thread_func, net, &recv_options);
 
 	return net;
 }
@@ -146,6 +162,7 @@ void net_destroy(net_t* net)
 	thread_destroy(net->recv_thread);
 	WSACleanup();
 	mutex_destroy(net->connections_mutex);
+	object_pool_destroy(net->packet_pool);
 	heap_free(net->heap, net);
 }
 
@@ -183,6 +200,7 @@ void net_disconnect_all(net_t* net)
 			thread_destroy(c->send_thread);
 			queue_destroy(c->send_queue);
 			queue_destroy(c->recv_queue);
+			frame_arena_destroy(c->send_arena);
 		}
 	}
 	memset(net->connections, 0, sizeof(net->connections));
@@ -293,7 +311,7 @@ static int send_thread_func(void* user)
 			packet->data, packet->size, 0,
 			(struct sockaddr*)&address, sizeof(address));
 
-		heap_free(connection->net->heap, packet);
+		frame_arena_retire(connection->send_arena);
 
 		if (bytes <= 0)
 		{
@@ -333,7 +351,8 @@ static connection_t* find_or_create_connection(net_t* net, const net_address_t*
 				c->last_recv_ms = timer_ticks_to_ms(timer_get_ticks());
 				c->send_queue = queue_create(net->heap, 3);
 				c->recv_queue = queue_create(net->heap, 3);
-				c->send_thread = thread_create(send_thread_func, c);
+				c->send_arena = frame_arena_create(net->heap, k_send_arena_frames, sizeof(packet_t));
+				c->send_thread = thread_create(send_thread_func, c, &net->send_thread_options);
 
 				result = c;
 				break;
@@ -352,7 +371,7 @@ static int recv_thread_func(void* user)
 
 	while (true)
 	{
-		packet_t* packet = heap_alloc(net->heap, sizeof(packet_t), 8);
+		packet_t* packet = object_pool_alloc(net->packet_pool);
 
 		struct sockaddr_in address;
 		int address_len = sizeof(address);
@@ -361,7 +380,7 @@ static int recv_thread_func(void* user)
 			(struct sockaddr*)&address, &address_len);
 		if (bytes <= 0)
 		{
-			heap_free(net->heap, packet);
+			object_pool_free(net->packet_pool, packet);
 			break;
 		}
 
@@ -378,12 +397,15 @@ static int recv_thread_func(void* user)
 		if (!connection)
 		{
 			debug_print(k_print_info, "Too many connections!\n");
-			heap_free(net->heap, packet);
+			object_pool_free(net->packet_pool, packet);
 			continue;
 		}
 		connection->last_recv_ms = timer_ticks_to_ms(timer_get_ticks());
 
-		queue_try_push(connection->recv_queue, packet);
+		if (!queue_try_push(connection->recv_queue, packet))
+		{
+			object_pool_free(net->packet_pool, packet);
+		}
 	}
 
 	return 0;
@@ -405,6 +427,7 @@ static void timeout_old_connections(net_t* net)
 			thread_destroy(c->send_thread);
 			queue_destroy(c->send_queue);
 			queue_destroy(c->recv_queue);
+			frame_arena_destroy(c->send_arena);
 			memset(c, 0, sizeof(*c));
 		}
 	}
@@ -507,7 +530,7 @@ static void packet_send(connection_t* connection)
 {
 	net_t* net = connection->net;
 
-	packet_t* packet = heap_alloc(net->heap, sizeof(packet_t), 8);
+	packet_t* packet = frame_arena_alloc(connection->send_arena, sizeof(packet_t), 8);
 
 	packet_header_t header =
 	{
@@ -520,6 +543,7 @@ static void packet_send(connection_t* connection)
 	packet->size += (int)packet_add_entities(connection, &packet->data[packet->size], sizeof(packet->data) - packet->size);
 
 	queue_push(connection->send_queue, packet);
+	frame_arena_next_frame(connection->send_arena);
 }
 
 static void packet_read_entities(connection_t* connection, char* packet, size_t packet_size)
@@ -601,8 +625,13 @@ static void packet_recv(connection_t* connection)
 	while (true)
 	{
 		packet_t* packet = queue_try_pop(connection->recv_queue);
-		if (!packet || !packet->size)
+		if (!packet)
+		{
+			break;
+		}
+		if (!packet->size)
 		{
+			object_pool_free(net->packet_pool, packet);
 			break;
 		}
 
@@ -610,6 +639,7 @@ static void packet_recv(connection_t* connection)
 		memcpy(&header, packet->data, sizeof(header));
 		if (header.sequence <= connection->incoming_sequence)
 		{
+			object_pool_free(net->packet_pool, packet);
 			continue;
 		}
 
@@ -618,6 +648,6 @@ static void packet_recv(connection_t* connection)
 
 		packet_read_entities(connection, &packet->data[sizeof(header)], packet->size - sizeof(header));
 
-		heap_free(net->heap, packet);
+		object_pool_free(net->packet_pool, packet);
 	}
 }
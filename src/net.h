@@ -8,6 +8,7 @@
 typedef struct net_t net_t;
 
 typedef struct heap_t heap_t;
+typedef struct thread_options_t thread_options_t;
 
 typedef struct net_address_t
 {
@@ -17,7 +18,8 @@ typedef struct net_address_t
 
 typedef void(*net_configure_entity_callback_t)(ecs_t* ecs, ecs_entity_ref_t entity, int type, void* user);
 
-net_t* net_create(heap_t* heap, ecs_t* ecs);
+// Receive and per-connection send threads take their affinity and priority from thread options, which may be NULL.
+net_t* net_create(heap_t* heap, ecs_t* ecs, const thread_options_t* thread_options);
 void net_destroy(net_t* net);
 
 void net_update(net_t* net);
@@ -0,0 +1,178 @@
+#include "object_pool.h"
+
+#include "atomic.h"
+#include "debug.h"
+#include "heap.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct object_pool_block_t
+{
+	struct object_pool_block_t* next;
+} object_pool_block_t;
+
+typedef struct object_pool_slab_t
+{
+	struct object_pool_slab_t* next;
+} object_pool_slab_t;
+
+// Head of the free list.
+// The tag changes on every update so that a compare-and-swap cannot
+// succeed against a block that was popped and pushed back in between.
+typedef struct __declspec(align(16)) object_pool_head_t
+{
+	object_pool_block_t* block;
+	int64_t tag;
+} object_pool_head_t;
+
+typedef struct object_pool_t
+{
+	object_pool_head_t head;
+	heap_t* heap;
+	size_t block_size;
+	size_t alignment;
+	size_t slab_header_size;
+	int slab_block_count;
+	bool thread_safe;
+	object_pool_slab_t* slabs;
+} object_pool_t;
+
+static object_pool_block_t* object_pool_pop(object_pool_t* pool);
+static void object_pool_push(object_pool_t* pool, object_pool_block_t* first, object_pool_block_t* last);
+static object_pool_block_t* object_pool_grow(object_pool_t* pool);
+
+object_pool_t* object_pool_create(heap_t* heap, size_t block_size, size_t alignment, int slab_block_count, bool thread_safe)
+{
+	alignment = __max(alignment, sizeof(object_pool_block_t));
+	block_size = __max(block_size, sizeof(object_pool_block_t));
+
+	object_pool_t* pool = heap_alloc(heap, sizeof(object_pool_t), _Alignof(object_pool_t));
+	pool->head.block = NULL;
+	pool->head.tag = 0;
+	pool->heap = heap;
+	pool->block_size = (block_size + (alignment - 1)) & ~(alignment - 1);
+	pool->alignment = alignment;
+	pool->slab_header_size = (sizeof(object_pool_slab_t) + (alignment - 1)) & ~(alignment - 1);
+	pool->slab_block_count = slab_block_count;
+	pool->thread_safe = thread_safe;
+	pool->slabs = NULL;
+	return pool;
+}
+
+void object_pool_destroy(object_pool_t* pool)
+{
+	object_pool_slab_t* slab = pool->slabs;
+	while (slab)
+	{
+		object_pool_slab_t* next = slab->next;
+		heap_free(pool->heap, slab);
+		slab = next;
+	}
+	heap_free(pool->heap, pool);
+}
+
+void* object_pool_alloc(object_pool_t* pool)
+{
+	object_pool_block_t* block = object_pool_pop(pool);
+	if (!block)
+	{
+		block = object_pool_grow(pool);
+	}
+	return block;
+}
+
+void object_pool_free(object_pool_t* pool, void* block)
+{
+	if (block)
+	{
+		object_pool_push(pool, block, block);
+	}
+}
+
+static object_pool_block_t* object_pool_pop(object_pool_t* pool)
+{
+	if (!pool->thread_safe)
+	{
+		object_pool_block_t* block = pool->head.block;
+		if (block)
+		{
+			pool->head.block = block->next;
+		}
+		return block;
+	}
+
+	// Reading next from a block another thread just popped is harmless:
+	// slabs stay mapped until the pool is destroyed, and the tag check fails.
+	object_pool_head_t old = { pool->head.block, pool->head.tag };
+	while (old.block)
+	{
+		object_pool_head_t new_head = { old.block->next, old.tag + 1 };
+		if (atomic_compare_and_exchange128((int64_t*)&pool->head, (int64_t*)&old, (const int64_t*)&new_head))
+		{
+			break;
+		}
+	}
+	return old.block;
+}
+
+static void object_pool_push(object_pool_t* pool, object_pool_block_t* first, object_pool_block_t* last)
+{
+	if (!pool->thread_safe)
+	{
+		last->next = pool->head.block;
+		pool->head.block = first;
+		return;
+	}
+
+	object_pool_head_t old = { pool->head.block, pool->head.tag };
+	object_pool_head_t new_head = { first, 0 };
+	do
+	{
+		last->next = old.block;
+		new_head.tag = old.tag + 1;
+	} while (!atomic_compare_and_exchange128((int64_t*)&pool->head, (int64_t*)&old, (const int64_t*)&new_head));
+}
+
+static object_pool_block_t* object_pool_grow(object_pool_t* pool)
+{
+	size_t slab_size = pool->slab_header_size + pool->block_size * pool->slab_block_count;
+	object_pool_slab_t* slab = heap_alloc(pool->heap, slab_size, pool->alignment);
+	if (!slab)
+	{
+		debug_print(k_print_error, "Pool out of memory!\n");
+		return NULL;
+	}
+
+	if (pool->thread_safe)
+	{
+		object_pool_slab_t* old = pool->slabs;
+		do
+		{
+			slab->next = old;
+			old = atomic_compare_and_exchange_pointer((void**)&pool->slabs, slab->next, slab);
+		} while (old != slab->next);
+	}
+	else
+	{
+		slab->next = pool->slabs;
+		pool->slabs = slab;
+	}
+
+	// Keep the first block for the caller; chain the rest onto the free list.
+	char* blocks = (char*)slab + pool->slab_header_size;
+	object_pool_block_t* first = (object_pool_block_t*)blocks;
+	if (pool->slab_block_count > 1)
+	{
+		object_pool_block_t* second = (object_pool_block_t*)(blocks + pool->block_size);
+		object_pool_block_t* last = second;
+		for (int i = 2; i < pool->slab_block_count; ++i)
+		{
+			object_pool_block_t* block = (object_pool_block_t*)(blocks + pool->block_size * i);
+			last->next = block;
+			last = block;
+		}
+		object_pool_push(pool, second, last);
+	}
+	return first;
+}
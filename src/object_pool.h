@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Fixed-size Object Pool
+//
+// Main object, object_pool_t, hands out blocks of a single size in O(1).
+// Free blocks are kept on an intrusive free list. When the list runs dry,
+// the pool grows by a slab of blocks taken from a heap_t. Slabs are only
+// returned to the heap when the pool is destroyed.
+
+// Handle to an object pool.
+typedef struct object_pool_t object_pool_t;
+
+typedef struct heap_t heap_t;
+
+// Create a pool of blocks of block_size bytes with the given alignment.
+// The pool grows by slab_block_count blocks at a time.
+// If thread_safe is true, any thread may allocate and free at the same time
+// without taking a lock. Otherwise only one thread may use the pool at a time.
+object_pool_t* object_pool_create(heap_t* heap, size_t block_size, size_t alignment, int slab_block_count, bool thread_safe);
+
+// Destroy a pool.
+// All blocks allocated from it become invalid.
+void object_pool_destroy(object_pool_t* pool);
+
+// Allocate a block from a pool.
+void* object_pool_alloc(object_pool_t* pool);
+
+// Return a block previously allocated from a pool.
+void object_pool_free(object_pool_t* pool, void* block);
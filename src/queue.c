@@ -1,76 +1,324 @@
+#include "queue.h"
+
 #include "atomic.h"
+#include "futex.h"
 #include "heap.h"
-#include "semaphore.h"
+#include "trace.h"
+
+#if defined(_WIN32)
+#define queue_cache_aligned __declspec(align(64))
+#else
+#define queue_cache_aligned __attribute__((aligned(64)))
+#endif
 
+enum
+{
+	k_queue_cache_line = 64,
+	// Attempts before a blocking push or pop parks the thread.
+	k_queue_spin_count = 64,
+};
+
+// Bounded MPMC ring after Dmitry Vyukov's design.
+// Each cell's sequence says whose turn it is: equal to a push position when
+// the cell is free for that push, one past it once the item is written, and
+// advanced by the capacity when the item is popped so the next lap can use it.
+// Positions count every push and pop, wrapping as unsigned.
+typedef struct queue_cell_t
+{
+	int sequence;
+	void* item;
+} queue_cell_t;
+
+// The positions and the parking state each start on their own cache line,
+// k_queue_cache_line bytes.
 typedef struct queue_t
 {
+	// Shared, read-only after create.
 	heap_t* heap;
-	semaphore_t* used_items;
-	semaphore_t* free_items;
-	void** items;
-	int capacity;
-	int head_index;
-	int tail_index;
+	queue_cell_t* cells;
+	unsigned int mask;
+	trace_t* trace;
+	const char* trace_name;
+
+	queue_cache_aligned int push_position;
+
+	queue_cache_aligned int pop_position;
+
+	// Parking. The wait counts let the fast path skip the wake calls when
+	// nobody sleeps; the epochs are what sleepers wait on.
+	queue_cache_aligned int push_epoch;
+	int pop_waiters;
+	int pop_epoch;
+	int push_waiters;
 } queue_t;
 
+static int queue_put(queue_t* queue, void** items, int count);
+static int queue_take(queue_t* queue, void** items, int capacity);
+static bool queue_cell_is_free(queue_t* queue, unsigned int position);
+static bool queue_cell_is_written(queue_t* queue, unsigned int position);
+static void queue_park(int* epoch, int* waiters, queue_t* queue, bool (*ready)(queue_t*));
+static void queue_unpark(int* epoch, int* waiters, int count);
+static bool queue_has_items(queue_t* queue);
+static bool queue_has_space(queue_t* queue);
+static void queue_trace_depth(queue_t* queue);
+
 queue_t* queue_create(heap_t* heap, int capacity)
 {
-	queue_t* queue = heap_alloc(heap, sizeof(queue_t), 8);
-	queue->items = heap_alloc(heap, sizeof(void*) * capacity, 8);
-	queue->used_items = semaphore_create(0, capacity);
-	queue->free_items = semaphore_create(capacity, capacity);
+	// A cell's free and written states would coincide with only one cell.
+	unsigned int size = 2;
+	while (size < (unsigned int)capacity)
+	{
+		size *= 2;
+	}
+
+	queue_t* queue = heap_alloc(heap, sizeof(queue_t), k_queue_cache_line);
 	queue->heap = heap;
-	queue->capacity = capacity;
-	queue->head_index = 0;
-	queue->tail_index = 0;
+	queue->cells = heap_alloc(heap, sizeof(queue_cell_t) * size, k_queue_cache_line);
+	for (unsigned int i = 0; i < size; ++i)
+	{
+		queue->cells[i].sequence = (int)i;
+		queue->cells[i].item = NULL;
+	}
+	queue->mask = size - 1;
+	queue->trace = NULL;
+	queue->trace_name = NULL;
+	queue->push_position = 0;
+	queue->pop_position = 0;
+	queue->push_epoch = 0;
+	queue->pop_waiters = 0;
+	queue->pop_epoch = 0;
+	queue->push_waiters = 0;
 	return queue;
 }
 
 void queue_destroy(queue_t* queue)
 {
-	semaphore_destroy(queue->used_items);
-	semaphore_destroy(queue->free_items);
-	heap_free(queue->heap, queue->items);
+	heap_free(queue->heap, queue->cells);
 	heap_free(queue->heap, queue);
 }
 
 void queue_push(queue_t* queue, void* item)
 {
-	semaphore_acquire(queue->free_items);
-	int index = atomic_increment(&queue->tail_index) % queue->capacity;
-	queue->items[index] = item;
-	semaphore_release(queue->used_items);
+	queue_push_many(queue, &item, 1);
 }
 
 void* queue_pop(queue_t* queue)
 {
-	semaphore_acquire(queue->used_items);
-	int index = atomic_increment(&queue->head_index) % queue->capacity;
-	void* item = queue->items[index];
-	semaphore_release(queue->free_items);
+	void* item;
+	queue_pop_many(queue, &item, 1);
 	return item;
 }
 
 bool queue_try_push(queue_t* queue, void* item)
 {
-	if (semaphore_try_acquire(queue->free_items))
+	return queue_put(queue, &item, 1) == 1;
+}
+
+void* queue_try_pop(queue_t* queue)
+{
+	void* item;
+	return queue_take(queue, &item, 1) ? item : NULL;
+}
+
+void queue_push_many(queue_t* queue, void** items, int count)
+{
+	for (int i = 0; count > 0; ++i)
 	{
-		int index = atomic_increment(&queue->tail_index) % queue->capacity;
-		queue->items[index] = item;
-		semaphore_release(queue->used_items);
-		return true;
+		int pushed = queue_put(queue, items, count);
+		items += pushed;
+		count -= pushed;
+		if (!pushed && i >= k_queue_spin_count)
+		{
+			queue_park(&queue->pop_epoch, &queue->push_waiters, queue, queue_has_space);
+		}
 	}
-	return false;
 }
 
-void* queue_try_pop(queue_t* queue)
+int queue_pop_many(queue_t* queue, void** items, int capacity)
+{
+	int count;
+	for (int i = 0; (count = queue_take(queue, items, capacity)) == 0; ++i)
+	{
+		if (i >= k_queue_spin_count)
+		{
+			queue_park(&queue->push_epoch, &queue->pop_waiters, queue, queue_has_items);
+		}
+	}
+	return count;
+}
+
+void queue_set_trace(queue_t* queue, trace_t* trace, const char* name)
+{
+	queue->trace_name = name;
+	queue->trace = trace;
+}
+
+// Push up to count items into consecutive free cells with one claim.
+// Returns the number pushed, zero if the queue is full.
+static int queue_put(queue_t* queue, void** items, int count)
+{
+	unsigned int position = (unsigned int)atomic_load(&queue->push_position);
+	while (true)
+	{
+		queue_cell_t* cell = &queue->cells[position & queue->mask];
+		int difference = (int)((unsigned int)atomic_load(&cell->sequence) - position);
+		if (difference < 0)
+		{
+			// The cell still holds an item from the previous lap: full.
+			return 0;
+		}
+		if (difference == 0)
+		{
+			int claim = 1;
+			while (claim < count && queue_cell_is_free(queue, position + claim))
+			{
+				++claim;
+			}
+
+			int old = atomic_compare_and_exchange(&queue->push_position, (int)position, (int)(position + claim));
+			if (old == (int)position)
+			{
+				for (int i = 0; i < claim; ++i)
+				{
+					cell = &queue->cells[(position + i) & queue->mask];
+					cell->item = items[i];
+					if (i + 1 < claim)
+					{
+						atomic_store(&cell->sequence, (int)(position + i + 1));
+					}
+				}
+				// Interlocked so every item is visible before the waiter check below.
+				atomic_add(&cell->sequence, 1);
+				queue_unpark(&queue->push_epoch, &queue->pop_waiters, claim);
+				queue_trace_depth(queue);
+				return claim;
+			}
+			position = (unsigned int)old;
+		}
+		else
+		{
+			// Another producer took this position; catch up.
+			position = (unsigned int)atomic_load(&queue->push_position);
+		}
+	}
+}
+
+// Pop up to capacity items from consecutive written cells with one claim.
+// Returns the number popped, zero if the queue is empty.
+// Separate from queue_try_pop because NULL is a valid item.
+static int queue_take(queue_t* queue, void** items, int capacity)
+{
+	unsigned int position = (unsigned int)atomic_load(&queue->pop_position);
+	while (true)
+	{
+		queue_cell_t* cell = &queue->cells[position & queue->mask];
+		int difference = (int)((unsigned int)atomic_load(&cell->sequence) - (position + 1));
+		if (difference < 0)
+		{
+			// The cell has not been written this lap: empty.
+			return 0;
+		}
+		if (difference == 0)
+		{
+			int claim = 1;
+			while (claim < capacity && queue_cell_is_written(queue, position + claim))
+			{
+				++claim;
+			}
+
+			int old = atomic_compare_and_exchange(&queue->pop_position, (int)position, (int)(position + claim));
+			if (old == (int)position)
+			{
+				// Hand each cell to the push one lap ahead.
+				for (int i = 0; i < claim; ++i)
+				{
+					cell = &queue->cells[(position + i) & queue->mask];
+					items[i] = cell->item;
+					if (i + 1 < claim)
+					{
+						atomic_store(&cell->sequence, (int)(position + i + queue->mask + 1));
+					}
+				}
+				atomic_add(&cell->sequence, (int)queue->mask);
+				queue_unpark(&queue->pop_epoch, &queue->push_waiters, claim);
+				queue_trace_depth(queue);
+				return claim;
+			}
+			position = (unsigned int)old;
+		}
+		else
+		{
+			// Another consumer took this position; catch up.
+			position = (unsigned int)atomic_load(&queue->pop_position);
+		}
+	}
+}
+
+static bool queue_cell_is_free(queue_t* queue, unsigned int position)
+{
+	queue_cell_t* cell = &queue->cells[position & queue->mask];
+	return (unsigned int)atomic_load(&cell->sequence) == position;
+}
+
+static bool queue_cell_is_written(queue_t* queue, unsigned int position)
+{
+	queue_cell_t* cell = &queue->cells[position & queue->mask];
+	return (unsigned int)atomic_load(&cell->sequence) == position + 1;
+}
+
+static bool queue_has_items(queue_t* queue)
+{
+	unsigned int position = (unsigned int)atomic_load(&queue->pop_position);
+	queue_cell_t* cell = &queue->cells[position & queue->mask];
+	return (int)((unsigned int)atomic_load(&cell->sequence) - (position + 1)) >= 0;
+}
+
+static bool queue_has_space(queue_t* queue)
+{
+	unsigned int position = (unsigned int)atomic_load(&queue->push_position);
+	queue_cell_t* cell = &queue->cells[position & queue->mask];
+	return (int)((unsigned int)atomic_load(&cell->sequence) - position) >= 0;
+}
+
+// Sleep until the other side moves the epoch.
+// Registering as a waiter and the other side's sequence update are both
+// interlocked, so either the re-check sees the update or the other side
+// sees the waiter and bumps the epoch, which futex_wait notices.
+static void queue_park(int* epoch, int* waiters, queue_t* queue, bool (*ready)(queue_t*))
+{
+	int observed = atomic_load(epoch);
+	atomic_increment(waiters);
+	if (!ready(queue))
+	{
+		futex_wait(epoch, observed);
+	}
+	atomic_decrement(waiters);
+}
+
+// Count is the number of items or cells made available, each of which may satisfy a sleeper.
+static void queue_unpark(int* epoch, int* waiters, int count)
+{
+	if (atomic_load(waiters))
+	{
+		atomic_increment(epoch);
+		if (count > 1)
+		{
+			futex_wake_all(epoch);
+		}
+		else
+		{
+			futex_wake(epoch);
+		}
+	}
+}
+
+static void queue_trace_depth(queue_t* queue)
 {
-	if (semaphore_try_acquire(queue->used_items))
+	// Reading the other side's position costs a cache miss; skip it unless recording.
+	trace_t* trace = queue->trace;
+	if (trace && trace_is_capturing(trace))
 	{
-		int index = atomic_increment(&queue->head_index) % queue->capacity;
-		void* item = queue->items[index];
-		semaphore_release(queue->free_items);
-		return item;
+		int depth = atomic_load(&queue->push_position) - atomic_load(&queue->pop_position);
+		trace_counter(trace, queue->trace_name, depth);
 	}
-	return NULL;
 }
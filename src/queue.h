@@ -3,13 +3,18 @@
 #include <stdbool.h>
 
 // Thread-safe Queue container
+//
+// Bounded multi-producer multi-consumer ring. Pushes and pops are lock-free;
+// a thread only sleeps in the OS when it must block on a full or empty queue.
 
 // Handle to a thread-safe queue.
 typedef struct queue_t queue_t;
 
 typedef struct heap_t heap_t;
+typedef struct trace_t trace_t;
 
 // Create a queue with the defined capacity.
+// Capacity is rounded up to a power of two, and to at least two.
 queue_t* queue_create(heap_t* heap, int capacity);
 
 // Destroy a previously created queue.
@@ -34,3 +39,23 @@ bool queue_try_push(queue_t* queue, void* item);
 // If the queue is empty, returns NULL.
 // Safe for multiple threads to pop at the same time.
 void* queue_try_pop(queue_t* queue);
+
+// Push several items onto a queue, in order.
+// Items go in with one synchronization operation per run of free space;
+// if the queue fills, blocks until all of them are pushed. Items from
+// other producers may land between those runs.
+// Safe for multiple threads to push at the same time.
+void queue_push_many(queue_t* queue, void** items, int count);
+
+// Pop up to capacity items off a queue (FIFO order).
+// If the queue is empty, blocks until an item is available, then takes
+// everything available at once with one synchronization operation.
+// Returns the number of items popped.
+// Safe for multiple threads to pop at the same time.
+int queue_pop_many(queue_t* queue, void** items, int capacity);
+
+// Report the number of items in a queue to a trace as a named counter.
+// Recorded on every push and pop while the trace is capturing.
+// Pass NULL to stop reporting.
+// Name must remain valid while the trace is set.
+void queue_set_trace(queue_t* queue, trace_t* trace, const char* name);
@@ -1,10 +1,12 @@
 #include "render.h"
 
 #include "ecs.h"
+#include "frame_arena.h"
 #include "gpu.h"
 #include "heap.h"
-#include "queue.h"
+#include "spsc_queue.h"
 #include "thread.h"
+#include "trace.h"
 #include "wm.h"
 
 #include <assert.h>
@@ -13,6 +15,12 @@
 enum
 {
 	k_render_max_drawables = 512,
+	k_render_arena_frames = 3,
+	k_render_arena_block_size = 128 * 1024,
+	// Frames are paced by the arena; the queue only needs to absorb a burst of draws.
+	k_render_queue_capacity = 1024,
+	// Commands handed to or taken from the queue at a time.
+	k_render_submit_batch = 64,
 };
 
 typedef enum command_type_t
@@ -64,7 +72,11 @@ typedef struct render_t
 	wm_window_t* window;
 	thread_t* thread;
 	gpu_t* gpu;
-	queue_t* queue;
+	spsc_queue_t* queue;
+	void* pending[k_render_submit_batch];
+	int pending_count;
+	frame_arena_t* arena;
+	trace_t* trace;
 
 	int frame_counter;
 	int gpu_frame_count;
@@ -78,51 +90,86 @@ typedef struct render_t
 } render_t;
 
 static int render_thread_func(void* user);
+static void render_submit(render_t* render, void* command);
+static void render_flush(render_t* render);
 static draw_shader_t* create_or_get_shader_for_model_command(render_t* render, model_command_t* command);
 static draw_mesh_t* create_or_get_mesh_for_model_command(render_t* render, model_command_t* command);
 static draw_instance_t* create_or_get_instance_for_model_command(render_t* render, model_command_t* command, gpu_shader_t* shader);
 static void destroy_stale_data(render_t* render);
 
-render_t* render_create(heap_t* heap, wm_window_t* window)
+render_t* render_create(heap_t* heap, wm_window_t* window, const thread_options_t* thread_options)
 {
-	render_t* render = heap_alloc(heap, sizeof(render_t), 8);
+	thread_options_t options = thread_options ? *thread_options : (thread_options_t) { 0 };
+	options.name = "render";
+
+	render_t* render = heap_alloc_tagged(heap, sizeof(render_t), 8, k_heap_tag_render);
 	render->heap = heap;
 	render->window = window;
-	render->queue = queue_create(heap, 3);
+	render->queue = spsc_queue_create(heap, k_render_queue_capacity);
+	render->pending_count = 0;
+	render->arena = frame_arena_create(heap, k_render_arena_frames, k_render_arena_block_size);
 	render->frame_counter = 0;
 	render->instance_count = 0;
 	render->mesh_count = 0;
 	render->shader_count = 0;
-	render->thread = thread_create(render_thread_func, render);
+	render->trace = NULL;
+	render->thread = thread_create(render_thread_func, render, &options);
 	return render;
 }
 
 void render_destroy(render_t* render)
 {
-	queue_push(render->queue, NULL);
+	render_submit(render, NULL);
+	render_flush(render);
 	thread_destroy(render->thread);
-	queue_destroy(render->queue);
+	spsc_queue_destroy(render->queue);
+	frame_arena_destroy(render->arena);
 	heap_free(render->heap, render);
 }
 
 void render_push_model(render_t* render, ecs_entity_ref_t* entity, gpu_mesh_info_t* mesh, gpu_shader_info_t* shader, gpu_uniform_buffer_info_t* uniform)
 {
-	model_command_t* command = heap_alloc(render->heap, sizeof(model_command_t), 8);
+	model_command_t* command = frame_arena_alloc(render->arena, sizeof(model_command_t), 8);
 	command->type = k_command_model;
 	command->entity = *entity;
 	command->mesh = mesh;
 	command->shader = shader;
 	command->uniform_buffer.size = uniform->size;
-	command->uniform_buffer.data = heap_alloc(render->heap, uniform->size, 8);
+	command->uniform_buffer.data = frame_arena_alloc(render->arena, uniform->size, 16);
 	memcpy(command->uniform_buffer.data, uniform->data, uniform->size);
-	queue_push(render->queue, command);
+	render_submit(render, command);
 }
 
 void render_push_done(render_t* render)
 {
-	frame_done_command_t* command = heap_alloc(render->heap, sizeof(frame_done_command_t), 8);
+	frame_done_command_t* command = frame_arena_alloc(render->arena, sizeof(frame_done_command_t), 8);
 	command->type = k_command_frame_done;
-	queue_push(render->queue, command);
+	render_submit(render, command);
+	render_flush(render);
+	frame_arena_next_frame(render->arena);
+}
+
+void render_set_trace(render_t* render, trace_t* trace)
+{
+	render->trace = trace;
+	spsc_queue_set_trace(render->queue, trace, "render queue");
+}
+
+// Commands are handed to the render thread in batches; a frame's
+// commands are all flushed by the time its frame done command is.
+static void render_submit(render_t* render, void* command)
+{
+	render->pending[render->pending_count++] = command;
+	if (render->pending_count == k_render_submit_batch)
+	{
+		render_flush(render);
+	}
+}
+
+static void render_flush(render_t* render)
+{
+	spsc_queue_push_many(render->queue, render->pending, render->pending_count);
+	render->pending_count = 0;
 }
 
 static int render_thread_func(void* user)
@@ -136,10 +183,21 @@ static int render_thread_func(void* user)
 	gpu_pipeline_t* last_pipeline = NULL;
 	gpu_mesh_t* last_mesh = NULL;
 	int frame_index = 0;
+	int draw_count = 0;
+
+	void* batch[k_render_submit_batch];
+	int batch_count = 0;
+	int batch_index = 0;
 
 	while (true)
 	{
-		command_type_t* type = queue_pop(render->queue);
+		if (batch_index == batch_count)
+		{
+			batch_count = spsc_queue_pop_many(render->queue, batch, k_render_submit_batch);
+			batch_index = 0;
+		}
+
+		command_type_t* type = batch[batch_index++];
 		if (!type)
 		{
 			break;
@@ -159,6 +217,16 @@ static int render_thread_func(void* user)
 
 			destroy_stale_data(render);
 			++render->frame_counter;
+
+			// Commands for this frame are consumed; let the main thread reuse their memory.
+			frame_arena_retire(render->arena);
+
+			trace_t* trace = render->trace;
+			if (trace)
+			{
+				trace_counter(trace, "render draws", draw_count);
+			}
+			draw_count = 0;
 			frame_index = render->frame_counter % render->gpu_frame_count;
 		}
 		else if (*type == k_command_model)
@@ -168,8 +236,6 @@ static int render_thread_func(void* user)
 			draw_mesh_t* mesh = create_or_get_mesh_for_model_command(render, command);
 			draw_instance_t* instance = create_or_get_instance_for_model_command(render, command, shader->shader);
 
-			heap_free(render->heap, command->uniform_buffer.data);
-
 			if (last_pipeline != shader->pipeline)
 			{
 				gpu_cmd_pipeline_bind(render->gpu, cmdbuf, shader->pipeline);
@@ -182,9 +248,8 @@ static int render_thread_func(void* user)
 			}
 			gpu_cmd_descriptor_bind(render->gpu, cmdbuf, instance->descriptors[frame_index]);
 			gpu_cmd_draw(render->gpu, cmdbuf);
+			++draw_count;
 		}
-
-		heap_free(render->heap, type);
 	}
 
 	gpu_wait_until_idle(render->gpu);
@@ -273,8 +338,8 @@ static draw_instance_t* create_or_get_instance_for_model_command(render_t* rende
 		instance = &render->instances[render->instance_count++];
 
 		instance->entity = command->entity;
-		instance->uniform_buffers = heap_alloc(render->heap, sizeof(gpu_uniform_buffer_t*) * render->gpu_frame_count, 8);
-		instance->descriptors = heap_alloc(render->heap, sizeof(gpu_descriptor_t*) * render->gpu_frame_count, 8);
+		instance->uniform_buffers = heap_alloc_tagged(render->heap, sizeof(gpu_uniform_buffer_t*) * render->gpu_frame_count, 8, k_heap_tag_render);
+		instance->descriptors = heap_alloc_tagged(render->heap, sizeof(gpu_descriptor_t*) * render->gpu_frame_count, 8, k_heap_tag_render);
 		for (int i = 0; i < render->gpu_frame_count; ++i)
 		{
 			instance->uniform_buffers[i] = gpu_uniform_buffer_create(render->gpu, &command->uniform_buffer);
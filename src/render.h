@@ -9,10 +9,13 @@ typedef struct gpu_mesh_info_t gpu_mesh_info_t;
 typedef struct gpu_shader_info_t gpu_shader_info_t;
 typedef struct gpu_uniform_buffer_info_t gpu_uniform_buffer_info_t;
 typedef struct heap_t heap_t;
+typedef struct thread_options_t thread_options_t;
+typedef struct trace_t trace_t;
 typedef struct wm_window_t wm_window_t;
 
 // Create a render system.
-render_t* render_create(heap_t* heap, wm_window_t* window);
+// The render thread takes its affinity and priority from thread options, which may be NULL.
+render_t* render_create(heap_t* heap, wm_window_t* window, const thread_options_t* thread_options);
 
 // Destroy a render system.
 void render_destroy(render_t* render);
@@ -22,3 +25,8 @@ void render_push_model(render_t* render, ecs_entity_ref_t* entity, gpu_mesh_info
 
 // Push an end-of-frame marker on a queue of items to be rendered.
 void render_push_done(render_t* render);
+
+// Report render activity to a trace.
+// Queue depth and draws per frame are recorded as counters.
+// Pass NULL to stop reporting.
+void render_set_trace(render_t* render, trace_t* trace);
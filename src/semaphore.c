@@ -1,31 +1,120 @@
 #include "semaphore.h"
 
+#include "atomic.h"
+#include "futex.h"
+
+#include <stdlib.h>
+
+#if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#define semaphore_pause() YieldProcessor()
+#elif defined(__x86_64__) || defined(__i386__)
+#define semaphore_pause() __builtin_ia32_pause()
+#else
+#define semaphore_pause()
+#endif
+
+enum
+{
+	// Upper bound on polls of an empty count before sleeping.
+	k_semaphore_max_spin_count = 128,
+};
+
+// The count is taken and given back in user space; the kernel is only
+// entered to sleep on a zero count, or to wake a sleeper on release.
+typedef struct semaphore_t
+{
+	int count;
+	int max_count;
+	// Threads sleeping on the count.
+	int waiters;
+	// Running average of polls it took to take the count by spinning.
+	int spin_count;
+} semaphore_t;
 
 semaphore_t* semaphore_create(int initial_count, int max_count)
 {
-	HANDLE semaphore = CreateSemaphore(NULL, initial_count, max_count, NULL);
-	return (semaphore_t*)semaphore;
+	semaphore_t* semaphore = malloc(sizeof(semaphore_t));
+	semaphore->count = initial_count;
+	semaphore->max_count = max_count;
+	semaphore->waiters = 0;
+	semaphore->spin_count = 0;
+	return semaphore;
 }
 
 void semaphore_destroy(semaphore_t* semaphore)
 {
-	CloseHandle(semaphore);
+	free(semaphore);
 }
 
 void semaphore_acquire(semaphore_t* semaphore)
 {
-	WaitForSingleObject(semaphore, INFINITE);
+	if (semaphore_try_acquire(semaphore))
+	{
+		return;
+	}
+
+	int spin_limit = semaphore->spin_count * 2 + 16;
+	if (spin_limit > k_semaphore_max_spin_count)
+	{
+		spin_limit = k_semaphore_max_spin_count;
+	}
+	for (int i = 0; i < spin_limit; ++i)
+	{
+		semaphore_pause();
+		if (semaphore_try_acquire(semaphore))
+		{
+			semaphore->spin_count += (i - semaphore->spin_count) / 8;
+			return;
+		}
+	}
+	semaphore->spin_count += (spin_limit - semaphore->spin_count) / 8;
+
+	// Announce the sleeper before the final check: a release either sees it
+	// and wakes us, or its count is seen here and we never sleep.
+	atomic_increment(&semaphore->waiters);
+	while (!semaphore_try_acquire(semaphore))
+	{
+		futex_wait(&semaphore->count, 0);
+	}
+	atomic_decrement(&semaphore->waiters);
 }
 
 bool semaphore_try_acquire(semaphore_t* semaphore)
 {
-	DWORD result = WaitForSingleObject(semaphore, 0);
-	return result == WAIT_OBJECT_0;
+	int count = atomic_load(&semaphore->count);
+	while (count > 0)
+	{
+		int old_count = atomic_compare_and_exchange(&semaphore->count, count, count - 1);
+		if (old_count == count)
+		{
+			return true;
+		}
+		count = old_count;
+	}
+	return false;
 }
 
 void semaphore_release(semaphore_t* semaphore)
 {
-	ReleaseSemaphore(semaphore, 1, NULL);
+	int count = atomic_load(&semaphore->count);
+	while (true)
+	{
+		// Like ReleaseSemaphore, releasing past the maximum count does nothing.
+		if (count >= semaphore->max_count)
+		{
+			return;
+		}
+		int old_count = atomic_compare_and_exchange(&semaphore->count, count, count + 1);
+		if (old_count == count)
+		{
+			break;
+		}
+		count = old_count;
+	}
+	if (atomic_load(&semaphore->waiters) > 0)
+	{
+		futex_wake(&semaphore->count);
+	}
 }
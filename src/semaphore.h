@@ -3,6 +3,9 @@
 #include <stdbool.h>
 
 // Counting semaphore thread synchronization
+//
+// Acquiring a nonzero count and releasing with no sleepers stay in user space.
+// A thread that finds the count at zero spins briefly, then sleeps on a futex.
 
 // Handle to a semaphore.
 typedef struct semaphore_t semaphore_t;
@@ -0,0 +1,265 @@
+#include "spsc_queue.h"
+
+#include "atomic.h"
+#include "heap.h"
+#include "semaphore.h"
+#include "trace.h"
+
+#include <assert.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#define spsc_queue_pause() YieldProcessor()
+#define spsc_queue_cache_aligned __declspec(align(64))
+#else
+#if defined(__x86_64__) || defined(__i386__)
+#define spsc_queue_pause() __builtin_ia32_pause()
+#else
+#define spsc_queue_pause()
+#endif
+#define spsc_queue_cache_aligned __attribute__((aligned(64)))
+#endif
+
+enum
+{
+	k_spsc_queue_cache_line = 64,
+	// Polls of the other side's index before sleeping in the OS.
+	k_spsc_queue_spin_count = 256,
+};
+
+// Head and tail count every item ever popped and pushed, wrapping as unsigned.
+// Their difference is the number of items in the ring.
+// Each side starts on its own cache line, k_spsc_queue_cache_line bytes.
+typedef struct spsc_queue_t
+{
+	// Shared, read-only after create.
+	heap_t* heap;
+	void** items;
+	unsigned int mask;
+	semaphore_t* items_available;
+	semaphore_t* space_available;
+	trace_t* trace;
+	const char* trace_name;
+
+	// Producer side. The cached head saves reading the consumer's line until the ring looks full.
+	spsc_queue_cache_aligned int tail;
+	unsigned int cached_head;
+	int producer_waiting;
+
+	// Consumer side. The cached tail saves reading the producer's line until the ring looks empty.
+	spsc_queue_cache_aligned int head;
+	unsigned int cached_tail;
+	int consumer_waiting;
+} spsc_queue_t;
+
+static void spsc_queue_wait(spsc_queue_t* queue, bool (*ready)(spsc_queue_t*), int* waiting, semaphore_t* wake);
+static void spsc_queue_wake(int* waiting, semaphore_t* wake);
+static int spsc_queue_put(spsc_queue_t* queue, void** items, int count);
+static int spsc_queue_take(spsc_queue_t* queue, void** items, int capacity);
+static bool spsc_queue_has_items(spsc_queue_t* queue);
+static bool spsc_queue_has_space(spsc_queue_t* queue);
+static void spsc_queue_trace_depth(spsc_queue_t* queue);
+
+spsc_queue_t* spsc_queue_create(heap_t* heap, int capacity)
+{
+	assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+
+	spsc_queue_t* queue = heap_alloc(heap, sizeof(spsc_queue_t), k_spsc_queue_cache_line);
+	queue->heap = heap;
+	queue->items = heap_alloc(heap, sizeof(void*) * capacity, k_spsc_queue_cache_line);
+	queue->mask = (unsigned int)capacity - 1;
+	queue->items_available = semaphore_create(0, 1);
+	queue->space_available = semaphore_create(0, 1);
+	queue->trace = NULL;
+	queue->trace_name = NULL;
+	queue->tail = 0;
+	queue->cached_head = 0;
+	queue->producer_waiting = 0;
+	queue->head = 0;
+	queue->cached_tail = 0;
+	queue->consumer_waiting = 0;
+	return queue;
+}
+
+void spsc_queue_destroy(spsc_queue_t* queue)
+{
+	semaphore_destroy(queue->items_available);
+	semaphore_destroy(queue->space_available);
+	heap_free(queue->heap, queue->items);
+	heap_free(queue->heap, queue);
+}
+
+void spsc_queue_push(spsc_queue_t* queue, void* item)
+{
+	spsc_queue_push_many(queue, &item, 1);
+}
+
+void* spsc_queue_pop(spsc_queue_t* queue)
+{
+	void* item;
+	spsc_queue_pop_many(queue, &item, 1);
+	return item;
+}
+
+bool spsc_queue_try_push(spsc_queue_t* queue, void* item)
+{
+	return spsc_queue_put(queue, &item, 1) == 1;
+}
+
+void* spsc_queue_try_pop(spsc_queue_t* queue)
+{
+	void* item;
+	return spsc_queue_take(queue, &item, 1) ? item : NULL;
+}
+
+void spsc_queue_push_many(spsc_queue_t* queue, void** items, int count)
+{
+	while (count > 0)
+	{
+		int pushed = spsc_queue_put(queue, items, count);
+		items += pushed;
+		count -= pushed;
+		if (!pushed)
+		{
+			spsc_queue_wait(queue, spsc_queue_has_space, &queue->producer_waiting, queue->space_available);
+		}
+	}
+}
+
+int spsc_queue_pop_many(spsc_queue_t* queue, void** items, int capacity)
+{
+	int count;
+	while ((count = spsc_queue_take(queue, items, capacity)) == 0)
+	{
+		spsc_queue_wait(queue, spsc_queue_has_items, &queue->consumer_waiting, queue->items_available);
+	}
+	return count;
+}
+
+void spsc_queue_set_trace(spsc_queue_t* queue, trace_t* trace, const char* name)
+{
+	queue->trace_name = name;
+	queue->trace = trace;
+}
+
+// Push as many of count items as fit. Returns the number pushed.
+static int spsc_queue_put(spsc_queue_t* queue, void** items, int count)
+{
+	unsigned int tail = (unsigned int)queue->tail;
+	unsigned int space = queue->mask + 1 - (tail - queue->cached_head);
+	if (space < (unsigned int)count)
+	{
+		queue->cached_head = (unsigned int)atomic_load(&queue->head);
+		space = queue->mask + 1 - (tail - queue->cached_head);
+	}
+	int pushed = space < (unsigned int)count ? (int)space : count;
+	if (!pushed)
+	{
+		return 0;
+	}
+
+	for (int i = 0; i < pushed; ++i)
+	{
+		queue->items[(tail + i) & queue->mask] = items[i];
+	}
+
+	// Interlocked add publishes the items and orders them before the waiting check below.
+	atomic_add(&queue->tail, pushed);
+	spsc_queue_wake(&queue->consumer_waiting, queue->items_available);
+	spsc_queue_trace_depth(queue);
+	return pushed;
+}
+
+// Pop up to capacity items. Returns the number popped.
+static int spsc_queue_take(spsc_queue_t* queue, void** items, int capacity)
+{
+	unsigned int head = (unsigned int)queue->head;
+	unsigned int available = queue->cached_tail - head;
+	if (available < (unsigned int)capacity)
+	{
+		queue->cached_tail = (unsigned int)atomic_load(&queue->tail);
+		available = queue->cached_tail - head;
+	}
+	int popped = available < (unsigned int)capacity ? (int)available : capacity;
+	if (!popped)
+	{
+		return 0;
+	}
+
+	for (int i = 0; i < popped; ++i)
+	{
+		items[i] = queue->items[(head + i) & queue->mask];
+	}
+
+	atomic_add(&queue->head, popped);
+	spsc_queue_wake(&queue->producer_waiting, queue->space_available);
+	spsc_queue_trace_depth(queue);
+	return popped;
+}
+
+static bool spsc_queue_has_items(spsc_queue_t* queue)
+{
+	unsigned int head = (unsigned int)queue->head;
+	if (queue->cached_tail != head)
+	{
+		return true;
+	}
+	queue->cached_tail = (unsigned int)atomic_load(&queue->tail);
+	return queue->cached_tail != head;
+}
+
+static bool spsc_queue_has_space(spsc_queue_t* queue)
+{
+	unsigned int tail = (unsigned int)queue->tail;
+	if (tail - queue->cached_head <= queue->mask)
+	{
+		return true;
+	}
+	queue->cached_head = (unsigned int)atomic_load(&queue->head);
+	return tail - queue->cached_head <= queue->mask;
+}
+
+// Spin briefly, then sleep until the other side signals.
+// Setting the waiting flag and the other side's index update are both
+// interlocked, so either this side sees the update or the other side sees the flag.
+static void spsc_queue_wait(spsc_queue_t* queue, bool (*ready)(spsc_queue_t*), int* waiting, semaphore_t* wake)
+{
+	for (int i = 0; i < k_spsc_queue_spin_count; ++i)
+	{
+		if (ready(queue))
+		{
+			return;
+		}
+		spsc_queue_pause();
+	}
+
+	atomic_compare_and_exchange(waiting, 0, 1);
+	if (ready(queue) && atomic_compare_and_exchange(waiting, 1, 0) == 1)
+	{
+		return;
+	}
+
+	// Either nothing is ready, or the other side already cleared the flag
+	// and released the semaphore; take the release so it is not left over.
+	semaphore_acquire(wake);
+}
+
+static void spsc_queue_wake(int* waiting, semaphore_t* wake)
+{
+	if (atomic_load(waiting) && atomic_compare_and_exchange(waiting, 1, 0) == 1)
+	{
+		semaphore_release(wake);
+	}
+}
+
+static void spsc_queue_trace_depth(spsc_queue_t* queue)
+{
+	// Reading the other side's position costs a cache miss; skip it unless recording.
+	trace_t* trace = queue->trace;
+	if (trace && trace_is_capturing(trace))
+	{
+		int depth = atomic_load(&queue->tail) - atomic_load(&queue->head);
+		trace_counter(trace, queue->trace_name, depth);
+	}
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Single-Producer Single-Consumer Queue
+//
+// Main object, spsc_queue_t, is a bounded ring of pointers for handing
+// work from exactly one producer thread to exactly one consumer thread.
+// Pushes and pops touch only user-space memory; the head and tail live on
+// separate cache lines so the two threads do not contend. A thread only
+// blocks in the OS when the ring is full (producer) or empty (consumer).
+
+// Handle to a single-producer single-consumer queue.
+typedef struct spsc_queue_t spsc_queue_t;
+
+typedef struct heap_t heap_t;
+typedef struct trace_t trace_t;
+
+// Create a queue with the defined capacity.
+// Capacity must be a power of two.
+spsc_queue_t* spsc_queue_create(heap_t* heap, int capacity);
+
+// Destroy a previously created queue.
+void spsc_queue_destroy(spsc_queue_t* queue);
+
+// Push an item onto a queue.
+// If the queue is full, blocks until space is available.
+// Call only from the producer thread.
+void spsc_queue_push(spsc_queue_t* queue, void* item);
+
+// Pop an item off a queue (FIFO order).
+// If the queue is empty, blocks until an item is available.
+// Call only from the consumer thread.
+void* spsc_queue_pop(spsc_queue_t* queue);
+
+// Push an item onto a queue if space is available.
+// If the queue is full, returns false.
+// Call only from the producer thread.
+bool spsc_queue_try_push(spsc_queue_t* queue, void* item);
+
+// Pop an item off a queue (FIFO order).
+// If the queue is empty, returns NULL.
+// Call only from the consumer thread.
+void* spsc_queue_try_pop(spsc_queue_t* queue);
+
+// Push several items onto a queue, in order.
+// Items go in with one synchronization operation per run of free space;
+// if the queue fills, blocks until all of them are pushed.
+// Call only from the producer thread.
+void spsc_queue_push_many(spsc_queue_t* queue, void** items, int count);
+
+// Pop up to capacity items off a queue (FIFO order).
+// If the queue is empty, blocks until an item is available, then takes
+// everything available at once with one synchronization operation.
+// Returns the number of items popped.
+// Call only from the consumer thread.
+int spsc_queue_pop_many(spsc_queue_t* queue, void** items, int capacity);
+
+// Report the number of items in a queue to a trace as a named counter.
+// Recorded on every push and pop while the trace is capturing.
+// Pass NULL to stop reporting.
+// Name must remain valid while the trace is set.
+void spsc_queue_set_trace(spsc_queue_t* queue, trace_t* trace, const char* name);
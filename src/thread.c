@@ -1,18 +1,31 @@
+// Thread naming and affinity on Linux are GNU extensions.
+#if !defined(_WIN32)
+#define _GNU_SOURCE
+#endif
+
 #include "thread.h"
 
 #include "debug.h"
 
+#include <string.h>
+
+#if defined(_WIN32)
+
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
-thread_t* thread_create(int (*function)(void*), void* data)
+static void thread_apply_options(HANDLE h, const thread_options_t* options);
+
+thread_t* thread_create(int (*function)(void*), void* data, const thread_options_t* options)
 {
 	HANDLE h = CreateThread(NULL, 0, function, data, CREATE_SUSPENDED, NULL);
-	if (h == INVALID_HANDLE_VALUE)
+	if (!h)
 	{
 		debug_print(k_print_warning, "Thread failed to create!\n");
 		return NULL;
 	}
+	// Applied while suspended so the thread never runs outside its affinity.
+	thread_apply_options(h, options);
 	ResumeThread(h);
 	return (thread_t*)h;
 }
@@ -26,7 +39,214 @@ int thread_destroy(thread_t* thread)
 	return code;
 }
 
+void thread_set_current_options(const thread_options_t* options)
+{
+	thread_apply_options(GetCurrentThread(), options);
+}
+
+bool thread_get_current_name(char* buffer, size_t size)
+{
+	buffer[0] = '\0';
+	PWSTR name = NULL;
+	if (FAILED(GetThreadDescription(GetCurrentThread(), &name)))
+	{
+		return false;
+	}
+	if (WideCharToMultiByte(CP_UTF8, 0, name, -1, buffer, (int)size, NULL, NULL) == 0)
+	{
+		buffer[0] = '\0';
+	}
+	LocalFree(name);
+	return buffer[0] != '\0';
+}
+
 void thread_sleep(uint32_t ms)
 {
 	Sleep(ms);
 }
+
+int thread_get_core_count()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+}
+
+static void thread_apply_options(HANDLE h, const thread_options_t* options)
+{
+	if (!options)
+	{
+		return;
+	}
+
+	if (options->name)
+	{
+		wchar_t name[64];
+		int length = (int)strnlen(options->name, _countof(name) - 1);
+		length = MultiByteToWideChar(CP_UTF8, 0, options->name, length, name, _countof(name) - 1);
+		name[length] = L'\0';
+		SetThreadDescription(h, name);
+	}
+
+	if (options->affinity_mask && !SetThreadAffinityMask(h, (DWORD_PTR)options->affinity_mask))
+	{
+		debug_print(k_print_warning, "Thread failed to set affinity mask!\n");
+	}
+
+	static const int k_priorities[] =
+	{
+		[k_thread_priority_normal] = THREAD_PRIORITY_NORMAL,
+		[k_thread_priority_low] = THREAD_PRIORITY_BELOW_NORMAL,
+		[k_thread_priority_high] = THREAD_PRIORITY_ABOVE_NORMAL,
+		[k_thread_priority_highest] = THREAD_PRIORITY_HIGHEST,
+	};
+	if (options->priority != k_thread_priority_normal && !SetThreadPriority(h, k_priorities[options->priority]))
+	{
+		debug_print(k_print_warning, "Thread failed to set priority!\n");
+	}
+}
+
+#else
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+enum
+{
+	// Linux thread names are limited to 16 bytes including the terminator.
+	k_thread_name_size = 16,
+};
+
+typedef struct thread_t
+{
+	pthread_t thread;
+	int (*function)(void*);
+	void* data;
+	int code;
+	thread_options_t options;
+	char name[k_thread_name_size];
+} thread_t;
+
+static void* thread_entry(void* user)
+{
+	thread_t* thread = user;
+	thread_set_current_options(&thread->options);
+	thread->code = thread->function(thread->data);
+	return NULL;
+}
+
+thread_t* thread_create(int (*function)(void*), void* data, const thread_options_t* options)
+{
+	thread_t* thread = malloc(sizeof(thread_t));
+	thread->function = function;
+	thread->data = data;
+	thread->code = 0;
+	memset(&thread->options, 0, sizeof(thread->options));
+	if (options)
+	{
+		thread->options = *options;
+		if (options->name)
+		{
+			strncpy(thread->name, options->name, sizeof(thread->name) - 1);
+			thread->name[sizeof(thread->name) - 1] = '\0';
+			thread->options.name = thread->name;
+		}
+	}
+	if (pthread_create(&thread->thread, NULL, thread_entry, thread) != 0)
+	{
+		debug_print(k_print_warning, "Thread failed to create!\n");
+		free(thread);
+		return NULL;
+	}
+	return thread;
+}
+
+int thread_destroy(thread_t* thread)
+{
+	pthread_join(thread->thread, NULL);
+	int code = thread->code;
+	free(thread);
+	return code;
+}
+
+void thread_set_current_options(const thread_options_t* options)
+{
+	if (!options)
+	{
+		return;
+	}
+
+	if (options->name)
+	{
+		char name[k_thread_name_size];
+		strncpy(name, options->name, sizeof(name) - 1);
+		name[sizeof(name) - 1] = '\0';
+		pthread_setname_np(pthread_self(), name);
+	}
+
+	if (options->affinity_mask)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int i = 0; i < 64; ++i)
+		{
+			if (options->affinity_mask & (1ULL << i))
+			{
+				CPU_SET(i, &set);
+			}
+		}
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		{
+			debug_print(k_print_warning, "Thread failed to set affinity mask!\n");
+		}
+	}
+
+	// Threads under the default scheduler are prioritized by nice value.
+	// Raising priority needs privileges the process may not have.
+	static const int k_nice_values[] =
+	{
+		[k_thread_priority_normal] = 0,
+		[k_thread_priority_low] = 5,
+		[k_thread_priority_high] = -5,
+		[k_thread_priority_highest] = -10,
+	};
+	if (options->priority != k_thread_priority_normal &&
+		setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), k_nice_values[options->priority]) != 0)
+	{
+		debug_print(k_print_warning, "Thread failed to set priority!\n");
+	}
+}
+
+bool thread_get_current_name(char* buffer, size_t size)
+{
+	char name[k_thread_name_size];
+	buffer[0] = '\0';
+	if (pthread_getname_np(pthread_self(), name, sizeof(name)) != 0)
+	{
+		return false;
+	}
+	strncpy(buffer, name, size - 1);
+	buffer[size - 1] = '\0';
+	return buffer[0] != '\0';
+}
+
+void thread_sleep(uint32_t ms)
+{
+	struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (long)(ms % 1000) * 1000000 };
+	while (nanosleep(&ts, &ts) != 0)
+	{
+	}
+}
+
+int thread_get_core_count()
+{
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int)count : 1;
+}
+
+#endif
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 // Threading support.
@@ -7,14 +9,46 @@
 // Handle to a thread.
 typedef struct thread_t thread_t;
 
+// Scheduling priority of a thread relative to others in the process.
+typedef enum thread_priority_t
+{
+	k_thread_priority_normal,
+	k_thread_priority_low,
+	k_thread_priority_high,
+	k_thread_priority_highest,
+} thread_priority_t;
+
+// Optional settings for a thread. Zero-initialize for defaults.
+typedef struct thread_options_t
+{
+	// Shown in debuggers, profilers and trace files. NULL for no name.
+	// Linux keeps only the first 15 characters.
+	const char* name;
+	// One bit per logical processor the thread may run on. Zero for any.
+	uint64_t affinity_mask;
+	thread_priority_t priority;
+} thread_options_t;
+
 // Creates a new thread.
 // Thread begins running function with data on return.
-thread_t* thread_create(int (*function)(void*), void* data);
+// Options may be NULL for defaults.
+thread_t* thread_create(int (*function)(void*), void* data, const thread_options_t* options);
 
 // Waits for a thread to complete and destroys it.
 // Returns the thread's exit code.
-int thread_destroy(thread);
+int thread_destroy(thread_t* thread);
+
+// Applies options to the calling thread.
+// For threads not started with thread_create, such as the main thread.
+void thread_set_current_options(const thread_options_t* options);
+
+// Copies the calling thread's name into buffer.
+// Returns false, leaving buffer empty, if the thread has no name.
+bool thread_get_current_name(char* buffer, size_t size);
 
 // Puts the calling thread to sleep for the specified number of milliseconds.
 // Thread will sleep for *approximately* the specified time.
 void thread_sleep(uint32_t ms);
+
+// Get the number of logical processors the OS schedules threads on.
+int thread_get_core_count();
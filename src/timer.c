@@ -1,7 +1,11 @@
 #include "timer.h"
 
+#if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#else
+#include <time.h>
+#endif
 
 static uint64_t s_ticks_start = 0;
 static double s_us_per_tick = 0.001;
@@ -28,14 +32,24 @@ uint32_t timer_ticks_to_ms(uint64_t t)
 
 uint64_t timer_get_ticks()
 {
+#if defined(_WIN32)
 	LARGE_INTEGER now;
 	QueryPerformanceCounter(&now);
 	return now.QuadPart - s_ticks_start;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec - s_ticks_start;
+#endif
 }
 
 uint64_t timer_get_ticks_per_second()
 {
+#if defined(_WIN32)
 	LARGE_INTEGER freq;
 	QueryPerformanceFrequency(&freq);
 	return freq.QuadPart;
+#else
+	return 1000000000ull;
+#endif
 }
@@ -1041,6 +1041,125 @@ void tlsf_remove_pool(tlsf_t tlsf, pool_t pool)
 	remove_free_block(control, block, fl, sl);
 }
 
+/* Locate the zero-size sentinel block at the end of a pool. */
+static block_header_t* pool_sentinel(pool_t pool, size_t pool_bytes)
+{
+	const size_t pool_used = align_down(pool_bytes - tlsf_pool_overhead(), ALIGN_SIZE);
+	return offset_to_block(pool, pool_used);
+}
+
+int tlsf_extend_pool(tlsf_t tlsf, pool_t pool, size_t pool_bytes, size_t bytes)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	block_header_t* block = pool_sentinel(pool, pool_bytes);
+	block_header_t* next;
+
+	if ((pool_bytes % ALIGN_SIZE) != 0 || (bytes % ALIGN_SIZE) != 0)
+	{
+		printf("tlsf_extend_pool: Sizes must be aligned by %u bytes.\n",
+			(unsigned int)ALIGN_SIZE);
+		return 0;
+	}
+
+	if (bytes < block_size_min + block_header_overhead)
+	{
+		printf("tlsf_extend_pool: Extension must be at least %u bytes.\n",
+			(unsigned int)(block_size_min + block_header_overhead));
+		return 0;
+	}
+
+	tlsf_assert(block_is_last(block) && "pool must end with the sentinel block");
+
+	/*
+	** The old sentinel becomes a free block spanning the new memory,
+	** followed by a new sentinel at the end.
+	*/
+	block_set_size(block, bytes - block_header_overhead);
+	block_set_free(block);
+
+	next = block_link_next(block);
+	block_set_size(next, 0);
+	block_set_used(next);
+	block_set_prev_free(next);
+
+	block = block_merge_prev(control, block);
+	block_insert(control, block);
+
+	return 1;
+}
+
+size_t tlsf_pool_free_tail(pool_t pool, size_t pool_bytes)
+{
+	const block_header_t* sentinel = pool_sentinel(pool, pool_bytes);
+	const block_header_t* first = offset_to_block(pool, -(int)block_header_overhead);
+	const block_header_t* block;
+
+	if (!block_is_prev_free(sentinel))
+	{
+		return 0;
+	}
+
+	/* The first block must remain so the pool stays valid. */
+	block = block_prev(sentinel);
+	if (block == first)
+	{
+		return block_size(block) - block_size_min;
+	}
+	return block_size(block) + block_header_overhead;
+}
+
+int tlsf_pool_is_free(pool_t pool, size_t pool_bytes)
+{
+	const block_header_t* sentinel = pool_sentinel(pool, pool_bytes);
+	const block_header_t* first = offset_to_block(pool, -(int)block_header_overhead);
+
+	/* Free blocks always merge, so a free pool is one block before the sentinel. */
+	return block_is_prev_free(sentinel) && block_prev(sentinel) == first;
+}
+
+int tlsf_shrink_pool(tlsf_t tlsf, pool_t pool, size_t pool_bytes, size_t bytes)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	block_header_t* sentinel = pool_sentinel(pool, pool_bytes);
+	block_header_t* block;
+	block_header_t* next;
+	size_t size;
+
+	if ((bytes % ALIGN_SIZE) != 0 || bytes > tlsf_pool_free_tail(pool, pool_bytes))
+	{
+		return 0;
+	}
+
+	block = block_prev(sentinel);
+	size = block_size(block);
+
+	if (size + block_header_overhead == bytes)
+	{
+		/* The whole block goes: it becomes the new sentinel. */
+		block_remove(control, block);
+		block_set_size(block, 0);
+		block_set_used(block);
+		return 1;
+	}
+
+	if (size < bytes + block_size_min)
+	{
+		return 0;
+	}
+
+	block_remove(control, block);
+	block_set_size(block, size - bytes);
+
+	next = block_link_next(block);
+	block_set_size(next, 0);
+	block_set_used(next);
+	block_set_prev_free(next);
+
+	block_insert(control, block);
+
+	return 1;
+}
+
 /*
 ** TLSF main interface.
 */
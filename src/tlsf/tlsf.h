@@ -59,6 +59,20 @@ pool_t tlsf_get_pool(tlsf_t tlsf);
 pool_t tlsf_add_pool(tlsf_t tlsf, void* mem, size_t bytes);
 void tlsf_remove_pool(tlsf_t tlsf, pool_t pool);
 
+/*
+** Grow or shrink a pool in place at its end.
+** pool_bytes is the pool's current size: the size passed to tlsf_add_pool
+** plus any changes since. Sizes must be multiples of tlsf_align_size.
+** Memory being added must directly follow the pool.
+** tlsf_pool_free_tail returns the most bytes the pool can shrink by.
+** tlsf_pool_is_free returns nonzero if no block in the pool is allocated.
+** The extend and shrink functions return nonzero on success.
+*/
+int tlsf_extend_pool(tlsf_t tlsf, pool_t pool, size_t pool_bytes, size_t bytes);
+size_t tlsf_pool_free_tail(pool_t pool, size_t pool_bytes);
+int tlsf_pool_is_free(pool_t pool, size_t pool_bytes);
+int tlsf_shrink_pool(tlsf_t tlsf, pool_t pool, size_t pool_bytes, size_t bytes);
+
 /* malloc/memalign/realloc/free replacements. */
 void* tlsf_malloc(tlsf_t tlsf, size_t bytes);
 void* tlsf_memalign(tlsf_t tlsf, size_t align, size_t bytes);
@@ -1,33 +1,697 @@
 #include "trace.h"
 
-#include <stddef.h>
+#include "atomic.h"
+#include "debug.h"
+#include "fs.h"
+#include "heap.h"
+#include "thread.h"
+#include "timer.h"
 
-trace_t* trace_create(heap_t* heap, int event_capacity)
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+enum
 {
-	return NULL;
+	k_trace_max_threads = 64,
+	k_trace_max_depth = 32,
+	k_trace_max_scopes = 256,
+	k_trace_max_event_json = 160,
+	k_trace_max_stats_csv = 192,
+	// Longest escape of one name character in JSON: \u00XX.
+	k_trace_max_json_escape = 6,
+};
+
+typedef enum trace_flags_t
+{
+	k_trace_flag_capture = 1 << 0,
+	k_trace_flag_stats = 1 << 1,
+} trace_flags_t;
+
+typedef enum trace_phase_t
+{
+	k_trace_phase_begin,
+	k_trace_phase_end,
+	k_trace_phase_counter,
+} trace_phase_t;
+
+typedef struct trace_event_t
+{
+	const char* name;
+	uint64_t ticks;
+	int64_t value;
+	trace_phase_t phase;
+} trace_event_t;
+
+// A duration that has been pushed but not yet popped.
+typedef struct trace_open_duration_t
+{
+	const char* name;
+	uint64_t ticks;
+} trace_open_duration_t;
+
+// Ring buffer of events recorded by a single thread.
+// Only the owning thread writes to it, so recording never waits on another thread.
+// The event is stored first and then published by bumping event_count.
+// Writing is set for the duration of each record, so a stopping capture can
+// wait for the thread to leave the ring before reading it.
+// Aligned to a cache line so neighboring threads do not share one.
+typedef struct __declspec(align(64)) trace_thread_t
+{
+	trace_event_t* events;
+	int event_count;
+	int writing;
+	uint32_t thread_id;
+	// Labels the thread's track in the Chrome trace; empty if the thread is unnamed.
+	char name[32];
+	int depth;
+	trace_open_duration_t stack[k_trace_max_depth];
+} trace_thread_t;
+
+// Timing for one named duration over one frame.
+typedef struct trace_sample_t
+{
+	uint64_t ticks;
+	uint64_t min_ticks;
+	uint64_t max_ticks;
+	int count;
+} trace_sample_t;
+
+// Aggregated timing for all durations sharing a name.
+// Any thread adds to the frame accumulators; trace_frame_end moves them
+// into the sample window, which only that thread touches.
+typedef struct trace_scope_t
+{
+	const char* name;
+	int64_t frame_ticks;
+	int64_t frame_min_ticks;
+	int64_t frame_max_ticks;
+	int frame_count;
+	trace_sample_t* samples;
+} trace_scope_t;
+
+typedef struct trace_t
+{
+	heap_t* heap;
+	fs_t* fs;
+	int event_capacity;
+	int flags;
+	int thread_count;
+	DWORD tls_index;
+	char path[1024];
+
+	void* file_buffer;
+	fs_work_t* file_work;
+
+	int stats_window;
+	int stats_frame;
+	uint64_t* stats_sort_buffer;
+	trace_scope_t scopes[k_trace_max_scopes];
+
+	// Threads beyond k_trace_max_threads are pointed here and record nothing.
+	trace_thread_t overflow_thread;
+	trace_thread_t threads[k_trace_max_threads];
+} trace_t;
+
+static void trace_record(trace_t* trace, const char* name, trace_phase_t phase, int64_t value);
+static trace_scope_t* trace_scope_find(trace_t* trace, const char* name, bool create);
+static void trace_scope_add(trace_t* trace, const char* name, uint64_t ticks);
+static void trace_scope_get_stats(trace_t* trace, trace_scope_t* scope, trace_stats_t* stats);
+static void trace_stats_free(trace_t* trace);
+static void trace_file_wait(trace_t* trace);
+static char* trace_write_json_string(char* cur, const char* text);
+
+trace_t* trace_create(heap_t* heap, fs_t* fs, int event_capacity)
+{
+	trace_t* trace = heap_alloc(heap, sizeof(trace_t), _Alignof(trace_t));
+	memset(trace, 0, sizeof(*trace));
+	trace->heap = heap;
+	trace->fs = fs;
+	trace->event_capacity = event_capacity;
+	trace->tls_index = TlsAlloc();
+	if (trace->tls_index == TLS_OUT_OF_INDEXES)
+	{
+		debug_print(k_print_error, "Trace failed to allocate thread local storage!\n");
+		heap_free(heap, trace);
+		return NULL;
+	}
+	return trace;
 }
 
 void trace_destroy(trace_t* trace)
 {
+	trace_capture_stop(trace);
+	trace_file_wait(trace);
+	trace_stats_free(trace);
 
+	int thread_count = __min(trace->thread_count, k_trace_max_threads);
+	for (int i = 0; i < thread_count; ++i)
+	{
+		if (trace->threads[i].events)
+		{
+			heap_free(trace->heap, trace->threads[i].events);
+		}
+	}
+
+	TlsFree(trace->tls_index);
+	heap_free(trace->heap, trace);
 }
 
 void trace_duration_push(trace_t* trace, const char* name)
 {
-
+	if (atomic_load(&trace->flags))
+	{
+		trace_record(trace, name, k_trace_phase_begin, 0);
+	}
 }
 
 void trace_duration_pop(trace_t* trace)
 {
+	if (atomic_load(&trace->flags))
+	{
+		trace_record(trace, NULL, k_trace_phase_end, 0);
+	}
+}
 
+void trace_counter(trace_t* trace, const char* name, int64_t value)
+{
+	if (atomic_load(&trace->flags) & k_trace_flag_capture)
+	{
+		trace_record(trace, name, k_trace_phase_counter, value);
+	}
 }
 
 void trace_capture_start(trace_t* trace, const char* path)
 {
+	if (atomic_load(&trace->flags) & k_trace_flag_capture)
+	{
+		debug_print(k_print_warning, "Trace capture already in progress!\n");
+		return;
+	}
+
+	trace_file_wait(trace);
 
+	strcpy_s(trace->path, sizeof(trace->path), path);
+
+	int thread_count = __min(atomic_load(&trace->thread_count), k_trace_max_threads);
+	for (int i = 0; i < thread_count; ++i)
+	{
+		atomic_store(&trace->threads[i].event_count, 0);
+	}
+
+	atomic_fetch_or_explicit(&trace->flags, k_trace_flag_capture, k_atomic_seq_cst);
+}
+
+bool trace_is_capturing(trace_t* trace)
+{
+	return (atomic_load(&trace->flags) & k_trace_flag_capture) != 0;
 }
 
 void trace_capture_stop(trace_t* trace)
 {
+	if (!(atomic_load(&trace->flags) & k_trace_flag_capture))
+	{
+		return;
+	}
+	atomic_fetch_and_explicit(&trace->flags, ~k_trace_flag_capture, k_atomic_seq_cst);
+
+	int thread_count = __min(atomic_load(&trace->thread_count), k_trace_max_threads);
+
+	// Threads that saw the capture flag before it cleared may still be adding an event.
+	for (int i = 0; i < thread_count; ++i)
+	{
+		while (atomic_load(&trace->threads[i].writing))
+		{
+			YieldProcessor();
+		}
+	}
+
+	trace_file_wait(trace);
+
+	static const char k_header[] = "{\n\t\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+	static const char k_footer[] = "\n\t]\n}\n";
+
+	// Size the output up front so it can be written in one pass.
+	// Names may grow when escaped, by at most k_trace_max_json_escape per character.
+	size_t capacity = sizeof(k_header) + sizeof(k_footer);
+	for (int i = 0; i < thread_count; ++i)
+	{
+		trace_thread_t* thread = &trace->threads[i];
+		capacity += k_trace_max_event_json + strlen(thread->name) * k_trace_max_json_escape;
+		int count = atomic_load(&thread->event_count);
+		for (int e = __max(0, count - trace->event_capacity); e < count; ++e)
+		{
+			trace_event_t* event = &thread->events[e % trace->event_capacity];
+			capacity += k_trace_max_event_json + (event->name ? strlen(event->name) * k_trace_max_json_escape : 0);
+		}
+	}
+
+	char* buffer = heap_alloc(trace->heap, capacity, 8);
+	char* cur = buffer;
+	const char* end = buffer + capacity;
+
+	memcpy(cur, k_header, sizeof(k_header) - 1);
+	cur += sizeof(k_header) - 1;
+
+	DWORD pid = GetCurrentProcessId();
+	bool first = true;
+	for (int i = 0; i < thread_count; ++i)
+	{
+		trace_thread_t* thread = &trace->threads[i];
+		if (thread->name[0])
+		{
+			cur += snprintf(cur, end - cur,
+				"%s\t\t{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":%u,\"args\":{\"name\":\"",
+				first ? "" : ",\n", pid, thread->thread_id);
+			cur = trace_write_json_string(cur, thread->name);
+			cur += snprintf(cur, end - cur, "\"}}");
+			first = false;
+		}
+		int count = atomic_load(&thread->event_count);
+		for (int e = __max(0, count - trace->event_capacity); e < count; ++e)
+		{
+			trace_event_t* event = &thread->events[e % trace->event_capacity];
+			unsigned long long us = timer_ticks_to_us(event->ticks);
+			if (event->phase == k_trace_phase_begin)
+			{
+				cur += snprintf(cur, end - cur, "%s\t\t{\"name\":\"", first ? "" : ",\n");
+				cur = trace_write_json_string(cur, event->name);
+				cur += snprintf(cur, end - cur,
+					"\",\"ph\":\"B\",\"pid\":%lu,\"tid\":%u,\"ts\":%llu}",
+					pid, thread->thread_id, us);
+			}
+			else if (event->phase == k_trace_phase_end)
+			{
+				cur += snprintf(cur, end - cur,
+					"%s\t\t{\"ph\":\"E\",\"pid\":%lu,\"tid\":%u,\"ts\":%llu}",
+					first ? "" : ",\n", pid, thread->thread_id, us);
+			}
+			else
+			{
+				cur += snprintf(cur, end - cur, "%s\t\t{\"name\":\"", first ? "" : ",\n");
+				cur = trace_write_json_string(cur, event->name);
+				cur += snprintf(cur, end - cur,
+					"\",\"ph\":\"C\",\"pid\":%lu,\"tid\":%u,\"ts\":%llu,\"args\":{\"value\":%lld}}",
+					pid, thread->thread_id, us, (long long)event->value);
+			}
+			first = false;
+		}
+	}
+
+	memcpy(cur, k_footer, sizeof(k_footer) - 1);
+	cur += sizeof(k_footer) - 1;
+
+	trace->file_buffer = buffer;
+	trace->file_work = fs_write(trace->fs, trace->path, buffer, cur - buffer, false);
+}
+
+void trace_stats_start(trace_t* trace, int frame_window)
+{
+	if (atomic_load(&trace->flags) & k_trace_flag_stats)
+	{
+		debug_print(k_print_warning, "Trace stats already in progress!\n");
+		return;
+	}
+
+	trace_stats_free(trace);
+
+	memset(trace->scopes, 0, sizeof(trace->scopes));
+	for (int i = 0; i < k_trace_max_scopes; ++i)
+	{
+		trace->scopes[i].frame_min_ticks = INT64_MAX;
+	}
+
+	int thread_count = __min(atomic_load(&trace->thread_count), k_trace_max_threads);
+	for (int i = 0; i < thread_count; ++i)
+	{
+		trace->threads[i].depth = 0;
+	}
+
+	trace->stats_window = frame_window;
+	trace->stats_frame = 0;
+	trace->stats_sort_buffer = heap_alloc(trace->heap, sizeof(uint64_t) * frame_window, 8);
+
+	atomic_fetch_or_explicit(&trace->flags, k_trace_flag_stats, k_atomic_seq_cst);
+}
+
+void trace_stats_stop(trace_t* trace)
+{
+	atomic_fetch_and_explicit(&trace->flags, ~k_trace_flag_stats, k_atomic_seq_cst);
+}
+
+bool trace_stats_is_running(trace_t* trace)
+{
+	return (atomic_load(&trace->flags) & k_trace_flag_stats) != 0;
+}
+
+void trace_frame_end(trace_t* trace)
+{
+	if (!(atomic_load(&trace->flags) & k_trace_flag_stats))
+	{
+		return;
+	}
+
+	int slot = trace->stats_frame % trace->stats_window;
+	for (int i = 0; i < k_trace_max_scopes; ++i)
+	{
+		trace_scope_t* scope = &trace->scopes[i];
+		if (!atomic_load_pointer_explicit((void**)&scope->name, k_atomic_acquire))
+		{
+			continue;
+		}
+		if (!scope->samples)
+		{
+			scope->samples = heap_alloc(trace->heap, sizeof(trace_sample_t) * trace->stats_window, 8);
+			memset(scope->samples, 0, sizeof(trace_sample_t) * trace->stats_window);
+		}
+
+		trace_sample_t* sample = &scope->samples[slot];
+		// The accumulators are independent counters; no ordering is needed between them.
+		sample->ticks = atomic_exchange64_explicit(&scope->frame_ticks, 0, k_atomic_relaxed);
+		sample->count = atomic_exchange_explicit(&scope->frame_count, 0, k_atomic_relaxed);
+		int64_t min = atomic_exchange64_explicit(&scope->frame_min_ticks, INT64_MAX, k_atomic_relaxed);
+		sample->min_ticks = min == INT64_MAX ? 0 : min;
+		sample->max_ticks = atomic_exchange64_explicit(&scope->frame_max_ticks, 0, k_atomic_relaxed);
+	}
+	trace->stats_frame++;
+}
+
+bool trace_stats_get(trace_t* trace, const char* name, trace_stats_t* stats)
+{
+	trace_scope_t* scope = trace->stats_sort_buffer ? trace_scope_find(trace, name, false) : NULL;
+	if (!scope || !scope->samples)
+	{
+		return false;
+	}
+	trace_scope_get_stats(trace, scope, stats);
+	return true;
+}
+
+int trace_stats_get_all(trace_t* trace, trace_stats_t* stats, int capacity)
+{
+	int count = 0;
+	for (int i = 0; i < k_trace_max_scopes && count < capacity; ++i)
+	{
+		if (trace->scopes[i].samples)
+		{
+			trace_scope_get_stats(trace, &trace->scopes[i], &stats[count++]);
+		}
+	}
+	return count;
+}
+
+void trace_stats_write_csv(trace_t* trace, const char* path)
+{
+	static const char k_header[] = "name,frames,count,total_us,min_us,max_us,p50_us,p95_us,p99_us\n";
+
+	trace_file_wait(trace);
+
+	size_t capacity = sizeof(k_header);
+	for (int i = 0; i < k_trace_max_scopes; ++i)
+	{
+		if (trace->scopes[i].samples)
+		{
+			capacity += k_trace_max_stats_csv + strlen(trace->scopes[i].name);
+		}
+	}
+
+	char* buffer = heap_alloc(trace->heap, capacity, 8);
+	char* cur = buffer;
+	const char* end = buffer + capacity;
+
+	memcpy(cur, k_header, sizeof(k_header) - 1);
+	cur += sizeof(k_header) - 1;
+
+	for (int i = 0; i < k_trace_max_scopes; ++i)
+	{
+		if (trace->scopes[i].samples)
+		{
+			trace_stats_t stats;
+			trace_scope_get_stats(trace, &trace->scopes[i], &stats);
+			cur += snprintf(cur, end - cur, "%s,%d,%d,%llu,%llu,%llu,%llu,%llu,%llu\n",
+				stats.name, stats.frame_count, stats.count,
+				(unsigned long long)stats.total_us,
+				(unsigned long long)stats.min_us,
+				(unsigned long long)stats.max_us,
+				(unsigned long long)stats.p50_us,
+				(unsigned long long)stats.p95_us,
+				(unsigned long long)stats.p99_us);
+		}
+	}
+
+	trace->file_buffer = buffer;
+	trace->file_work = fs_write(trace->fs, path, buffer, cur - buffer, false);
+}
+
+static trace_thread_t* trace_get_thread(trace_t* trace)
+{
+	trace_thread_t* thread = TlsGetValue(trace->tls_index);
+	if (!thread)
+	{
+		// Claim the slot before allocating: the heap may report counters to
+		// this trace, which would otherwise recurse back in here.
+		int index = atomic_increment(&trace->thread_count);
+		if (index < k_trace_max_threads)
+		{
+			thread = &trace->threads[index];
+			thread->thread_id = GetCurrentThreadId();
+			thread_get_current_name(thread->name, sizeof(thread->name));
+			TlsSetValue(trace->tls_index, thread);
+			thread->events = heap_alloc(trace->heap, sizeof(trace_event_t) * trace->event_capacity, 8);
+		}
+		else
+		{
+			debug_print(k_print_warning, "Trace out of thread slots!\n");
+			thread = &trace->overflow_thread;
+			TlsSetValue(trace->tls_index, thread);
+		}
+	}
+	return thread;
+}
+
+static void trace_record(trace_t* trace, const char* name, trace_phase_t phase, int64_t value)
+{
+	trace_thread_t* thread = trace_get_thread(trace);
+	if (!thread->events)
+	{
+		return;
+	}
+
+	// Pairs with trace_capture_stop: either this sees the capture flag
+	// cleared, or the stop sees this thread writing and waits for it.
+	atomic_exchange(&thread->writing, 1);
+	uint64_t ticks = timer_get_ticks();
+	int flags = atomic_load_explicit(&trace->flags, k_atomic_seq_cst);
+
+	if (flags & k_trace_flag_capture)
+	{
+		trace_event_t* event = &thread->events[thread->event_count % trace->event_capacity];
+		event->name = name;
+		event->ticks = ticks;
+		event->value = value;
+		event->phase = phase;
+		atomic_store(&thread->event_count, thread->event_count + 1);
+	}
+
+	if (flags & k_trace_flag_stats)
+	{
+		if (phase == k_trace_phase_begin)
+		{
+			if (thread->depth < k_trace_max_depth)
+			{
+				thread->stack[thread->depth].name = name;
+				thread->stack[thread->depth].ticks = ticks;
+			}
+			thread->depth++;
+		}
+		else if (phase == k_trace_phase_end && thread->depth > 0)
+		{
+			thread->depth--;
+			if (thread->depth < k_trace_max_depth)
+			{
+				trace_open_duration_t* open = &thread->stack[thread->depth];
+				trace_scope_add(trace, open->name, ticks - open->ticks);
+			}
+		}
+	}
+
+	atomic_store(&thread->writing, 0);
+}
+
+static uint32_t trace_hash_name(const char* name)
+{
+	uint32_t hash = 2166136261u;
+	for (const char* c = name; *c; ++c)
+	{
+		hash = (hash ^ (uint8_t)*c) * 16777619u;
+	}
+	return hash;
+}
+
+static trace_scope_t* trace_scope_find(trace_t* trace, const char* name, bool create)
+{
+	uint32_t hash = trace_hash_name(name);
+	for (int i = 0; i < k_trace_max_scopes; ++i)
+	{
+		trace_scope_t* scope = &trace->scopes[(hash + i) % k_trace_max_scopes];
+		const char* existing = atomic_load_pointer_explicit((void**)&scope->name, k_atomic_acquire);
+		if (!existing)
+		{
+			if (!create)
+			{
+				return NULL;
+			}
+			existing = atomic_compare_and_exchange_pointer_explicit((void**)&scope->name, NULL, (void*)name, k_atomic_acq_rel);
+			if (!existing)
+			{
+				return scope;
+			}
+		}
+		if (existing == name || strcmp(existing, name) == 0)
+		{
+			return scope;
+		}
+	}
+	return NULL;
+}
+
+static void trace_scope_add(trace_t* trace, const char* name, uint64_t ticks)
+{
+	trace_scope_t* scope = trace_scope_find(trace, name, true);
+	if (!scope)
+	{
+		return;
+	}
+
+	atomic_fetch_add64_explicit(&scope->frame_ticks, (int64_t)ticks, k_atomic_relaxed);
+	atomic_fetch_add_explicit(&scope->frame_count, 1, k_atomic_relaxed);
+
+	int64_t min = atomic_load64_explicit(&scope->frame_min_ticks, k_atomic_relaxed);
+	while ((int64_t)ticks < min)
+	{
+		int64_t old_min = atomic_compare_and_exchange64_explicit(&scope->frame_min_ticks, min, (int64_t)ticks, k_atomic_relaxed);
+		if (old_min == min)
+		{
+			break;
+		}
+		min = old_min;
+	}
+	int64_t max = atomic_load64_explicit(&scope->frame_max_ticks, k_atomic_relaxed);
+	while ((int64_t)ticks > max)
+	{
+		int64_t old_max = atomic_compare_and_exchange64_explicit(&scope->frame_max_ticks, max, (int64_t)ticks, k_atomic_relaxed);
+		if (old_max == max)
+		{
+			break;
+		}
+		max = old_max;
+	}
+}
+
+static int trace_compare_ticks(const void* a, const void* b)
+{
+	uint64_t ta = *(const uint64_t*)a;
+	uint64_t tb = *(const uint64_t*)b;
+	return ta < tb ? -1 : (ta > tb ? 1 : 0);
+}
+
+static void trace_scope_get_stats(trace_t* trace, trace_scope_t* scope, trace_stats_t* stats)
+{
+	int frame_count = __min(trace->stats_frame, trace->stats_window);
+
+	memset(stats, 0, sizeof(*stats));
+	stats->name = scope->name;
+	stats->frame_count = frame_count;
+
+	uint64_t total = 0;
+	uint64_t min = UINT64_MAX;
+	uint64_t max = 0;
+	for (int i = 0; i < frame_count; ++i)
+	{
+		trace_sample_t* sample = &scope->samples[i];
+		total += sample->ticks;
+		stats->count += sample->count;
+		if (sample->count)
+		{
+			min = __min(min, sample->min_ticks);
+			max = __max(max, sample->max_ticks);
+		}
+		trace->stats_sort_buffer[i] = sample->ticks;
+	}
+
+	if (frame_count == 0)
+	{
+		return;
+	}
+
+	qsort(trace->stats_sort_buffer, frame_count, sizeof(uint64_t), trace_compare_ticks);
+
+	stats->total_us = timer_ticks_to_us(total);
+	stats->min_us = stats->count ? timer_ticks_to_us(min) : 0;
+	stats->max_us = timer_ticks_to_us(max);
+	stats->p50_us = timer_ticks_to_us(trace->stats_sort_buffer[(frame_count - 1) * 50 / 100]);
+	stats->p95_us = timer_ticks_to_us(trace->stats_sort_buffer[(frame_count - 1) * 95 / 100]);
+	stats->p99_us = timer_ticks_to_us(trace->stats_sort_buffer[(frame_count - 1) * 99 / 100]);
+}
 
+static void trace_stats_free(trace_t* trace)
+{
+	for (int i = 0; i < k_trace_max_scopes; ++i)
+	{
+		if (trace->scopes[i].samples)
+		{
+			heap_free(trace->heap, trace->scopes[i].samples);
+			trace->scopes[i].samples = NULL;
+		}
+	}
+	if (trace->stats_sort_buffer)
+	{
+		heap_free(trace->heap, trace->stats_sort_buffer);
+		trace->stats_sort_buffer = NULL;
+	}
+}
+
+static void trace_file_wait(trace_t* trace)
+{
+	if (trace->file_work)
+	{
+		fs_work_destroy(trace->file_work);
+		heap_free(trace->heap, trace->file_buffer);
+		trace->file_work = NULL;
+		trace->file_buffer = NULL;
+	}
+}
+
+// Copy text into a JSON string, escaping quotes, backslashes and control characters.
+// The caller sizes the buffer for k_trace_max_json_escape characters per input character.
+static char* trace_write_json_string(char* cur, const char* text)
+{
+	static const char k_hex[] = "0123456789abcdef";
+	for (const char* c = text; *c; ++c)
+	{
+		uint8_t ch = (uint8_t)*c;
+		if (ch == '"' || ch == '\\')
+		{
+			*cur++ = '\\';
+			*cur++ = (char)ch;
+		}
+		else if (ch < 0x20)
+		{
+			*cur++ = '\\';
+			*cur++ = 'u';
+			*cur++ = '0';
+			*cur++ = '0';
+			*cur++ = k_hex[ch >> 4];
+			*cur++ = k_hex[ch & 0xf];
+		}
+		else
+		{
+			*cur++ = (char)ch;
+		}
+	}
+	return cur;
 }
@@ -1,26 +1,98 @@
 #pragma once
 
+// CPU Performance Tracing
+//
+// Main object, trace_t, records named durations on any thread.
+// Events are captured into per-thread ring buffers and written
+// out as a Chrome trace file (chrome://tracing) when capture stops.
+// Tracks are labeled with thread names set through thread options.
+// Durations can also be aggregated by name into per-frame statistics.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct fs_t fs_t;
 typedef struct heap_t heap_t;
 
+// Handle to a tracing system.
 typedef struct trace_t trace_t;
 
+// Aggregated timing for all durations with the same name over the stats window.
+// Percentiles are of the total time spent in the duration per frame.
+typedef struct trace_stats_t
+{
+	const char* name;
+	int frame_count;
+	int count;
+	uint64_t total_us;
+	uint64_t min_us;
+	uint64_t max_us;
+	uint64_t p50_us;
+	uint64_t p95_us;
+	uint64_t p99_us;
+} trace_stats_t;
+
 // Creates a CPU performance tracing system.
-// Event capacity is the maximum number of durations that can be traced.
-trace_t* trace_create(heap_t* heap, int event_capacity);
+// Event capacity is the maximum number of durations that can be traced per thread.
+// If capacity is exceeded, the oldest events on that thread are overwritten.
+// Trace files are written using the provided file system.
+trace_t* trace_create(heap_t* heap, fs_t* fs, int event_capacity);
 
 // Destroys a CPU performance tracing system.
+// Waits for any pending trace file write to complete.
 void trace_destroy(trace_t* trace);
 
 // Begin tracing a named duration on the current thread.
 // It is okay to nest multiple durations at once.
+// Name must remain valid until the capture is stopped.
 void trace_duration_push(trace_t* trace, const char* name);
 
 // End tracing the currently active duration on the current thread.
 void trace_duration_pop(trace_t* trace);
 
+// Record the current value of a named counter.
+// Counters appear as tracks alongside durations in the Chrome trace.
+// Only recorded while a capture is in progress.
+// Name must remain valid until the capture is stopped.
+void trace_counter(trace_t* trace, const char* name, int64_t value);
+
 // Start recording trace events.
 // A Chrome trace file will be written to path.
 void trace_capture_start(trace_t* trace, const char* path);
 
+// Determine if a capture is in progress.
+// Lets callers skip gathering counter values that would not be recorded.
+bool trace_is_capturing(trace_t* trace);
+
 // Stop recording trace events.
+// The Chrome trace file is written asynchronously.
 void trace_capture_stop(trace_t* trace);
+
+// Start aggregating durations by name into per-frame statistics.
+// Statistics cover the most recent frame_window frames.
+// Durations nested deeper than 32 on a thread are not aggregated.
+void trace_stats_start(trace_t* trace, int frame_window);
+
+// Stop aggregating durations.
+// Statistics gathered so far remain available to query.
+void trace_stats_stop(trace_t* trace);
+
+// Determine if durations are being aggregated into statistics.
+bool trace_stats_is_running(trace_t* trace);
+
+// Mark the end of a frame.
+// Durations completed since the last call are added to the statistics window.
+// Call once per frame from a single thread; query statistics from that thread.
+void trace_frame_end(trace_t* trace);
+
+// Get the statistics for all durations with the given name.
+// Returns false if no such duration has been recorded.
+bool trace_stats_get(trace_t* trace, const char* name, trace_stats_t* stats);
+
+// Get the statistics for every recorded duration name.
+// Fills at most capacity entries and returns the number filled.
+int trace_stats_get_all(trace_t* trace, trace_stats_t* stats, int capacity);
+
+// Write the statistics for every recorded duration name as CSV to path.
+// The file is written asynchronously.
+void trace_stats_write_csv(trace_t* trace, const char* path);
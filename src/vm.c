@@ -0,0 +1,159 @@
+#include "vm.h"
+
+#if defined(_WIN32)
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+
+size_t vm_page_size()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+}
+
+void* vm_reserve(size_t size)
+{
+	return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+void vm_release(void* address, size_t size)
+{
+	VirtualFree(address, 0, MEM_RELEASE);
+}
+
+bool vm_commit(void* address, size_t size)
+{
+	return VirtualAlloc(address, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+}
+
+void vm_decommit(void* address, size_t size)
+{
+	VirtualFree(address, size, MEM_DECOMMIT);
+}
+
+size_t vm_huge_page_size()
+{
+	return GetLargePageMinimum();
+}
+
+// Large pages require the lock memory privilege to be enabled on the process token.
+// The account must already hold the privilege; this only turns it on.
+static bool vm_enable_lock_memory_privilege()
+{
+	HANDLE token;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+	{
+		return false;
+	}
+
+	TOKEN_PRIVILEGES privileges = { 0 };
+	privileges.PrivilegeCount = 1;
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	bool result = LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+		AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) &&
+		GetLastError() == ERROR_SUCCESS;
+
+	CloseHandle(token);
+	return result;
+}
+
+void* vm_alloc_huge(size_t size)
+{
+	static bool s_privilege_enabled = false;
+	if (!s_privilege_enabled)
+	{
+		s_privilege_enabled = vm_enable_lock_memory_privilege();
+		if (!s_privilege_enabled)
+		{
+			return NULL;
+		}
+	}
+	return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+}
+
+void vm_advise_huge(void* address, size_t size)
+{
+	// Windows has no transparent huge pages.
+}
+
+size_t vm_resident_bytes()
+{
+	PROCESS_MEMORY_COUNTERS counters = { .cb = sizeof(counters) };
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+	{
+		return 0;
+	}
+	return counters.WorkingSetSize;
+}
+
+#else
+
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+size_t vm_page_size()
+{
+	return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+void* vm_reserve(size_t size)
+{
+	void* address = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return address != MAP_FAILED ? address : NULL;
+}
+
+void vm_release(void* address, size_t size)
+{
+	munmap(address, size);
+}
+
+bool vm_commit(void* address, size_t size)
+{
+	return mprotect(address, size, PROT_READ | PROT_WRITE) == 0;
+}
+
+void vm_decommit(void* address, size_t size)
+{
+	// Drop the pages, then make the range inaccessible again.
+	madvise(address, size, MADV_DONTNEED);
+	mprotect(address, size, PROT_NONE);
+}
+
+size_t vm_huge_page_size()
+{
+	// The default huge page size on x86-64.
+	return 2 * 1024 * 1024;
+}
+
+void* vm_alloc_huge(size_t size)
+{
+	// Fails unless the administrator has set aside huge pages (vm.nr_hugepages).
+	void* address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	return address != MAP_FAILED ? address : NULL;
+}
+
+void vm_advise_huge(void* address, size_t size)
+{
+	// Transparent huge pages; ignored if disabled in the kernel.
+	madvise(address, size, MADV_HUGEPAGE);
+}
+
+size_t vm_resident_bytes()
+{
+	// Second field of statm is the resident page count.
+	FILE* file = fopen("/proc/self/statm", "r");
+	if (!file)
+	{
+		return 0;
+	}
+	size_t total = 0;
+	size_t resident = 0;
+	int fields = fscanf(file, "%zu %zu", &total, &resident);
+	fclose(file);
+	return fields == 2 ? resident * vm_page_size() : 0;
+}
+
+#endif
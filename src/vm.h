@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Virtual Memory
+//
+// Thin wrapper over the OS virtual memory interface.
+// Address space is reserved up front, then pages are committed and
+// decommitted within it as needed. Sizes and addresses must be page aligned.
+
+// Get the size of an OS page in bytes.
+size_t vm_page_size();
+
+// Reserve a range of address space without backing it with memory.
+// Returns NULL on failure.
+void* vm_reserve(size_t size);
+
+// Release a range of address space previously reserved with vm_reserve.
+// Size must match the size that was reserved.
+void vm_release(void* address, size_t size);
+
+// Back pages within a reserved range with zeroed, writable memory.
+// Returns false if the OS is out of memory.
+bool vm_commit(void* address, size_t size);
+
+// Return the memory backing pages within a reserved range to the OS.
+// The address space remains reserved.
+void vm_decommit(void* address, size_t size);
+
+// Get the size of an OS huge page in bytes, or zero if not supported.
+size_t vm_huge_page_size();
+
+// Reserve and commit a range backed by huge pages.
+// Size must be a multiple of the huge page size. The range cannot be
+// decommitted; release it with vm_release.
+// Returns NULL if huge pages are unavailable, for instance when the OS has
+// none free or the process lacks permission to lock memory.
+void* vm_alloc_huge(size_t size);
+
+// Hint that a reserved range should be backed by huge pages where possible.
+// Used as a fallback when vm_alloc_huge fails. Does nothing on some platforms.
+void vm_advise_huge(void* address, size_t size);
+
+// Get the number of bytes of the process resident in physical memory.
+// Covers every allocator in the process, not just ranges reserved here.
+size_t vm_resident_bytes();
@@ -34,6 +34,8 @@ k_key_map[] =
 	{ .virtual_key = VK_RIGHT, .ga_key = k_key_right, },
 	{ .virtual_key = VK_UP, .ga_key = k_key_up, },
 	{ .virtual_key = VK_DOWN, .ga_key = k_key_down, },
+	{ .virtual_key = VK_F11, .ga_key = k_key_f11, },
+	{ .virtual_key = VK_F12, .ga_key = k_key_f12, },
 };
 
 static LRESULT CALLBACK _window_proc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)